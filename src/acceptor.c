@@ -0,0 +1,424 @@
+/* $Id$
+ *
+ * The central acceptor (AcceptQueue). Instead of letting the children
+ * race for new connections on the listening sockets, the parent accepts
+ * them, keeps them in a FIFO queue and passes each one to an idle child
+ * over a unix domain socket pair (SCM_RIGHTS). Every child gets a pair of
+ * its own, created right before the fork.
+ *
+ * A child reports every finished connection back over its channel, so
+ * the parent always knows which children are able to take another one.
+ * Connections go to the most recently used idle child, whose memory is
+ * most likely still warm, and the least recently used ones are retired
+ * when there are more than MaxSpareServers idle children. If the queue
+ * is full, new connections are refused right away with a 503.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include "acceptor.h"
+#include "log.h"
+#include "sock.h"
+#include "stats.h"
+#include "utils.h"
+
+/* maximum number of connections accepted with a single wakeup */
+#define ACCEPTOR_BATCH 64
+
+struct channel_s {
+  int fd;			/* parent end of the socket pair or -1 */
+  int busy;			/* connections passed, but not finished */
+  unsigned int passed;		/* connections passed in total */
+  int full;			/* the channel took no more, wait for POLLOUT */
+  long last_used;		/* monotonic ms of the last activity */
+};
+
+static struct acceptor_s {
+  int qlen;			/* AcceptQueue */
+  int head, count;
+  int *queue;
+  long *since;			/* monotonic ms the connection was queued */
+
+  int nchannels;
+  struct channel_s *channels;
+  int capacity;			/* connections a child takes at once */
+  unsigned int maxrequests;	/* MaxRequestsPerChild */
+  int maxspare;			/* MaxSpareServers */
+
+  int child_fd;			/* child end of the latest socket pair */
+} acceptor = {
+.qlen = 0,.channels = NULL,.child_fd = -1};
+
+static const char refused[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Connection: close\r\n\r\n" "Too many connections, try again later.\r\n";
+
+/*
+ * Set up the acceptor for "nchannels" children taking "capacity"
+ * connections each. Nothing happens unless AcceptQueue is set.
+ */
+int acceptor_init(int nchannels, int capacity, unsigned int maxrequests,
+		  int maxspare)
+{
+  int i;
+
+  if (config.acceptqueue <= 0)
+    return 0;
+
+  acceptor.queue = calloc(config.acceptqueue, sizeof(int));
+  acceptor.since = calloc(config.acceptqueue, sizeof(long));
+  acceptor.channels = calloc(nchannels, sizeof(struct channel_s));
+  if (!acceptor.queue || !acceptor.since || !acceptor.channels) {
+    free(acceptor.queue);
+    free(acceptor.since);
+    free(acceptor.channels);
+    acceptor.channels = NULL;
+    return -1;
+  }
+
+  for (i = 0; i != nchannels; i++)
+    acceptor.channels[i].fd = -1;
+
+  acceptor.qlen = config.acceptqueue;
+  acceptor.head = acceptor.count = 0;
+  acceptor.nchannels = nchannels;
+  acceptor.capacity = max(capacity, 1);
+  acceptor.maxrequests = maxrequests;
+  acceptor.maxspare = maxspare;
+
+  return 0;
+}
+
+int acceptor_enabled(void)
+{
+  return acceptor.qlen > 0;
+}
+
+/*
+ * Number of connections waiting in the queue
+ */
+int acceptor_queued(void)
+{
+  return acceptor.count;
+}
+
+static void channel_close(struct channel_s *chan)
+{
+  if (chan->fd != -1)
+    close(chan->fd);
+  chan->fd = -1;
+  chan->busy = 0;
+  chan->full = FALSE;
+}
+
+/*
+ * Create the channel for the child about to be started in "slot". Called
+ * by the parent right before the fork.
+ */
+int acceptor_channel(int slot)
+{
+  struct channel_s *chan;
+  int pair[2];
+
+  if (!acceptor_enabled())
+    return 0;
+
+  chan = &acceptor.channels[slot];
+  channel_close(chan);
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == -1) {
+    log_message(LOG_ERR, "acceptor_channel: socketpair() %s",
+		strerror(errno));
+    return -1;
+  }
+
+  socket_nonblocking(pair[0]);
+  chan->fd = pair[0];
+  chan->passed = 0;
+  chan->last_used = 0;
+  acceptor.child_fd = pair[1];
+
+  return 0;
+}
+
+/*
+ * The parent is done with forking the child in "slot", "pid" is the
+ * return value of fork().
+ */
+void acceptor_forked(int slot, pid_t pid)
+{
+  if (!acceptor_enabled())
+    return;
+
+  close(acceptor.child_fd);
+  acceptor.child_fd = -1;
+
+  if (pid < 0)
+    channel_close(&acceptor.channels[slot]);
+}
+
+/*
+ * Close the queued connections and the parent ends of all channels in a
+ * process forked from the parent.
+ */
+void acceptor_release(void)
+{
+  int i;
+
+  if (!acceptor_enabled())
+    return;
+
+  for (i = 0; i != acceptor.count; i++)
+    close(acceptor.queue[(acceptor.head + i) % acceptor.qlen]);
+  acceptor.count = 0;
+
+  for (i = 0; i != acceptor.nchannels; i++) {
+    if (acceptor.channels[i].fd != -1)
+      close(acceptor.channels[i].fd);
+  }
+  free(acceptor.channels);
+  acceptor.channels = NULL;
+}
+
+/*
+ * Called in the new child: drop everything belonging to the parent and
+ * take the connections from the channel from now on.
+ */
+void acceptor_child(void)
+{
+  if (!acceptor_enabled())
+    return;
+
+  acceptor_release();
+  listeners_use_channel(acceptor.child_fd);
+}
+
+/*
+ * Called in a child: "n" connections passed in by the acceptor are
+ * finished.
+ */
+void acceptor_done(int n)
+{
+  if (acceptor.child_fd == -1 || n <= 0)
+    return;
+
+  send(acceptor.child_fd, &n, sizeof(n), MSG_NOSIGNAL);
+}
+
+/*
+ * Queue a new connection or refuse it if the queue is full.
+ */
+static void acceptor_enqueue(int fd, long now)
+{
+  int tail;
+
+  if (acceptor.count == acceptor.qlen) {
+    send(fd, refused, sizeof(refused) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    update_stats(STAT_REFUSE);
+    return;
+  }
+
+  tail = (acceptor.head + acceptor.count) % acceptor.qlen;
+  acceptor.queue[tail] = fd;
+  acceptor.since[tail] = now;
+  acceptor.count++;
+}
+
+/*
+ * A child is able to take another connection if it has spare capacity
+ * and will not exit because of MaxRequestsPerChild before handling it.
+ */
+static int channel_ready(struct channel_s *chan)
+{
+  return chan->fd != -1 && !chan->full && chan->busy < acceptor.capacity
+      && (acceptor.maxrequests == 0 || chan->passed < acceptor.maxrequests);
+}
+
+/*
+ * Pass the queued connections to the most recently used idle children.
+ * A channel without room for another connection is left alone until it
+ * is writable again, the connection goes to the next child or waits.
+ */
+static void acceptor_dispatch(long now)
+{
+  struct channel_s *chan, *best;
+  int i, fd;
+
+  while (acceptor.count) {
+    best = NULL;
+    for (i = 0; i != acceptor.nchannels; i++) {
+      chan = &acceptor.channels[i];
+      if (channel_ready(chan) && (!best || chan->last_used > best->last_used))
+	best = chan;
+    }
+    if (!best)
+      return;
+
+    fd = acceptor.queue[acceptor.head];
+    if (send_sock(best->fd, fd) < 0) {
+      if (errno == EPIPE || errno == ECONNRESET) {
+	/* the child is gone */
+	log_message(LOG_WARNING, "Could not pass connection to child: %s",
+		    strerror(errno));
+	channel_close(best);
+      } else {
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+	  log_message(LOG_WARNING, "Could not pass connection to child: %s",
+		      strerror(errno));
+	best->full = TRUE;
+      }
+      continue;
+    }
+
+    stats_queued(now - acceptor.since[acceptor.head]);
+    close(fd);
+    acceptor.head = (acceptor.head + 1) % acceptor.qlen;
+    acceptor.count--;
+
+    best->busy++;
+    best->passed++;
+    best->last_used = now;
+  }
+}
+
+/*
+ * Retire the least recently used idle children as long as there are
+ * more than MaxSpareServers of them. Only the parent retires children,
+ * so no connection is ever passed to a child which is about to leave.
+ */
+static void acceptor_retire(void)
+{
+  struct channel_s *chan, *lru;
+  int i, idle;
+
+  for (;;) {
+    lru = NULL;
+    idle = 0;
+    for (i = 0; i != acceptor.nchannels; i++) {
+      chan = &acceptor.channels[i];
+      if (chan->fd == -1 || chan->busy || !channel_ready(chan))
+	continue;
+      idle++;
+      if (!lru || chan->last_used < lru->last_used)
+	lru = chan;
+    }
+    if (idle <= acceptor.maxspare)
+      return;
+
+    log_message(LOG_NOTICE,
+		"Idle servers (%d) exceed MaxSpareServers (%d). Retiring child.",
+		idle, acceptor.maxspare);
+    channel_close(lru);
+  }
+}
+
+/*
+ * Read the finished connections reported by a child.
+ */
+static void channel_read(struct channel_s *chan, long now)
+{
+  int n;
+  ssize_t len;
+
+  while ((len = recv(chan->fd, &n, sizeof(n), MSG_DONTWAIT)) > 0) {
+    if (len == sizeof(n))
+      chan->busy = max(chan->busy - n, 0);
+    chan->last_used = now;
+  }
+
+  /* the child is gone */
+  if (len == 0 || (errno != EAGAIN && errno != EINTR))
+    channel_close(chan);
+}
+
+/*
+ * The main loop of the acceptor. Accept and dispatch connections until
+ * "timeout" ms have passed or "notify_fd" becomes readable.
+ */
+void acceptor_run(int notify_fd, int timeout)
+{
+  struct channel_s *chan;
+  struct pollfd *fds;
+  int *slots;
+  int i, n, nfds, nlisteners;
+  int conns[ACCEPTOR_BATCH];
+  long now, deadline = monotonic_ms() + timeout;
+
+  fds = calloc(1 + listeners_total() + acceptor.nchannels,
+	       sizeof(struct pollfd));
+  slots = calloc(acceptor.nchannels, sizeof(int));
+  if (!fds || !slots) {
+    free(fds);
+    free(slots);
+    poll(NULL, 0, timeout);
+    return;
+  }
+
+  for (;;) {
+    fds[0].fd = notify_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+
+    nlisteners = listeners_pollfds(&fds[1], listeners_total());
+    nfds = 1 + nlisteners;
+
+    for (i = n = 0; i != acceptor.nchannels; i++) {
+      if (acceptor.channels[i].fd == -1)
+	continue;
+      fds[nfds].fd = acceptor.channels[i].fd;
+      fds[nfds].events = acceptor.channels[i].full ? POLLIN | POLLOUT : POLLIN;
+      fds[nfds].revents = 0;
+      slots[n++] = i;
+      nfds++;
+    }
+
+    now = monotonic_ms();
+    if (poll(fds, nfds, (int) max(deadline - now, 0)) == -1) {
+      if (errno != EINTR)
+	log_message(LOG_ERR, "acceptor_run: poll() %s", strerror(errno));
+      break;
+    }
+    now = monotonic_ms();
+
+    /* accept_sock_batch() takes from all listeners in turn */
+    for (i = 1; i != 1 + nlisteners; i++) {
+      if (fds[i].revents)
+	break;
+    }
+    if (i != 1 + nlisteners) {
+      while ((n = accept_sock_batch(conns, ACCEPTOR_BATCH)) > 0) {
+	for (i = 0; i != n; i++)
+	  acceptor_enqueue(conns[i], now);
+      }
+    }
+
+    for (i = 1 + nlisteners; i != nfds; i++) {
+      chan = &acceptor.channels[slots[i - 1 - nlisteners]];
+      if (fds[i].revents & POLLOUT)
+	chan->full = FALSE;
+      if (fds[i].revents & ~POLLOUT)
+	channel_read(chan, now);
+    }
+
+    acceptor_dispatch(now);
+    acceptor_retire();
+
+    if (fds[0].revents || now >= deadline)
+      break;
+  }
+
+  free(fds);
+  free(slots);
+}
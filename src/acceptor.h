@@ -0,0 +1,34 @@
+/* $Id$
+ *
+ * See 'acceptor.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_ACCEPTOR_H
+#define TINYPROXY_ACCEPTOR_H
+
+extern int acceptor_init(int nchannels, int capacity,
+			 unsigned int maxrequests, int maxspare);
+extern int acceptor_enabled(void);
+extern int acceptor_queued(void);
+
+/* parent */
+extern int acceptor_channel(int slot);
+extern void acceptor_forked(int slot, pid_t pid);
+extern void acceptor_run(int notify_fd, int timeout);
+extern void acceptor_release(void);
+
+/* child */
+extern void acceptor_child(void);
+extern void acceptor_done(int n);
+
+#endif
@@ -0,0 +1,127 @@
+/* $Id$
+ *
+ * Everything a request needs for itself (the request structure, the
+ * header tables, the request line, the variables of an error page) is
+ * taken from the arena of its connection by moving a pointer, and given
+ * back all at once with arena_reset() when the request is done. Nothing
+ * allocated there is freed on its own, so an early return cannot leak.
+ *
+ * The arena is a chain of blocks. The usual ones come from a free list
+ * of the child, a request which needs more than fits into one of them
+ * (a large header, say) gets a block of its own size appended.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include "arena.h"
+#include "freelist.h"
+
+#define ARENA_BLOCK (8 * 1024)
+#define ARENA_ALIGN (sizeof(void *) * 2)
+
+struct arena_block_s {
+  struct arena_block_s *next;
+  size_t size, used;
+  /* the memory follows, aligned like the header */
+};
+
+#define ARENA_HEADER \
+  ((sizeof(struct arena_block_s) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+static struct freelist_s blocks = FREELIST_INIT(ARENA_BLOCK);
+
+/*
+ * "len" bytes from the arena, aligned for any type.
+ */
+void *arena_alloc(struct arena_s *arena, size_t len)
+{
+  struct arena_block_s *block = arena->block;
+  size_t size;
+  void *ptr;
+
+  len = (len + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  if (!block || block->size - block->used < len) {
+    if (len <= ARENA_BLOCK - ARENA_HEADER) {
+      size = ARENA_BLOCK;
+      block = freelist_get(&blocks);
+    } else {
+      size = ARENA_HEADER + len;
+      block = malloc(size);
+    }
+    if (!block)
+      return NULL;
+
+    block->size = size - ARENA_HEADER;
+    block->used = 0;
+
+    /*
+     * A large block goes behind the current one, which may still have
+     * room for the smaller things to come.
+     */
+    if (arena->block && size > ARENA_BLOCK) {
+      block->next = arena->block->next;
+      arena->block->next = block;
+    } else {
+      block->next = arena->block;
+      arena->block = block;
+    }
+  }
+
+  ptr = (char *) block + ARENA_HEADER + block->used;
+  block->used += len;
+  return ptr;
+}
+
+void *arena_calloc(struct arena_s *arena, size_t nmemb, size_t size)
+{
+  void *ptr;
+
+  if (size && nmemb > SIZE_MAX / size)
+    return NULL;
+  if ((ptr = arena_alloc(arena, nmemb * size)))
+    memset(ptr, 0, nmemb * size);
+  return ptr;
+}
+
+char *arena_strndup(struct arena_s *arena, const char *str, size_t len)
+{
+  char *ptr;
+
+  if ((ptr = arena_alloc(arena, len + 1))) {
+    memcpy(ptr, str, len);
+    ptr[len] = '\0';
+  }
+  return ptr;
+}
+
+char *arena_strdup(struct arena_s *arena, const char *str)
+{
+  return arena_strndup(arena, str, strlen(str));
+}
+
+/*
+ * Give back everything allocated from the arena.
+ */
+void arena_reset(struct arena_s *arena)
+{
+  struct arena_block_s *block;
+
+  while ((block = arena->block)) {
+    arena->block = block->next;
+    if (block->size == ARENA_BLOCK - ARENA_HEADER)
+      freelist_put(&blocks, block);
+    else
+      free(block);
+  }
+}
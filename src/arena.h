@@ -0,0 +1,35 @@
+/* $Id$
+ *
+ * See 'arena.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_ARENA_H
+#define TINYPROXY_ARENA_H
+
+struct arena_block_s;
+
+/*
+ * The memory of a request. A zeroed structure is an empty arena.
+ */
+struct arena_s {
+  struct arena_block_s *block;	/* the newest, the older ones follow */
+};
+
+extern void *arena_alloc(struct arena_s *arena, size_t len);
+extern void *arena_calloc(struct arena_s *arena, size_t nmemb, size_t size);
+extern char *arena_strndup(struct arena_s *arena, const char *str,
+			   size_t len);
+extern char *arena_strdup(struct arena_s *arena, const char *str);
+extern void arena_reset(struct arena_s *arena);
+
+#endif
@@ -1,12 +1,19 @@
 /* $Id$
  *
- * The buffer used in each connection is a linked list of lines. As the lines
- * are read in and written out the buffer expands and contracts. Basically,
- * by using this method we can increase the buffer size dynamically. However,
- * we have a hard limit of 64 KB for the size of the buffer. The buffer can be
- * thought of as a queue were we act on both the head and tail. The various
- * functions act on each end (the names are taken from what Perl uses to act on
- * the ends of an array. :)
+ * The buffer used for each direction of a connection is a ring. Data is
+ * read with readv() straight into the free space and written with
+ * writev() from the used region, which are at most two pieces each, so
+ * a single system call moves as much as the socket takes. The ring has
+ * room for RelayBufferSize bytes (MAXBUFFSIZE by default), it is
+ * allocated when the first data arrives and released again when the
+ * buffer is cleared.
+ *
+ * Data which is rewritten on the way in (decoded chunks and FTP directory
+ * listings) is read into a small buffer first and copied into the ring,
+ * which may grow beyond its size for that.
+ *
+ * Buffers and rings of the usual size come from the free lists of the
+ * child (see 'freelist.c').
  *
  * Copyright (C) 1999,2001  Robert James Kaes (rjkaes@users.sourceforge.net)
  *
@@ -25,6 +32,7 @@
 
 #include "conns.h"
 #include "buffer.h"
+#include "freelist.h"
 
 #include "log.h"
 #ifdef FTP_SUPPORT
@@ -32,71 +40,127 @@
 #include "ftp.h"
 #endif
 
-#define BUFFER_HEAD(x) (x)->head
-#define BUFFER_TAIL(x) (x)->tail
-
-struct bufline_s {
-  unsigned char *string;	/* the actual string of data */
-  struct bufline_s *next;	/* pointer to next in linked list */
-  size_t length;		/* length of the string of data */
-  size_t pos;			/* start sending from this offset */
-};
-
 /*
- * The buffer structure points to the beginning and end of the buffer list
- * (and includes the total size)
+ * The ring and where the data is in it. The data starts at "start" and
+ * may wrap around the end of the ring.
  */
 struct buffer_s {
-  struct bufline_s *head;	/* top of the buffer */
-  struct bufline_s *tail;	/* bottom of the buffer */
-  size_t size;			/* total size of the buffer */
+  unsigned char *data;		/* the ring, NULL until it is needed */
+  size_t capacity;		/* size of the ring */
+  size_t start;			/* offset of the first byte */
+  size_t size;			/* total size of the data */
 };
 
+static struct freelist_s buffers = FREELIST_INIT(sizeof(struct buffer_s));
+static struct freelist_s rings = FREELIST_INIT(0);
+
 /*
- * Take a string of data and a length and make a new line which can be added
- * to the buffer. The data IS copied, so make sure if you allocated your
- * data buffer on the heap, delete it because you now have TWO copies.
+ * A ring of "capacity" bytes, from the free list if it has the usual size.
  */
-static struct bufline_s *makenewline(unsigned char *data, size_t length)
+static unsigned char *ring_alloc(size_t capacity)
 {
-  struct bufline_s *newline;
+  if (capacity != (size_t) config.relaybuffersize)
+    return malloc(capacity);
 
-  assert(data != NULL);
-  assert(length > 0);
+  if (rings.size != capacity) {
+    freelist_flush(&rings);
+    rings.size = capacity;
+  }
+  return freelist_get(&rings);
+}
 
-  if (!(newline = malloc(sizeof(struct bufline_s))))
-    return NULL;
+static void ring_free(unsigned char *data, size_t capacity)
+{
+  if (data && capacity == rings.size)
+    freelist_put(&rings, data);
+  else
+    free(data);
+}
 
-  if (!(newline->string = malloc(length))) {
-    free(newline);
-    return NULL;
-  }
+/*
+ * The data in the buffer as up to two iovecs, returns their number.
+ */
+static int used_iov(struct buffer_s *buffptr, struct iovec *iov)
+{
+  size_t first;
 
-  memcpy(newline->string, data, length);
+  if (buffptr->size == 0)
+    return 0;
+
+  first = min(buffptr->size, buffptr->capacity - buffptr->start);
+  iov[0].iov_base = buffptr->data + buffptr->start;
+  iov[0].iov_len = first;
+  if (first == buffptr->size)
+    return 1;
 
-  newline->next = NULL;
-  newline->length = length;
+  iov[1].iov_base = buffptr->data;
+  iov[1].iov_len = buffptr->size - first;
+  return 2;
+}
 
-  /* Position our "read" pointer at the beginning of the data */
-  newline->pos = 0;
+/*
+ * The free space of the ring as up to two iovecs, returns their number.
+ */
+static int free_iov(struct buffer_s *buffptr, struct iovec *iov)
+{
+  size_t room = buffptr->capacity - buffptr->size, end, first;
 
-  return newline;
+  if (room == 0)
+    return 0;
+
+  end = (buffptr->start + buffptr->size) % buffptr->capacity;
+  first = min(room, buffptr->capacity - end);
+  iov[0].iov_base = buffptr->data + end;
+  iov[0].iov_len = first;
+  if (first == room)
+    return 1;
+
+  iov[1].iov_base = buffptr->data;
+  iov[1].iov_len = room - first;
+  return 2;
 }
 
 /*
- * Free the allocated buffer line
+ * Make sure the ring exists and has room for "length" more bytes. A ring
+ * which is too small is replaced by a larger one with the data moved to
+ * its start.
  */
-static void free_line(struct bufline_s *line)
+static int reserve_buffer(struct buffer_s *buffptr, size_t length)
 {
-  assert(line != NULL);
+  size_t capacity = buffptr->capacity;
+  unsigned char *data;
 
-  if (!line)
-    return;
+  if (capacity == 0)
+    capacity = (size_t) config.relaybuffersize;
+  while (capacity - buffptr->size < length)
+    capacity *= 2;
 
-  if (line->string)
-    free(line->string);
+  if (buffptr->data && capacity == buffptr->capacity)
+    return 0;
 
-  free(line);
+  if (!(data = ring_alloc(capacity)))
+    return -1;
+  copy_from_buffer(buffptr, data, buffptr->size);
+  ring_free(buffptr->data, buffptr->capacity);
+
+  buffptr->data = data;
+  buffptr->capacity = capacity;
+  buffptr->start = 0;
+  return 0;
+}
+
+/*
+ * Drop "length" bytes from the start of the buffer.
+ */
+static void consume_buffer(struct buffer_s *buffptr, size_t length)
+{
+  assert(length <= buffptr->size);
+
+  buffptr->size -= length;
+  if (buffptr->size == 0)
+    buffptr->start = 0;
+  else
+    buffptr->start = (buffptr->start + length) % buffptr->capacity;
 }
 
 /*
@@ -106,36 +170,27 @@ struct buffer_s *new_buffer(void)
 {
   struct buffer_s *buffptr;
 
-  if (!(buffptr = malloc(sizeof(struct buffer_s))))
+  if (!(buffptr = freelist_get(&buffers)))
     return NULL;
 
   /*
-   * Since the buffer is initially empty, set the HEAD and TAIL
-   * pointers to NULL since they can't possibly point anywhere at the
-   * moment.
+   * The ring is only allocated once there is something to put in it.
    */
-  BUFFER_HEAD(buffptr) = BUFFER_TAIL(buffptr) = NULL;
-  buffptr->size = 0;
+  buffptr->data = NULL;
+  buffptr->capacity = buffptr->start = buffptr->size = 0;
 
   return buffptr;
 }
 
 /*
- * Delete all the lines in the buffer and the buffer itself
+ * Delete the data in the buffer and the buffer itself
  */
 void delete_buffer(struct buffer_s *buffptr)
 {
-  struct bufline_s *next;
-
   assert(buffptr != NULL);
 
-  while (BUFFER_HEAD(buffptr)) {
-    next = BUFFER_HEAD(buffptr)->next;
-    free_line(BUFFER_HEAD(buffptr));
-    BUFFER_HEAD(buffptr) = next;
-  }
-
-  free(buffptr);
+  ring_free(buffptr->data, buffptr->capacity);
+  freelist_put(&buffers, buffptr);
 }
 
 /*
@@ -147,94 +202,124 @@ size_t buffer_size(struct buffer_s *buffptr)
 }
 
 /*
- * Push a new line on to the end of the buffer.
+ * Return how many bytes recv_buffer() may still read into the buffer.
+ */
+size_t buffer_room(struct buffer_s *buffptr)
+{
+  size_t capacity = buffptr->data ? buffptr->capacity
+      : (size_t) config.relaybuffersize;
+
+  return buffptr->size < capacity ? capacity - buffptr->size : 0;
+}
+
+/*
+ * Append data to the end of the buffer. The data IS copied.
  */
 int add_to_buffer(struct buffer_s *buffptr, unsigned char *data, size_t length)
 {
-  struct bufline_s *newline;
+  struct iovec iov[2];
+  size_t n;
+  int i, count;
 
   assert(buffptr != NULL);
   assert(data != NULL);
   assert(length > 0);
 
-  /*
-   * Sanity check here. A buffer with a non-NULL head pointer must
-   * have a size greater than zero, and vice-versa.
-   */
-  if (BUFFER_HEAD(buffptr) == NULL)
-    assert(buffptr->size == 0);
-  else
-    assert(buffptr->size > 0);
-
-  /*
-   * Make a new line so we can add it to the buffer.
-   */
-  if (!(newline = makenewline(data, length)))
+  if (reserve_buffer(buffptr, length) < 0)
     return -1;
 
-  if (buffptr->size == 0)
-    BUFFER_HEAD(buffptr) = BUFFER_TAIL(buffptr) = newline;
-  else {
-    BUFFER_TAIL(buffptr)->next = newline;
-    BUFFER_TAIL(buffptr) = newline;
+  count = free_iov(buffptr, iov);
+  for (i = 0; i < count && length > 0; i++) {
+    n = min(iov[i].iov_len, length);
+    memcpy(iov[i].iov_base, data, n);
+    data += n;
+    length -= n;
+    buffptr->size += n;
   }
 
-  buffptr->size += length;
-
   return 0;
 }
 
 /*
- * Remove the first line from the top of the buffer
+ * Add data received for the connection to the buffer. A chunked response
+ * body goes through the chunk parser and FTP directory listings are
+ * formatted on the way.
  */
-static struct bufline_s *remove_from_buffer(struct buffer_s *buffptr)
+int add_received(struct buffer_s *buffptr, unsigned char *data, size_t length,
+		 struct conn_s *connptr)
 {
-  struct bufline_s *line;
-
-  assert(buffptr != NULL);
-  assert(BUFFER_HEAD(buffptr) != NULL);
-
-  line = BUFFER_HEAD(buffptr);
-  BUFFER_HEAD(buffptr) = line->next;
-
-  buffptr->size -= line->length;
-
-  return line;
+  if (connptr->chunked.state != CHUNK_NONE && buffptr == connptr->sbuffer)
+    return add_to_buffer_chunked(buffptr, data, length, &connptr->chunked);
+#ifdef FTP_SUPPORT
+  if (connptr->ftp_isdir) {
+    if (add_to_buffer_formatted(buffptr, data, length, connptr) < 0) {
+      log_message(LOG_ERR, "add_received: add_to_buffer_formatted() error.");
+      return -1;
+    }
+    return 0;
+  }
+#endif
+  if (add_to_buffer(buffptr, data, length) < 0) {
+    log_message(LOG_ERR, "add_received: add_to_buffer() error.");
+    return -1;
+  }
+  return 0;
 }
 
 /*
- * Reads the bytes from the socket, and adds them to the buffer.
+ * Reads the bytes from the socket into the free space of the buffer.
  * Takes a connection and returns the number of bytes read.
  */
 ssize_t recv_buffer(int fd, struct buffer_s * buffptr, struct conn_s * connptr)
 {
   ssize_t bytesin;
-  unsigned char buffer[READ_BUFFER_SIZE];
+  struct iovec iov[2];
+  int chunked, count, i;
+  size_t n, left;
 
   assert(fd >= 0);
   assert(buffptr != NULL);
 
   /*
-   * Don't allow the buffer to grow larger than MAXBUFFSIZE
+   * Don't allow the buffer to grow larger than its ring
    */
-  if (buffptr->size >= MAXBUFFSIZE)
+  if (buffer_room(buffptr) == 0)
     return 0;
 
-  bytesin = recv(fd, buffer, READ_BUFFER_SIZE, 0);
+  chunked = connptr->chunked.state != CHUNK_NONE
+      && buffptr == connptr->sbuffer;
 
-  if (bytesin > 0) {
+  if ((chunked && connptr->chunked.decode)
 #ifdef FTP_SUPPORT
-    if (connptr->ftp_isdir) {
-      if (add_to_buffer_formatted(buffptr, buffer, bytesin, connptr) < 0) {
-	log_message(LOG_ERR, "recv_buffer: add_to_buffer_formatted() error.");
-	return -1;
-      }
-    } else
+      || connptr->ftp_isdir
 #endif
-    if (add_to_buffer(buffptr, buffer, bytesin) < 0) {
-      log_message(LOG_ERR, "recv_buffer: add_to_buffer() error.");
+      ) {
+    unsigned char buffer[READ_BUFFER_SIZE];
+
+    /* the data is rewritten on its way into the buffer */
+    bytesin = recv(fd, buffer, READ_BUFFER_SIZE, 0);
+    if (bytesin > 0 && add_received(buffptr, buffer, bytesin, connptr) < 0)
       return -1;
+  } else {
+    if (reserve_buffer(buffptr, 0) < 0)
+      return -1;
+
+    count = free_iov(buffptr, iov);
+    bytesin = readv(fd, iov, count);
+
+    if (bytesin > 0) {
+      /* chunks passed on as they are only go through the parser */
+      for (i = 0, left = bytesin; chunked && i < count && left > 0; i++) {
+	n = min(iov[i].iov_len, left);
+	if (chunked_parse(&connptr->chunked, iov[i].iov_base, n) < 0)
+	  return -1;
+	left -= n;
+      }
+      buffptr->size += bytesin;
     }
+  }
+
+  if (bytesin > 0) {
     return bytesin;
   } else {
     if (bytesin == 0) {
@@ -264,13 +349,13 @@ ssize_t recv_buffer(int fd, struct buffer_s * buffptr, struct conn_s * connptr)
 }
 
 /*
- * Write the bytes in the buffer to the socket.
+ * Write as many bytes of the buffer to the socket as it takes.
  * Takes a connection and returns the number of bytes written.
  */
 ssize_t send_buffer(int fd, struct buffer_s * buffptr)
 {
   ssize_t bytessent;
-  struct bufline_s *line;
+  struct iovec iov[2];
 
   assert(fd >= 0);
   assert(buffptr != NULL);
@@ -278,19 +363,11 @@ ssize_t send_buffer(int fd, struct buffer_s * buffptr)
   if (buffptr->size == 0)
     return 0;
 
-  /* Sanity check. It would be bad to be using a NULL pointer! */
-  assert(BUFFER_HEAD(buffptr) != NULL);
-  line = BUFFER_HEAD(buffptr);
-
-  bytessent =
-      send(fd, line->string + line->pos, line->length - line->pos,
-	   MSG_NOSIGNAL);
+  bytessent = writev(fd, iov, used_iov(buffptr, iov));
 
   if (bytessent >= 0) {
     /* bytes sent, adjust buffer */
-    line->pos += bytessent;
-    if (line->pos == line->length)
-      free_line(remove_from_buffer(buffptr));
+    consume_buffer(buffptr, bytessent);
     return bytessent;
   } else {
     switch (errno) {
@@ -306,14 +383,50 @@ ssize_t send_buffer(int fd, struct buffer_s * buffptr)
     case ENOBUFS:
     case ENOMEM:
       log_message(LOG_ERR,
-		  "send_buffer: send() error [NOBUFS/NOMEM] \"%s\" on file descriptor %d",
+		  "send_buffer: writev() error [NOBUFS/NOMEM] \"%s\" on file descriptor %d",
 		  strerror(errno), fd);
       return 0;
     default:
       log_message(LOG_ERR,
-		  "send_buffer: send() error \"%s\" on file descriptor %d",
+		  "send_buffer: writev() error \"%s\" on file descriptor %d",
 		  strerror(errno), fd);
       return -1;
     }
   }
 }
+
+/*
+ * Copy up to "length" bytes from the start of the buffer to "dst" without
+ * removing them. Returns the number of bytes copied.
+ */
+size_t copy_from_buffer(struct buffer_s *buffptr, unsigned char *dst,
+			size_t length)
+{
+  struct iovec iov[2];
+  size_t n, copied = 0;
+  int i, count;
+
+  assert(buffptr != NULL);
+  assert(dst != NULL);
+
+  count = used_iov(buffptr, iov);
+  for (i = 0; i < count && copied < length; i++) {
+    n = min(iov[i].iov_len, length - copied);
+    memcpy(dst + copied, iov[i].iov_base, n);
+    copied += n;
+  }
+
+  return copied;
+}
+
+/*
+ * Remove all data from the buffer and release the ring.
+ */
+void clear_buffer(struct buffer_s *buffptr)
+{
+  assert(buffptr != NULL);
+
+  ring_free(buffptr->data, buffptr->capacity);
+  buffptr->data = NULL;
+  buffptr->capacity = buffptr->start = buffptr->size = 0;
+}
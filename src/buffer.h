@@ -27,15 +27,21 @@ struct conn_s;
 extern struct buffer_s *new_buffer(void);
 extern void delete_buffer(struct buffer_s *buffptr);
 extern size_t buffer_size(struct buffer_s *buffptr);
+extern size_t buffer_room(struct buffer_s *buffptr);
 
 /*
- * Add a new line to the given buffer. The data IS copied into the structure.
+ * Add data to the given buffer. The data IS copied into the structure.
  */
 extern int add_to_buffer(struct buffer_s *buffptr, unsigned char *data,
 			 size_t length);
 
+extern int add_received(struct buffer_s *buffptr, unsigned char *data,
+			size_t length, struct conn_s *connptr);
 extern ssize_t recv_buffer(int fd, struct buffer_s *buffptr,
 			   struct conn_s *connptr);
 extern ssize_t send_buffer(int fd, struct buffer_s *buffptr);
+extern size_t copy_from_buffer(struct buffer_s *buffptr, unsigned char *dst,
+			       size_t length);
+extern void clear_buffer(struct buffer_s *buffptr);
 
 #endif				/* __BUFFER_H_ */
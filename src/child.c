@@ -18,15 +18,24 @@
 
 #include "tinyproxy-ex.h"
 
+#include <limits.h>		/* INT_MAX */
+#ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+#endif
+
+#include "acceptor.h"
 #include "child.h"
 #include "daemon.h"
 #include "filter.h"
 #include "heap.h"
 #include "log.h"
+#include "relay.h"
 #include "reqs.h"
 #include "sock.h"
+#include "stats.h"
 #include "utils.h"
 #include "proctitle.h"
+#include "worker.h"
 
 /*
  * Stores the internal data needed for each child (connection)
@@ -46,10 +55,63 @@ static struct child_s *child_ptr;
 static struct child_config_s {
   int maxclients, maxrequestsperchild;
   int maxspareservers, minspareservers, startservers;
+  int workerconnections;
 } child_config;
 
 static int *servers_waiting;	/* servers waiting for a connection */
 
+/*
+ * The child states and "servers_waiting" live in shared memory and are
+ * updated by all children. With atomic builtins no lock is needed,
+ * otherwise a fcntl() lock serializes the modifications.
+ */
+#define CHILD_STATUS(ptr)	ATOMIC_LOAD(&(ptr)->status)
+#define CHILD_SET_STATUS(ptr, s) ATOMIC_STORE(&(ptr)->status, s)
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+#define SERVER_INC() do { \
+    int n = ATOMIC_ADD(servers_waiting, 1); \
+    DEBUG2("INC: servers_waiting: %d", n); \
+} while (0)
+
+#define SERVER_DEC() ((void) server_dec())
+
+#define SERVER_COUNT() ATOMIC_LOAD(servers_waiting)
+
+/*
+ * Count the calling child as waiting server no more. Returns the number
+ * of waiting servers left.
+ */
+static int server_dec(void)
+{
+  int n = ATOMIC_ADD(servers_waiting, -1);
+
+  DEBUG2("DEC: servers_waiting: %d", n);
+  return n;
+}
+
+#define _child_lock_init()
+
+/*
+ * Count the calling child as waiting server again, unless more than
+ * "limit" servers are waiting already. Returns the number of waiting
+ * servers found, the child was not counted if this exceeds "limit".
+ */
+static int server_inc_unless_above(int limit)
+{
+  int n = ATOMIC_LOAD(servers_waiting);
+
+  while (n <= limit && !__atomic_compare_exchange_n(servers_waiting, &n, n + 1,
+						    FALSE, __ATOMIC_SEQ_CST,
+						    __ATOMIC_SEQ_CST));
+  if (n <= limit)
+    DEBUG2("INC: servers_waiting: %d", n + 1);
+  return n;
+}
+
+#else
+
 /*
  * Lock/Unlock the "servers_waiting" variable so that two children cannot
  * modify it at the same time.
@@ -107,15 +169,85 @@ static void _child_lock_release(void)
 #define SERVER_INC() do { \
     SERVER_COUNT_LOCK(); \
     ++(*servers_waiting); \
-    DEBUG2("INC: servers_waiting: %d", *servers_waiting + 1); \
+    DEBUG2("INC: servers_waiting: %d", *servers_waiting); \
     SERVER_COUNT_UNLOCK(); \
 } while (0)
 
-#define SERVER_DEC() do { \
-    SERVER_COUNT_LOCK(); \
-    --(*servers_waiting); \
-    DEBUG2("DEC: servers_waiting: %d", *servers_waiting + 1); \
-    SERVER_COUNT_UNLOCK(); \
+#define SERVER_DEC() ((void) server_dec())
+
+#define SERVER_COUNT() (*servers_waiting)
+
+static int server_dec(void)
+{
+  int n;
+
+  SERVER_COUNT_LOCK();
+  n = --(*servers_waiting);
+  DEBUG2("DEC: servers_waiting: %d", n);
+  SERVER_COUNT_UNLOCK();
+  return n;
+}
+
+static int server_inc_unless_above(int limit)
+{
+  int n;
+
+  SERVER_COUNT_LOCK();
+  if ((n = *servers_waiting) <= limit) {
+    ++(*servers_waiting);
+    DEBUG2("INC: servers_waiting: %d", n + 1);
+  }
+  SERVER_COUNT_UNLOCK();
+  return n;
+}
+
+#endif				/* HAVE_ATOMIC_BUILTINS */
+
+/* interval of the regular pool check in ms */
+#define CHILD_CHECK_INTERVAL 5000
+/* interval of the checks in ms while the pool is growing */
+#define CHILD_RAMP_INTERVAL 100
+
+/* the children wake up the parent through this eventfd (or pipe) */
+static int notify_fd[2] = { -1, -1 };
+
+static void _child_notify_init(void)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  notify_fd[0] = notify_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+  if (pipe(notify_fd) == 0) {
+    socket_nonblocking(notify_fd[0]);
+    socket_nonblocking(notify_fd[1]);
+  }
+#endif
+  if (notify_fd[0] == -1)
+    log_message(LOG_WARNING, "Could not create notification channel: %s",
+		strerror(errno));
+}
+
+static void child_notify_parent(void)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t one = 1;
+
+  write(notify_fd[1], &one, sizeof(one));
+#else
+  write(notify_fd[1], "", 1);
+#endif
+}
+
+/*
+ * The calling child got busy. Wake up the parent when the number of
+ * spare servers drops below MinSpareServers (or to zero). Only the value
+ * of our own decrement tells whether it was us who crossed the line,
+ * another child may have changed the count since.
+ */
+#define SERVER_BUSY() do { \
+    int left = server_dec(); \
+    if ((left + 1 >= child_config.minspareservers \
+	 && left < child_config.minspareservers) || left == 0) \
+      child_notify_parent(); \
 } while (0)
 
 /*
@@ -139,6 +271,9 @@ short int child_configure(child_config_t type, int val)
   case CHILD_MAXREQUESTSPERCHILD:
     child_config.maxrequestsperchild = val;
     break;
+  case CHILD_WORKERCONNECTIONS:
+    child_config.workerconnections = val;
+    break;
   default:
     DEBUG2("Invalid type (%d)", type);
     return -1;
@@ -157,7 +292,7 @@ int child_mark_empty(pid_t pid)
   for (i = 0; i != child_config.maxclients; i++) {
     if (child_ptr[i].tid == pid) {
       child_ptr[i].tid = -1;
-      child_ptr[i].status = T_EMPTY;
+      CHILD_SET_STATUS(&child_ptr[i], T_EMPTY);
       child_ptr[i].connects = 0;
       return pid;
     }
@@ -165,6 +300,90 @@ int child_mark_empty(pid_t pid)
   return 0;
 }
 
+/*
+ * Number of running children on the shard of the given slot
+**/
+static int child_shard_count(int slot)
+{
+  int i, n = 0, nshards = listeners_shards();
+
+  for (i = 0; i != child_config.maxclients; i++) {
+    if (i % nshards == slot % nshards
+	&& CHILD_STATUS(&child_ptr[i]) != T_EMPTY)
+      n++;
+  }
+  return n;
+}
+
+/*
+ * Find an empty slot for a new child. With ListenSharding prefer the
+ * shard with the fewest children, so no shard is left unserved.
+**/
+static int child_find_empty(void)
+{
+  int i, n, slot = -1, best = child_config.maxclients + 1;
+
+  for (i = 0; i != child_config.maxclients; i++) {
+    if (CHILD_STATUS(&child_ptr[i]) != T_EMPTY)
+      continue;
+    if (!listeners_shards())
+      return i;
+    if ((n = child_shard_count(i)) < best) {
+      best = n;
+      slot = i;
+    }
+  }
+  return slot;
+}
+
+/*
+ * Check for a shard without any children (after a crash or when a child
+ * reached MaxRequestsPerChild).
+**/
+static int child_shard_unserved(void)
+{
+  int k;
+
+  for (k = 0; k < listeners_shards(); k++) {
+    if (child_shard_count(k) == 0) {
+      log_message(LOG_NOTICE,
+		  "No server left on shard %d. Creating new child.", k);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/*
+ * A child must not leave because of too many spare servers if it is the
+ * last one serving its shard. With AcceptQueue the acceptor retires the
+ * spare children itself.
+**/
+static int child_may_exit(struct child_s *ptr)
+{
+  if (acceptor_enabled())
+    return FALSE;
+  return !listeners_shards() || child_shard_count(ptr - child_ptr) > 1;
+}
+
+/*
+ * Count the child as waiting server again. Returns FALSE if there are
+ * too many spare children and the child should kill itself off.
+**/
+static int child_wait_again(struct child_s *ptr)
+{
+  int n, limit;
+
+  limit = child_may_exit(ptr) ? child_config.maxspareservers : INT_MAX;
+  if ((n = server_inc_unless_above(limit)) > limit) {
+    log_message(LOG_NOTICE,
+		"Waiting servers (%d) exceeds MaxSpareServers (%d). Killing child.",
+		n, child_config.maxspareservers);
+    return FALSE;
+  }
+  return TRUE;
+}
+
 /*
  * This is the main (per child) loop.
  */
@@ -176,7 +395,7 @@ static void child_main(struct child_s *ptr)
 
   while (!config.quit) {
 
-    ptr->status = T_WAITING;
+    CHILD_SET_STATUS(ptr, T_WAITING);
     proctitle("idle (%d)", ptr->connects);
 
     connfd = accept_sock();
@@ -198,17 +417,23 @@ static void child_main(struct child_s *ptr)
      * Make sure no error occurred...
      */
     if (connfd < 0) {
+      if (errno == EPIPE) {
+	/* retired by the acceptor */
+	SERVER_DEC();
+	break;
+      }
       log_message(LOG_ERR, "Accept returned an error (%s) ... retrying.",
 		  strerror(errno));
       continue;
     }
 
     proctitle("%s", "running");
-    ptr->status = T_CONNECTED;
+    CHILD_SET_STATUS(ptr, T_CONNECTED);
 
-    SERVER_DEC();
+    SERVER_BUSY();
 
     handle_connection(connfd);
+    acceptor_done(1);
 
     ptr->connects++;
     if (child_config.maxrequestsperchild != 0) {
@@ -223,30 +448,128 @@ static void child_main(struct child_s *ptr)
       }
     }
 
-    SERVER_COUNT_LOCK();
-    if (*servers_waiting > child_config.maxspareservers) {
-      /*
-       * There are too many spare children, kill ourself
-       * off.
-       */
-      log_message(LOG_NOTICE,
-		  "Waiting servers (%d) exceeds MaxSpareServers (%d). Killing child.",
-		  *servers_waiting, child_config.maxspareservers);
-      SERVER_COUNT_UNLOCK();
-
+    if (!child_wait_again(ptr))
       break;
+  }
+
+  CHILD_SET_STATUS(ptr, T_EMPTY);
+  ptr->tid = -1;
+
+  exit(0);
+}
+
+#ifdef WORKER_SUPPORT
+/* maximum number of connections accepted with a single wakeup */
+#define ACCEPT_BATCH 16
+
+/*
+ * The main loop of a child in worker mode. The child handles up to
+ * "WorkerConnections" connections at once and counts as a waiting server
+ * as long as it is able to take another one.
+ */
+static void child_worker_main(struct child_s *ptr)
+{
+  int connfds[ACCEPT_BATCH];
+  int i, n, acceptable, finished;
+  int draining = FALSE;
+  const int maxconns = child_config.workerconnections;
+
+  ptr->connects = 0;
+  CHILD_SET_STATUS(ptr, T_WAITING);
+
+  if (worker_init(maxconns) < 0 || worker_listen(TRUE) < 0) {
+    log_message(LOG_ERR, "Could not initialize worker mode: %s",
+		strerror(errno));
+    SERVER_DEC();
+    goto EXIT;
+  }
+
+  while (!config.quit) {
+    if (CHILD_STATUS(ptr) == T_WAITING && worker_tasks() == 0) {
+      proctitle("idle (%d)", ptr->connects);
     } else {
-      SERVER_COUNT_UNLOCK();
+      proctitle("running %d/%d (%d)", worker_tasks(), maxconns,
+		ptr->connects);
     }
 
-    SERVER_INC();
+    finished = worker_dispatch(&acceptable);
+
+    if (acceptable && !draining && worker_tasks() < maxconns) {
+      n = min(maxconns - worker_tasks(), ACCEPT_BATCH);
+      if (child_config.maxrequestsperchild != 0)
+	n = min(n, child_config.maxrequestsperchild - ptr->connects);
+
+      update_stats(STAT_ACCEPT_WAKEUP);
+      if ((n = accept_sock_batch(connfds, n)) == 0)
+	update_stats(STAT_ACCEPT_IDLE);
+      else if (n < 0) {
+	/* retired by the acceptor */
+	worker_listen(FALSE);
+	CHILD_SET_STATUS(ptr, T_CONNECTED);
+	SERVER_DEC();
+	draining = TRUE;
+	n = 0;
+      }
+    } else
+      n = 0;
+
+    for (i = 0; i != n; i++) {
+      if (worker_spawn(handle_connection, connfds[i]) < 0) {
+	log_message(LOG_ERR, "Could not start worker task: %s",
+		    strerror(errno));
+	close(connfds[i]);
+	continue;
+      }
+      ptr->connects++;
+
+      if (child_config.maxrequestsperchild != 0
+	  && ptr->connects == child_config.maxrequestsperchild) {
+	log_message(LOG_NOTICE,
+		    "Child has reached MaxRequestsPerChild (%u). Killing child.",
+		    ptr->connects);
+	draining = TRUE;
+      }
+
+      /* full (or about to exit), let the other children take over */
+      if (CHILD_STATUS(ptr) == T_WAITING
+	  && (draining || worker_tasks() == maxconns)) {
+	worker_listen(FALSE);
+	CHILD_SET_STATUS(ptr, T_CONNECTED);
+	SERVER_BUSY();
+      }
+    }
+
+    if (draining) {
+      if (worker_tasks() == 0)
+	break;
+      continue;
+    }
+
+    if (!finished)
+      continue;
+
+    acceptor_done(finished);
+
+    if (CHILD_STATUS(ptr) == T_CONNECTED) {
+      /* able to take new connections again */
+      CHILD_SET_STATUS(ptr, T_WAITING);
+      SERVER_INC();
+      worker_listen(TRUE);
+    } else if (worker_tasks() == 0) {
+      SERVER_DEC();
+
+      if (!child_wait_again(ptr))
+	break;
+    }
   }
 
-  ptr->status = T_EMPTY;
+EXIT:
+  CHILD_SET_STATUS(ptr, T_EMPTY);
   ptr->tid = -1;
 
   exit(0);
 }
+#endif
 
 /*
  * Fork a child "child" (or in our case a process) and then start up the
@@ -256,8 +579,13 @@ static int child_make(struct child_s *ptr)
 {
   pid_t pid;
 
-  if ((pid = fork()) > 0)
+  if (acceptor_channel(ptr - child_ptr) < 0)
+    return -1;
+
+  if ((pid = fork()) != 0) {
+    acceptor_forked(ptr - child_ptr, pid);
     return pid;			/* parent */
+  }
 
   /*
    * Reset the SIGNALS so that the child can be reaped.
@@ -266,6 +594,14 @@ static int child_make(struct child_s *ptr)
   set_signal_handler(SIGTERM, SIG_DFL);
   set_signal_handler(SIGHUP, SIG_DFL);
 
+  listeners_use_shard(ptr - child_ptr);
+  acceptor_child();
+  relay_child();
+
+#ifdef WORKER_SUPPORT
+  if (child_config.workerconnections > 1)
+    child_worker_main(ptr);	/* never returns */
+#endif
   child_main(ptr);		/* never returns */
   return -1;
 }
@@ -275,7 +611,7 @@ static int child_make(struct child_s *ptr)
  */
 short int child_pool_create(void)
 {
-  int i;
+  int i, capacity = 1;
 
   /*
    * Make sure the number of MaxClients is not zero, since this
@@ -312,6 +648,34 @@ short int child_pool_create(void)
    * variable.
    */
   _child_lock_init();
+  _child_notify_init();
+
+  if (child_config.maxclients < listeners_shards()) {
+    log_message(LOG_ERR,
+		"child_pool_create: \"MaxClients\" must not be less than \"ListenSharding\".");
+    return -1;
+  }
+  if (config.acceptqueue > 0 && listeners_shards()) {
+    log_message(LOG_ERR,
+		"child_pool_create: \"AcceptQueue\" can not be combined with \"ListenSharding\".");
+    return -1;
+  }
+#ifdef WORKER_SUPPORT
+  if (child_config.workerconnections > 1)
+    capacity = child_config.workerconnections;
+#endif
+  if (acceptor_init(child_config.maxclients, capacity,
+		    child_config.maxrequestsperchild,
+		    child_config.maxspareservers) < 0) {
+    log_message(LOG_ERR, "Could not allocate memory for the acceptor.");
+    return -1;
+  }
+  if (child_config.startservers < listeners_shards()) {
+    log_message(LOG_WARNING,
+		"Every shard needs a server. Starting %u servers instead.",
+		listeners_shards());
+    child_config.startservers = listeners_shards();
+  }
 
   if (child_config.startservers > child_config.maxclients) {
     log_message(LOG_WARNING,
@@ -321,13 +685,13 @@ short int child_pool_create(void)
   }
 
   for (i = 0; i != child_config.maxclients; i++) {
-    child_ptr[i].status = T_EMPTY;
+    CHILD_SET_STATUS(&child_ptr[i], T_EMPTY);
     child_ptr[i].connects = 0;
   }
 
   for (i = 0; i != child_config.startservers; i++) {
     DEBUG2("Trying to create child %d of %d", i + 1, child_config.startservers);
-    child_ptr[i].status = T_WAITING;
+    CHILD_SET_STATUS(&child_ptr[i], T_WAITING);
     child_ptr[i].tid = child_make(&child_ptr[i]);
 
     if (child_ptr[i].tid < 0) {
@@ -349,48 +713,146 @@ short int child_pool_create(void)
   return 0;
 }
 
+/*
+ * Number of children running (or being started)
+**/
+static int child_running(void)
+{
+  int i, n = 0;
+
+  for (i = 0; i != child_config.maxclients; i++) {
+    if (CHILD_STATUS(&child_ptr[i]) != T_EMPTY)
+      n++;
+  }
+  return n;
+}
+
+/*
+ * Start up to "count" new children, returns the number started.
+**/
+static int child_spawn(int count)
+{
+  int i, n;
+
+  for (n = 0; n < count && (i = child_find_empty()) != -1; n++) {
+    CHILD_SET_STATUS(&child_ptr[i], T_WAITING);
+    child_ptr[i].tid = child_make(&child_ptr[i]);
+    if (child_ptr[i].tid < 0) {
+      log_message(LOG_NOTICE, "Could not create child");
+
+      CHILD_SET_STATUS(&child_ptr[i], T_EMPTY);
+      break;
+    }
+
+    SERVER_INC();
+  }
+  return n;
+}
+
+/*
+ * Estimate how many children should be created right now. There should
+ * be MinSpareServers waiting, and enough waiting servers for the
+ * connections queued in the listen backlog plus the growth of the
+ * accept rate expected until the next check. Never more than up to
+ * MaxSpareServers or MaxClients.
+**/
+static int child_spare_needed(long rate, long prev_rate)
+{
+  int waiting = SERVER_COUNT();
+  int per_child = 1, demand, need;
+
+#ifdef WORKER_SUPPORT
+  if (child_config.workerconnections > 1)
+    per_child = child_config.workerconnections;
+#endif
+
+  demand = listeners_queued() + acceptor_queued();
+  if (rate > prev_rate)
+    demand += (rate - prev_rate) * CHILD_RAMP_INTERVAL / 1000;
+  demand = (demand + per_child - 1) / per_child;
+
+  need = max(child_config.minspareservers - waiting, demand - waiting);
+  need = min(need, max(child_config.maxspareservers,
+		       child_config.minspareservers) - waiting);
+  need = min(need, child_config.maxclients - child_running());
+
+  return need;
+}
+
+/*
+ * Wait until a child reports a shortage of spare servers, but no longer
+ * than "timeout" ms. With AcceptQueue the acceptor runs meanwhile.
+**/
+static void child_wait_notify(int timeout)
+{
+  struct pollfd pfd;
+  char buf[64];
+
+  pfd.fd = notify_fd[0];
+  pfd.events = POLLIN;
+
+  if (acceptor_enabled()) {
+    acceptor_run(notify_fd[0], timeout);
+    while (read(notify_fd[0], buf, sizeof(buf)) > 0);
+  } else if (poll(&pfd, 1, timeout) > 0) {
+    while (read(notify_fd[0], buf, sizeof(buf)) > 0);
+  }
+}
+
 /*
  * Keep the proper number of servers running. This is the birth of the
- * servers. It monitors this at least once a second.
+ * servers. Besides a regular check every CHILD_CHECK_INTERVAL ms, the
+ * children wake us up as soon as there are not enough spare servers.
+ * While the demand is not met new children are created in batches
+ * which double every CHILD_RAMP_INTERVAL ms.
  */
 void child_main_loop(void)
 {
-  int i;
+  int need, batch = 1, ramp_from = 0;
+  long now, last = monotonic_ms(), ramp_start = -1;
+  long rate = 0, prev_rate = 0;
+  unsigned long accepted, last_accepted = stats_accepted();
 
   while (1) {
     if (config.quit)
       return;
 
-    /* If there are not enough spare servers, create more */
-    SERVER_COUNT_LOCK();
-    if (*servers_waiting < child_config.minspareservers) {
-      log_message(LOG_NOTICE,
-		  "Waiting servers (%d) is less than MinSpareServers (%d). Creating new child.",
-		  *servers_waiting, child_config.minspareservers);
-
-      SERVER_COUNT_UNLOCK();
-
-      for (i = 0; i != child_config.maxclients; i++) {
-	if (child_ptr[i].status == T_EMPTY) {
-	  child_ptr[i].status = T_WAITING;
-	  child_ptr[i].tid = child_make(&child_ptr[i]);
-	  if (child_ptr[i].tid < 0) {
-	    log_message(LOG_NOTICE, "Could not create child");
-
-	    child_ptr[i].status = T_EMPTY;
-	    break;
-	  }
-
-	  SERVER_INC();
+    /* smoothed accept rate in connections per second */
+    now = monotonic_ms();
+    accepted = stats_accepted();
+    if (now > last) {
+      prev_rate = rate;
+      rate = (rate + (long) (accepted - last_accepted) * 1000 / (now - last)) / 2;
+      last = now;
+      last_accepted = accepted;
+    }
 
-	  break;
-	}
+    if ((need = child_spare_needed(rate, prev_rate)) > 0) {
+      if (ramp_start == -1) {
+	ramp_start = now;
+	ramp_from = child_running();
       }
+      log_message(LOG_NOTICE,
+		  "Waiting servers (%d) fall short by %d. Creating %d new children.",
+		  SERVER_COUNT(), need, min(need, batch));
+      child_spawn(min(need, batch));
+      batch *= 2;
     } else {
-      SERVER_COUNT_UNLOCK();
+      batch = 1;
+      if (ramp_start != -1) {
+	log_message(LOG_INFO, "Pool grew from %d to %d servers in %ld ms.",
+		    ramp_from, child_running(), now - ramp_start);
+	stats_rampup(now - ramp_start, ramp_from, child_running());
+	ramp_start = -1;
+      }
     }
 
-    sleep(5);
+    /* never leave a shard without a child */
+    while (child_shard_unserved() && child_spawn(1) == 1);
+
+    relay_check();
+
+    child_wait_notify(need > 0 ? CHILD_RAMP_INTERVAL : CHILD_CHECK_INTERVAL);
 
     /* Handle log rotation if it was requested */
     if (received_sighup) {
@@ -418,7 +880,7 @@ void child_kill_children(void)
   int i;
 
   for (i = 0; i != child_config.maxclients; i++) {
-    if (child_ptr[i].status != T_EMPTY)
+    if (CHILD_STATUS(&child_ptr[i]) != T_EMPTY)
       kill(child_ptr[i].tid, SIGTERM);
   }
 }
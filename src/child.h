@@ -23,7 +23,8 @@ typedef enum {
   CHILD_MAXSPARESERVERS,
   CHILD_MINSPARESERVERS,
   CHILD_STARTSERVERS,
-  CHILD_MAXREQUESTSPERCHILD
+  CHILD_MAXREQUESTSPERCHILD,
+  CHILD_WORKERCONNECTIONS
 } child_config_t;
 
 extern short int child_pool_create(void);
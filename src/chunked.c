@@ -0,0 +1,163 @@
+/* $Id$
+ *
+ * Parser for the chunked transfer coding of HTTP/1.1 response bodies.
+ * The relay feeds everything it reads from the server through it, which
+ * tells where the body ends without waiting for the server to close the
+ * connection. HTTP/1.1 clients get the chunks as they are, for HTTP/1.0
+ * clients the framing is stripped and only the data is passed on.
+ *
+ * The parser works on whatever recv() returned, so it keeps its state
+ * between calls and a chunk header may be split anywhere. Trailers are
+ * passed on to HTTP/1.1 clients and dropped when decoding.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include "buffer.h"
+#include "chunked.h"
+#include "log.h"
+
+/*
+ * Get ready for a new chunked body.
+ */
+void chunked_start(struct chunked_s *chunk, int decode)
+{
+  chunk->state = CHUNK_SIZE;
+  chunk->left = 0;
+  chunk->digits = 0;
+  chunk->decode = decode;
+}
+
+static int hexval(unsigned char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/*
+ * Run "length" bytes of the body through the parser. When decoding, the
+ * chunk data is moved to the front of "data" on the way, otherwise the
+ * data is left alone. Returns the number of bytes to pass on, or -1 if
+ * the framing is broken or the server sends anything after the last
+ * chunk.
+ */
+ssize_t chunked_parse(struct chunked_s *chunk, unsigned char *data,
+		      size_t length)
+{
+  unsigned char *ptr = data, *end = data + length, *out = data;
+  size_t len;
+  int val;
+
+  while (ptr < end && chunk->state != CHUNK_ERROR) {
+    switch (chunk->state) {
+    case CHUNK_SIZE:
+      if ((val = hexval(*ptr)) >= 0) {
+	if (chunk->left > (UINT64_MAX >> 4)) {
+	  chunk->state = CHUNK_ERROR;
+	  break;
+	}
+	chunk->left = (chunk->left << 4) | (uint64_t) val;
+	chunk->digits++;
+	ptr++;
+	break;
+      }
+      if (chunk->digits == 0) {
+	chunk->state = CHUNK_ERROR;
+	break;
+      }
+      chunk->state = CHUNK_EXT;
+      /* FALLTHROUGH */
+    case CHUNK_EXT:
+      if (*ptr++ != '\n')
+	break;
+      chunk->state = chunk->left ? CHUNK_DATA : CHUNK_TRAILER;
+      break;
+
+    case CHUNK_DATA:
+      len = (size_t) end - (size_t) ptr;
+      if ((uint64_t) len > chunk->left)
+	len = (size_t) chunk->left;
+      if (chunk->decode) {
+	memmove(out, ptr, len);
+	out += len;
+      }
+      ptr += len;
+      if ((chunk->left -= len) == 0)
+	chunk->state = CHUNK_DATA_END;
+      break;
+
+    case CHUNK_DATA_END:
+      if (*ptr == '\n') {
+	chunk->state = CHUNK_SIZE;
+	chunk->digits = 0;
+      } else if (*ptr != '\r') {
+	chunk->state = CHUNK_ERROR;
+	break;
+      }
+      ptr++;
+      break;
+
+    case CHUNK_TRAILER:
+      if (*ptr == '\n')
+	chunk->state = CHUNK_DONE;
+      else if (*ptr != '\r')
+	chunk->state = CHUNK_TRAILER_LINE;
+      ptr++;
+      break;
+
+    case CHUNK_TRAILER_LINE:
+      if (*ptr++ == '\n')
+	chunk->state = CHUNK_TRAILER;
+      break;
+
+    case CHUNK_DONE:
+      /* nothing may follow the last chunk */
+      chunk->state = CHUNK_ERROR;
+      break;
+
+    default:
+      chunk->state = CHUNK_ERROR;
+      break;
+    }
+    /* the framing is dropped when decoding */
+    if (!chunk->decode)
+      out = ptr;
+  }
+
+  if (chunk->state == CHUNK_ERROR) {
+    log_message(LOG_WARNING, "Broken chunked encoding in the response body");
+    return -1;
+  }
+
+  return out - data;
+}
+
+/*
+ * Run "length" bytes of the body through the parser and add them to the
+ * buffer, only the chunk data if decoding.
+ */
+int add_to_buffer_chunked(struct buffer_s *buffptr, unsigned char *data,
+			  size_t length, struct chunked_s *chunk)
+{
+  ssize_t len;
+
+  if ((len = chunked_parse(chunk, data, length)) < 0)
+    return -1;
+  if (len > 0 && add_to_buffer(buffptr, data, len) < 0)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,49 @@
+/* $Id$
+ *
+ * See 'chunked.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_CHUNKED_H
+#define TINYPROXY_CHUNKED_H
+
+struct buffer_s;
+
+/*
+ * Where the parser is in a chunked body. CHUNK_NONE (the default of a
+ * zeroed connection) means the body is not chunked at all.
+ */
+struct chunked_s {
+  enum {
+    CHUNK_NONE = 0,
+    CHUNK_SIZE,			/* the hex digits of the chunk size */
+    CHUNK_EXT,			/* chunk extensions up to the end of line */
+    CHUNK_DATA,			/* "left" bytes of chunk data */
+    CHUNK_DATA_END,		/* the CRLF after the chunk data */
+    CHUNK_TRAILER,		/* start of a trailer line */
+    CHUNK_TRAILER_LINE,		/* inside a trailer line */
+    CHUNK_DONE,			/* the body is complete */
+    CHUNK_ERROR
+  } state;
+  uint64_t left;
+  unsigned int digits;
+  unsigned int decode;		/* pass on the data without the framing */
+};
+
+extern void chunked_start(struct chunked_s *chunk, int decode);
+extern ssize_t chunked_parse(struct chunked_s *chunk, unsigned char *data,
+			     size_t length);
+extern int add_to_buffer_chunked(struct buffer_s *buffptr,
+				 unsigned char *data, size_t length,
+				 struct chunked_s *chunk);
+
+#endif
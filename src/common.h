@@ -108,6 +108,9 @@
 #ifdef HAVE_NETDB_H
 #  include	<netdb.h>
 #endif
+#ifdef HAVE_POLL_H
+#  include	<poll.h>
+#endif
 #ifdef HAVE_PWD_H
 #  include     	<pwd.h>
 #endif
@@ -190,4 +193,15 @@
 #  define max(a,b)	((a) > (b) ? (a) : (b))
 #endif
 
+/* Access to variables shared between the processes */
+#ifdef HAVE_ATOMIC_BUILTINS
+#  define ATOMIC_LOAD(p)	__atomic_load_n(p, __ATOMIC_SEQ_CST)
+#  define ATOMIC_STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#  define ATOMIC_ADD(p, v)	__atomic_add_fetch(p, v, __ATOMIC_SEQ_CST)
+#else
+#  define ATOMIC_LOAD(p)	(*(p))
+#  define ATOMIC_STORE(p, v)	(*(p) = (v))
+#  define ATOMIC_ADD(p, v)	(*(p) += (v))
+#endif
+
 #endif
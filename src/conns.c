@@ -5,6 +5,9 @@
  * file and this file are only used for create/free functions and the
  * connection structure definition.
  *
+ * The structures are kept on a free list of the child for the next
+ * connection (see 'freelist.c').
+ *
  * Copyright (C) 2001  Robert James Kaes (rjkaes@flarenet.com)
  *
  * This program is free software; you can redistribute it and/or modify it
@@ -22,9 +25,13 @@
 
 #include "buffer.h"
 #include "conns.h"
+#include "freelist.h"
 #include "log.h"
 #include "stats.h"
 #include "network.h"
+#include "pool.h"
+
+static struct freelist_s conns = FREELIST_INIT(sizeof(struct conn_s));
 
 struct conn_s *initialize_conn(int client_fd, const char *ipaddr,
 			       const char *string_addr)
@@ -33,6 +40,8 @@ struct conn_s *initialize_conn(int client_fd, const char *ipaddr,
   struct buffer_s *cbuffer, *sbuffer;
 
   assert(client_fd >= 0);
+  assert(strlen(ipaddr) < PEER_IP_LENGTH);
+  assert(strlen(string_addr) < PEER_STRING_LENGTH);
 
   /*
    * Allocate the memory for all the internal components
@@ -46,9 +55,10 @@ struct conn_s *initialize_conn(int client_fd, const char *ipaddr,
   /*
    * Allocate the space for the conn_s structure itself.
    */
-  connptr = calloc(1, sizeof(struct conn_s));
+  connptr = freelist_get(&conns);
   if (!connptr)
     goto error_exit;
+  memset(connptr, 0, sizeof(struct conn_s));
 
   connptr->client_fd = client_fd;
   connptr->server_fd = -1;
@@ -68,8 +78,9 @@ struct conn_s *initialize_conn(int client_fd, const char *ipaddr,
   /* There is _no_ content length initially */
   connptr->server.content_length = connptr->client.content_length = -1;
 
-  connptr->client_ip_addr = strdup(ipaddr);
-  connptr->client_string_addr = strdup(string_addr);
+  connptr->client_ip_addr = strcpy(connptr->client_ip_room, ipaddr);
+  connptr->client_string_addr =
+      strcpy(connptr->client_string_room, string_addr);
 
   update_stats(STAT_OPEN);
 
@@ -87,66 +98,91 @@ error_exit:
   return NULL;
 }
 
-void destroy_conn(struct conn_s *connptr)
+/*
+ * Close the server side of the connection and free everything belonging
+ * to the current request, which is the arena of the connection.
+ */
+static void release_request(struct conn_s *connptr)
 {
-  assert(connptr != NULL);
-
-  if (connptr->client_fd != -1) {
-    /* flush all remaining data and close the client file descriptor */
-    disable_tcp_cork(connptr->client_fd);
-    if (close(connptr->client_fd) < 0)
-      log_message(LOG_INFO, "Client (%d) close message: %s",
-		  connptr->client_fd, strerror(errno));
-  }
-
   if (connptr->server_fd != -1) {
-    /* flush all remaining data and close the server file descriptor */
-    disable_tcp_cork(connptr->server_fd);
-    if (close(connptr->server_fd) < 0)
+    /* pool or close the connection */
+    if (pool_release(connptr->server_fd, connptr->server_keepalive) < 0)
       log_message(LOG_INFO, "Server (%d) close message: %s",
 		  connptr->server_fd, strerror(errno));
+    connptr->server_fd = -1;
   }
+  connptr->server_keepalive = FALSE;
+  linebuf_clear(&connptr->server_lines);
 #ifdef FTP_SUPPORT
   if (connptr->server_cfd != -1)
     if (close(connptr->server_cfd) < 0)
       log_message(LOG_INFO, "Server cmd (%d) close message: %s",
 		  connptr->server_cfd, strerror(errno));
-  if (connptr->ftp_basedir)
-    free(connptr->ftp_basedir);
-  if (connptr->ftp_path)
-    free(connptr->ftp_path);
-  if (connptr->ftp_greeting)
-    free(connptr->ftp_greeting);
+  connptr->server_cfd = -1;
+  connptr->ftp_basedir = connptr->ftp_path = connptr->ftp_greeting = NULL;
+  connptr->ftp_listing = NULL;
 #endif
-  if (connptr->cbuffer)
-    delete_buffer(connptr->cbuffer);
-  if (connptr->sbuffer)
-    delete_buffer(connptr->sbuffer);
 
-  if (connptr->request_line)
-    free(connptr->request_line);
+  /* all of these were allocated from the arena */
+  connptr->request_line = NULL;
+  connptr->error_variables = NULL;
+  connptr->error_variable_count = connptr->error_variable_room = 0;
+  connptr->error_string = NULL;
+  arena_reset(&connptr->arena);
+}
+
+/*
+ * Get a kept alive client connection ready for its next request.
+ */
+void reset_conn(struct conn_s *connptr)
+{
+  assert(connptr != NULL);
+
+  release_request(connptr);
+
+  clear_buffer(connptr->cbuffer);
+  clear_buffer(connptr->sbuffer);
 
-  if (connptr->error_variables) {
-    int i;
+#ifdef FTP_SUPPORT
+  connptr->ftp_isdir = FALSE;
+  connptr->offset = 0;
+#endif
+  connptr->request_len = 0;
+  connptr->error_number = -1;
+  connptr->statuscode = 0;
+  connptr->method = METH_UNKNOWN;
+  connptr->show_stats = FALSE;
+  connptr->local_request = FALSE;
+  connptr->upstream_proxy = NULL;
+
+  memset(&connptr->server, 0, sizeof(connptr->server));
+  memset(&connptr->client, 0, sizeof(connptr->client));
+  memset(&connptr->chunked, 0, sizeof(connptr->chunked));
+  connptr->server.content_length = connptr->client.content_length = -1;
+}
 
-    for (i = 0; i != connptr->error_variable_count; ++i) {
-      free(connptr->error_variables[i]->error_key);
-      free(connptr->error_variables[i]->error_val);
-      free(connptr->error_variables[i]);
-    }
+void destroy_conn(struct conn_s *connptr)
+{
+  assert(connptr != NULL);
 
-    free(connptr->error_variables);
+  if (connptr->client_fd != -1) {
+    /* close the client file descriptor */
+    if (close(connptr->client_fd) < 0)
+      log_message(LOG_INFO, "Client (%d) close message: %s",
+		  connptr->client_fd, strerror(errno));
   }
 
-  if (connptr->error_string)
-    free(connptr->error_string);
+  release_request(connptr);
 
-  if (connptr->client_ip_addr)
-    free(connptr->client_ip_addr);
-  if (connptr->client_string_addr)
-    free(connptr->client_string_addr);
+  if (connptr->cbuffer)
+    delete_buffer(connptr->cbuffer);
+  if (connptr->sbuffer)
+    delete_buffer(connptr->sbuffer);
+  linebuf_free(&connptr->client_lines);
+  linebuf_free(&connptr->server_lines);
 
-  free(connptr);
+  freelist_put(&conns, connptr);
 
   update_stats(STAT_CLOSE);
+  freelist_report();
 }
@@ -19,6 +19,10 @@
 #define TINYPROXY_CONNS_H
 
 #include "tinyproxy-ex.h"
+#include "arena.h"
+#include "chunked.h"
+#include "network.h"
+#include "sock.h"
 
 #define LENGTH_NONE UINT64_C(-1)
 
@@ -40,6 +44,16 @@ struct conn_s {
   struct buffer_s *cbuffer;
   struct buffer_s *sbuffer;
 
+  /* the headers are read through these */
+  struct linebuf_s client_lines;
+  struct linebuf_s server_lines;
+
+  /* and the heads sent to the server or the client are collected here */
+  struct headbuf_s head_out;
+
+  /* what the current request allocates, reset when it is done */
+  struct arena_s arena;
+
   /* The request line (first line) from the client */
   char *request_line;
   size_t request_len;
@@ -51,11 +65,14 @@ struct conn_s {
   char *ftp_basedir;
   char *ftp_path;
   char *ftp_greeting;
-  size_t offset;
+  char *ftp_listing;		/* a listing line not complete yet, ... */
+  size_t offset;		/* ... and its length */
 #endif
   /* Booleans */
   unsigned int show_stats;
   unsigned int local_request;
+  unsigned int keepalive;	/* the client may send another request */
+  unsigned int server_keepalive;	/* the server connection is reusable */
   /*
    * Store the error response if there is one.
    * This structure stores key -> value mappings for substitution
@@ -64,8 +81,8 @@ struct conn_s {
   struct error_variable_s {
     char *error_key;
     char *error_val;
-  } **error_variables;
-  int error_variable_count;
+  } *error_variables;
+  int error_variable_count, error_variable_room;
 
   int error_number;
   /* responses Status-Code */
@@ -76,11 +93,17 @@ struct conn_s {
   struct param_s server;
   struct param_s client;
 
+  /* the chunked response body */
+  struct chunked_s chunked;
+
   /*
-   * Store the client's IP and hostname information
+   * Store the client's IP and hostname information. initialize_conn()
+   * points these at the room below.
    */
   char *client_ip_addr;
   char *client_string_addr;
+  char client_ip_room[PEER_IP_LENGTH];
+  char client_string_room[PEER_STRING_LENGTH];
 
   /*
    * Pointer to upstream proxy.
@@ -88,11 +111,19 @@ struct conn_s {
   struct upstream *upstream_proxy;
 };
 
+/*
+ * The request went out completely, whatever the client sends while the
+ * response is relayed belongs to its next request.
+ */
+#define REQUEST_COMPLETE(connptr) \
+  ((connptr)->keepalive || (connptr)->server_keepalive)
+
 /*
  * Functions for the creation and destruction of a connection structure.
  */
 extern struct conn_s *initialize_conn(int client_fd, const char *ipaddr,
 				      const char *string_addr);
+extern void reset_conn(struct conn_s *connptr);
 extern void destroy_conn(struct conn_s *connptr);
 
 #endif
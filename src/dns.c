@@ -0,0 +1,791 @@
+/* $Id$
+ *
+ * A stub resolver which does not block the child. getaddrinfo() waits
+ * for the nameservers as long as the C library sees fit, and in the
+ * worker mode it stops every connection of the child while doing so.
+ * Here the queries go out on non blocking sockets, all waiting is done
+ * in worker_poll(), and a lookup takes at most DNSTimeout seconds.
+ *
+ * Numeric addresses and the names in /etc/hosts are answered right away.
+ * Everything else goes to the nameservers from /etc/resolv.conf, or the
+ * DNSServer lines of the config file. The A and AAAA queries are sent
+ * together over UDP and a truncated answer is asked for again over TCP.
+ * The search list and the options ndots, timeout and attempts of
+ * resolv.conf are followed, both files are read again once they change.
+ * The answers are kept in the cache all children share (see
+ * 'dnscache.c').
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include <limits.h>
+#ifdef HAVE_GETRANDOM
+#  include <sys/random.h>
+#endif
+
+#include "dns.h"
+#include "dnscache.h"
+#include "log.h"
+#include "sock.h"
+#include "text.h"
+#include "utils.h"
+#include "worker.h"
+
+#define RESOLV_CONF "/etc/resolv.conf"
+#define HOSTS_FILE "/etc/hosts"
+
+#define DNS_PORT 53
+#define DNS_MAX_SERVERS 3
+#define DNS_MAX_SEARCH 6
+#define DNS_PACKET 512		/* the most UDP brings without EDNS */
+#define DNS_HEADER 12
+#define DNS_QUERY (DNS_HEADER + DNS_NAME_MAX + 1 + 4)
+
+/*
+ * Once one of the queries brought addresses, the other one gets this many
+ * milliseconds more before the lookup goes on without it.
+ */
+#define DNS_SECOND_WAIT 100
+
+#define DNS_TYPE_A	1
+#define DNS_TYPE_CNAME	5
+#define DNS_TYPE_SOA	6
+#define DNS_TYPE_AAAA	28
+#define DNS_CLASS_IN	1
+
+#define DNS_NOERROR	0
+#define DNS_NXDOMAIN	3
+#define DNS_TRUNCATED	16	/* not an rcode, those have four bits */
+
+static struct {
+  union dns_sockaddr_u server[DNS_MAX_SERVERS];
+  int nservers;
+  int configured;		/* the servers are from DNSServer */
+  char search[DNS_MAX_SEARCH][DNS_NAME_MAX + 1];
+  int nsearch;
+  int ndots, timeout, attempts;
+  int inet6_first;		/* there is a route for IPv6 */
+  time_t mtime;
+} resolv = {.mtime = -1 };
+
+static struct {
+  char *text;
+  time_t mtime;
+} hosts = {.mtime = -1 };
+
+/*
+ * The state of the A or AAAA query of a lookup.
+ */
+struct query_s {
+  unsigned int type;
+  int done;
+  int count;
+  unsigned char addr[DNS_MAX_ADDRS / 2][16];
+  size_t len;
+  unsigned char packet[DNS_QUERY];
+};
+
+struct lookup_s {
+  const char *name;
+  unsigned int ttl, negttl;
+  int nxdomain;
+  int failed;			/* a server failed or answered with an error */
+  int error;			/* errno of a failed socket() */
+  struct query_s query[2];
+};
+
+static uint16_t get16(const unsigned char *p)
+{
+  return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16
+      | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put16(unsigned char *p, unsigned int v)
+{
+  p[0] = (unsigned char) (v >> 8);
+  p[1] = (unsigned char) v;
+}
+
+/*
+ * Whether the file changed since "*mtime", which is updated. A missing
+ * file has the time 0.
+ */
+static int file_changed(const char *path, time_t * mtime)
+{
+  struct stat st;
+  time_t now = stat(path, &st) == 0 ? st.st_mtime : 0;
+
+  if (now == *mtime)
+    return 0;
+  *mtime = now;
+  return 1;
+}
+
+static int parse_server(const char *addr, int port, union dns_sockaddr_u *sa)
+{
+  memset(sa, 0, sizeof(*sa));
+  if (inet_pton(AF_INET, addr, &sa->in.sin_addr) == 1) {
+    sa->in.sin_family = AF_INET;
+    sa->in.sin_port = htons(port);
+  } else if (inet_pton(AF_INET6, addr, &sa->in6.sin6_addr) == 1) {
+    sa->in6.sin6_family = AF_INET6;
+    sa->in6.sin6_port = htons(port);
+  } else
+    return -1;
+  return 0;
+}
+
+/*
+ * Use the nameserver at "addr" (DNSServer) instead of those from
+ * resolv.conf.
+ */
+int dns_add_server(const char *addr, int port)
+{
+  if (resolv.nservers == DNS_MAX_SERVERS && resolv.configured) {
+    log_message(LOG_WARNING, "Only %d DNSServer lines are used, ignoring %s.",
+		DNS_MAX_SERVERS, addr);
+    return -1;
+  }
+  if (!resolv.configured)
+    resolv.nservers = 0;
+  if (port <= 0 || port > 65535
+      || parse_server(addr, port, &resolv.server[resolv.nservers]) < 0) {
+    log_message(LOG_WARNING, "Invalid DNSServer %s, ignored.", addr);
+    return -1;
+  }
+  resolv.nservers++;
+  resolv.configured = TRUE;
+  return 0;
+}
+
+/*
+ * Whether the kernel has a route for addresses of the family. Nothing
+ * is sent by connecting a UDP socket.
+ */
+static int have_route(int family)
+{
+  union dns_sockaddr_u probe;
+  int fd, ret;
+
+  parse_server(family == AF_INET6 ? "2001:db8::1" : "192.0.2.1", DNS_PORT,
+	       &probe);
+  if ((fd = socket(family, SOCK_DGRAM, 0)) == -1)
+    return FALSE;
+  ret = connect(fd, &probe.sa, DNS_ADDRLEN(&probe)) == 0;
+  close(fd);
+  return ret;
+}
+
+static void load_resolv(void)
+{
+  char line[1024], *tok, *save;
+  FILE *f;
+
+  if (!resolv.configured)
+    resolv.nservers = 0;
+  resolv.nsearch = 0;
+  resolv.ndots = 1;
+  resolv.timeout = 5;
+  resolv.attempts = 2;
+
+  if ((f = fopen(RESOLV_CONF, "r"))) {
+    while (fgets(line, sizeof(line), f)) {
+      if (!(tok = strtok_r(line, " \t\r\n", &save)) || *tok == '#'
+	  || *tok == ';')
+	continue;
+
+      if (!strcmp(tok, "nameserver")) {
+	if (!resolv.configured && resolv.nservers < DNS_MAX_SERVERS
+	    && (tok = strtok_r(NULL, " \t\r\n", &save))
+	    && parse_server(tok, DNS_PORT,
+			    &resolv.server[resolv.nservers]) == 0)
+	  resolv.nservers++;
+      } else if (!strcmp(tok, "search") || !strcmp(tok, "domain")) {
+	resolv.nsearch = 0;
+	while (resolv.nsearch < DNS_MAX_SEARCH
+	       && (tok = strtok_r(NULL, " \t\r\n", &save)))
+	  strlcpy(resolv.search[resolv.nsearch++], tok, DNS_NAME_MAX + 1);
+      } else if (!strcmp(tok, "options")) {
+	while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+	  if (!strncmp(tok, "ndots:", 6))
+	    resolv.ndots = min(max(atoi(tok + 6), 0), 15);
+	  else if (!strncmp(tok, "timeout:", 8))
+	    resolv.timeout = min(max(atoi(tok + 8), 1), 30);
+	  else if (!strncmp(tok, "attempts:", 9))
+	    resolv.attempts = min(max(atoi(tok + 9), 1), 5);
+	}
+      }
+    }
+    fclose(f);
+  }
+
+  /* like the C library, ask the local host if nothing else is known */
+  if (resolv.nservers == 0) {
+    parse_server("127.0.0.1", DNS_PORT, &resolv.server[0]);
+    resolv.nservers = 1;
+  }
+
+  resolv.inet6_first = have_route(AF_INET6);
+}
+
+static void load_hosts(void)
+{
+  struct stat st;
+  int fd;
+
+  free(hosts.text);
+  hosts.text = NULL;
+  if ((fd = open(HOSTS_FILE, O_RDONLY)) == -1)
+    return;
+  if (fstat(fd, &st) == 0 && st.st_size < 1024 * 1024
+      && (hosts.text = malloc(st.st_size + 1))) {
+    ssize_t len = read(fd, hosts.text, st.st_size);
+
+    hosts.text[len > 0 ? len : 0] = '\0';
+  }
+  close(fd);
+}
+
+static void add_addr(struct dns_result_s *res, int family, const void *addr,
+		     uint16_t port)
+{
+  union dns_sockaddr_u *sa;
+
+  if (res->count == DNS_MAX_ADDRS)
+    return;
+  sa = &res->addr[res->count++];
+  memset(sa, 0, sizeof(*sa));
+  if (family == AF_INET6) {
+    sa->in6.sin6_family = AF_INET6;
+    sa->in6.sin6_port = htons(port);
+    memcpy(&sa->in6.sin6_addr, addr, 16);
+  } else {
+    sa->in.sin_family = AF_INET;
+    sa->in.sin_port = htons(port);
+    memcpy(&sa->in.sin_addr, addr, 4);
+  }
+}
+
+static int add_numeric(const char *str, uint16_t port,
+		       struct dns_result_s *res)
+{
+  unsigned char addr[16];
+
+  if (inet_pton(AF_INET, str, addr) == 1)
+    add_addr(res, AF_INET, addr, port);
+  else if (inet_pton(AF_INET6, str, addr) == 1)
+    add_addr(res, AF_INET6, addr, port);
+  else
+    return FALSE;
+  return TRUE;
+}
+
+/*
+ * Add the addresses /etc/hosts has for the name.
+ */
+static void lookup_hosts(const char *host, uint16_t port,
+			 struct dns_result_s *res)
+{
+  size_t hostlen = strlen(host), len;
+  char addr[INET6_ADDRSTRLEN], *line, *next, *p, *q;
+
+  for (line = hosts.text; line && *line; line = next) {
+    if ((next = strchr(line, '\n')))
+      *next = '\0';
+
+    /* the address, then the names up to the end or a comment */
+    p = line + strspn(line, " \t");
+    len = strcspn(p, " \t\r#");
+    if (len > 0 && len < sizeof(addr) && p[len] && p[len] != '#') {
+      memcpy(addr, p, len);
+      addr[len] = '\0';
+      for (q = p + len; *(q += strspn(q, " \t\r")) && *q != '#'; q += len) {
+	len = strcspn(q, " \t\r#");
+	if (len == hostlen && !strncasecmp(q, host, len)) {
+	  add_numeric(addr, port, res);
+	  break;
+	}
+      }
+    }
+
+    if (next)
+      *next++ = '\n';
+  }
+}
+
+static void random_bytes(void *buf, size_t len)
+{
+  static int fd = -1;
+
+#ifdef HAVE_GETRANDOM
+  if (getrandom(buf, len, GRND_NONBLOCK) == (ssize_t) len)
+    return;
+#endif
+  if (fd == -1)
+    fd = open("/dev/urandom", O_RDONLY);
+  if (fd == -1 || read(fd, buf, len) != (ssize_t) len) {
+    unsigned char *p = buf;
+
+    while (len--)
+      *p++ = (unsigned char) (random() ^ getpid());
+  }
+}
+
+static int build_query(struct query_s *q, const char *name, uint16_t id)
+{
+  unsigned char *p = q->packet + DNS_HEADER;
+  const char *s = name;
+  size_t n;
+
+  memset(q->packet, 0, DNS_HEADER);
+  put16(q->packet, id);
+  q->packet[2] = 0x01;		/* recursion desired */
+  q->packet[5] = 1;		/* one question */
+
+  while (*s) {
+    n = strcspn(s, ".");
+    if (n == 0 || n > 63
+	|| (size_t) (p - q->packet) - DNS_HEADER + n + 2 > DNS_NAME_MAX)
+      return -1;
+    *p++ = (unsigned char) n;
+    memcpy(p, s, n);
+    p += n;
+    s += n;
+    if (*s)
+      s++;
+  }
+  *p++ = 0;
+  put16(p, q->type);
+  put16(p + 2, DNS_CLASS_IN);
+  q->len = p + 4 - q->packet;
+  return 0;
+}
+
+/*
+ * Expand the (maybe compressed) name at "*pos" of the message as dotted
+ * text into "out" and move "*pos" behind it.
+ */
+static int read_name(const unsigned char *msg, size_t len, size_t *pos,
+		     char *out)
+{
+  size_t p = *pos, n = 0;
+  int hops = 0;
+  unsigned int c;
+
+  for (;;) {
+    if (p >= len)
+      return -1;
+    c = msg[p];
+    if (c >= 0xc0) {
+      if (p + 1 >= len || ++hops > 32)
+	return -1;
+      if (hops == 1)
+	*pos = p + 2;
+      p = (c & 0x3f) << 8 | msg[p + 1];
+      continue;
+    }
+    if (c >= 0x40)
+      return -1;
+    if (c == 0)
+      break;
+    if (p + 1 + c > len || n + 1 + c > DNS_NAME_MAX
+	|| memchr(msg + p + 1, '.', c) || memchr(msg + p + 1, '\0', c))
+      return -1;
+    if (n)
+      out[n++] = '.';
+    memcpy(out + n, msg + p + 1, c);
+    n += c;
+    p += 1 + c;
+  }
+  if (hops == 0)
+    *pos = p + 1;
+  out[n] = '\0';
+  return 0;
+}
+
+/*
+ * Check that "msg" answers the query and take the addresses from it,
+ * following CNAMEs. Returns the rcode, DNS_TRUNCATED, or -1 if it is not
+ * an answer to the query at all.
+ */
+static int parse_answer(const unsigned char *msg, size_t len,
+			struct lookup_s *l, struct query_s *q, uint16_t id)
+{
+  char owner[DNS_NAME_MAX + 1], name[DNS_NAME_MAX + 1];
+  unsigned int count, i, type, rdlen, alen = q->type == DNS_TYPE_A ? 4 : 16;
+  uint32_t ttl;
+  size_t pos = DNS_HEADER, p;
+  int rcode;
+
+  if (len < DNS_HEADER || get16(msg) != id || !(msg[2] & 0x80)
+      || (msg[2] & 0x78) || get16(msg + 4) != 1)
+    return -1;
+  if (read_name(msg, len, &pos, owner) < 0 || pos + 4 > len
+      || strcasecmp(owner, l->name) || get16(msg + pos) != q->type
+      || get16(msg + pos + 2) != DNS_CLASS_IN)
+    return -1;
+  pos += 4;
+
+  if (msg[2] & 0x02)
+    return DNS_TRUNCATED;
+  if ((rcode = msg[3] & 0x0f) != DNS_NOERROR && rcode != DNS_NXDOMAIN)
+    return rcode;
+
+  strlcpy(name, l->name, sizeof(name));
+  count = get16(msg + 6) + get16(msg + 8);
+  for (i = 0; i < count; i++) {
+    if (read_name(msg, len, &pos, owner) < 0 || pos + 10 > len)
+      break;
+    type = get16(msg + pos);
+    ttl = get32(msg + pos + 4);
+    rdlen = get16(msg + pos + 8);
+    pos += 10;
+    if (pos + rdlen > len)
+      break;
+
+    if (get16(msg + pos - 8) != DNS_CLASS_IN) {
+      /* not for us */
+    } else if (i < get16(msg + 6)) {
+      if (strcasecmp(owner, name)) {
+	/* not for us */
+      } else if (type == DNS_TYPE_CNAME) {
+	p = pos;
+	if (read_name(msg, len, &p, name) < 0)
+	  break;
+	l->ttl = min(l->ttl, ttl);
+      } else if (type == q->type && rdlen == alen
+		 && q->count < DNS_MAX_ADDRS / 2) {
+	memcpy(q->addr[q->count++], msg + pos, alen);
+	l->ttl = min(l->ttl, ttl);
+      }
+    } else if (type == DNS_TYPE_SOA) {
+      /* a negative answer may be kept for the SOA's minimum TTL */
+      p = pos;
+      if (read_name(msg, len, &p, owner) == 0
+	  && read_name(msg, len, &p, owner) == 0 && p + 20 <= pos + rdlen)
+	l->negttl = min(ttl, get32(msg + p + 16));
+    }
+    pos += rdlen;
+  }
+  return rcode;
+}
+
+/*
+ * Send or receive "len" bytes on the non blocking TCP socket before
+ * "deadline".
+ */
+static int tcp_io(int fd, void *buf, size_t len, int out, long deadline)
+{
+  struct pollfd pfd;
+  size_t done = 0;
+  ssize_t n;
+  long left;
+
+  while (done < len) {
+    if (out)
+      n = send(fd, (char *) buf + done, len - done, MSG_NOSIGNAL);
+    else
+      n = recv(fd, (char *) buf + done, len - done, 0);
+    if (n > 0) {
+      done += n;
+      continue;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+      return -1;
+    if ((left = deadline - monotonic_ms()) <= 0)
+      return -1;
+    pfd.fd = fd;
+    pfd.events = out ? POLLOUT : POLLIN;
+    if (worker_poll(&pfd, 1, left) < 0 && errno != EINTR)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Ask the query again over TCP, for an answer which did not fit into a
+ * UDP packet.
+ */
+static int tcp_query(struct lookup_s *l, struct query_s *q,
+		     const union dns_sockaddr_u *server, long deadline)
+{
+  unsigned char lenbuf[2], *answer = NULL;
+  struct pollfd pfd;
+  int fd, err = 0, ret = -1;
+  socklen_t errlen = sizeof(err);
+  size_t len;
+  long left;
+
+  if ((fd = socket(server->sa.sa_family, SOCK_STREAM, 0)) == -1)
+    return -1;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  socket_nonblocking(fd);
+
+  if (connect(fd, &server->sa, DNS_ADDRLEN(server)) == -1) {
+    if (errno != EINPROGRESS || (left = deadline - monotonic_ms()) <= 0)
+      goto out;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    if (worker_poll(&pfd, 1, left) <= 0
+	|| getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err)
+      goto out;
+  }
+
+  put16(lenbuf, q->len);
+  if (tcp_io(fd, lenbuf, 2, TRUE, deadline) < 0
+      || tcp_io(fd, q->packet, q->len, TRUE, deadline) < 0
+      || tcp_io(fd, lenbuf, 2, FALSE, deadline) < 0)
+    goto out;
+  len = get16(lenbuf);
+  if (!(answer = malloc(len)) || tcp_io(fd, answer, len, FALSE, deadline) < 0)
+    goto out;
+
+  ret = parse_answer(answer, len, l, q, get16(q->packet));
+  if (ret == DNS_TRUNCATED)
+    ret = -1;
+
+out:
+  free(answer);
+  close(fd);
+  return ret;
+}
+
+/*
+ * Send the open queries to one server and wait for its answers until
+ * "deadline". Returns when all queries are done or the server is of no
+ * more use.
+ */
+static void try_server(struct lookup_s *l, const union dns_sockaddr_u *server,
+		       long deadline, long end)
+{
+  unsigned char buf[DNS_PACKET];
+  struct query_s *q;
+  struct pollfd pfd;
+  int fd, i, open = 0, rcode = -1;
+  ssize_t len;
+  long left;
+
+  if ((fd = socket(server->sa.sa_family, SOCK_DGRAM, 0)) == -1) {
+    l->error = errno;
+    return;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  socket_nonblocking(fd);
+
+  /* a connected socket only gets the answers of this server */
+  if (connect(fd, &server->sa, DNS_ADDRLEN(server)) == -1) {
+    close(fd);
+    return;
+  }
+  for (i = 0; i < 2; i++) {
+    if (l->query[i].done)
+      continue;
+    /* the second send() may already see the ICMP error of the first */
+    if (send(fd, l->query[i].packet, l->query[i].len, MSG_NOSIGNAL) < 0) {
+      l->failed = TRUE;
+      close(fd);
+      return;
+    }
+    open++;
+  }
+
+  while (open > 0 && (left = deadline - monotonic_ms()) > 0) {
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (worker_poll(&pfd, 1, left) <= 0) {
+      if (errno == EINTR)
+	continue;
+      break;
+    }
+    if ((len = recv(fd, buf, sizeof(buf), 0)) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	continue;
+      l->failed = TRUE;		/* ECONNREFUSED, nobody there */
+      break;
+    }
+
+    for (i = 0; i < 2; i++) {
+      q = &l->query[i];
+      if (q->done
+	  || (rcode = parse_answer(buf, len, l, q, get16(q->packet))) < 0)
+	continue;
+      if (rcode == DNS_TRUNCATED)
+	rcode = tcp_query(l, q, server, end);
+      break;
+    }
+    if (i == 2)
+      continue;			/* somebody else's packet */
+
+    if (rcode == DNS_NOERROR) {
+      q->done = TRUE;
+      open--;
+    } else if (rcode == DNS_NXDOMAIN) {
+      l->nxdomain = TRUE;
+      l->query[0].done = l->query[1].done = TRUE;
+      break;
+    } else {
+      q->count = 0;
+      l->failed = TRUE;
+      break;
+    }
+
+    /* do not wait long for the second one if the first had addresses */
+    if (open > 0 && q->count > 0)
+      deadline = min(deadline, monotonic_ms() + DNS_SECOND_WAIT);
+  }
+  close(fd);
+}
+
+/*
+ * Look up the name as it is, without the search list.
+ */
+static int lookup(const char *name, uint16_t port, struct dns_result_s *res,
+		  long end)
+{
+  struct lookup_s l;
+  uint16_t ids[2];
+  int try, i, k, order;
+
+  memset(&l, 0, sizeof(l));
+  l.name = name;
+  l.ttl = l.negttl = UINT_MAX;
+  l.query[0].type = DNS_TYPE_A;
+  l.query[1].type = DNS_TYPE_AAAA;
+  random_bytes(ids, sizeof(ids));
+  for (i = 0; i < 2; i++) {
+    if (build_query(&l.query[i], name, ids[i]) < 0)
+      return DNS_EBADNAME;
+  }
+
+  for (try = 0; try < resolv.attempts * resolv.nservers; try++) {
+    try_server(&l, &resolv.server[try % resolv.nservers],
+	       min(end, monotonic_ms() + resolv.timeout * 1000L), end);
+    if (l.nxdomain || l.query[0].count + l.query[1].count > 0
+	|| (l.query[0].done && l.query[1].done) || monotonic_ms() >= end)
+      break;
+  }
+
+  /* IPv6 first if there is a route for it */
+  order = resolv.inet6_first ? 1 : 0;
+  for (k = 0; k < 2; k++) {
+    struct query_s *q = &l.query[order ^ k];
+
+    for (i = 0; i < q->count; i++)
+      add_addr(res, q->type == DNS_TYPE_A ? AF_INET : AF_INET6, q->addr[i],
+	       port);
+  }
+
+  if (res->count > 0) {
+    res->ttl = l.ttl;
+    return 0;
+  }
+  res->ttl = l.negttl == UINT_MAX ? 0 : l.negttl;
+  if (l.nxdomain || (l.query[0].done && l.query[1].done))
+    return DNS_ENOTFOUND;
+  if (l.failed)
+    return DNS_EFAIL;
+  if (l.error) {
+    errno = l.error;
+    return DNS_ESYSTEM;
+  }
+  return DNS_ETIMEDOUT;
+}
+
+/*
+ * Look up the name with the search list, the way resolv.conf says.
+ */
+static int search(const char *host, size_t len, uint16_t port,
+		  struct dns_result_s *res)
+{
+  char name[DNS_NAME_MAX + 1], fqdn[DNS_NAME_MAX + 1];
+  int absolute, dots, i, ret = DNS_ENOTFOUND;
+  const char *p;
+  long end;
+
+  absolute = host[len - 1] == '.';
+  strlcpy(name, host, absolute ? len : len + 1);
+  for (dots = 0, p = name; (p = strchr(p, '.')); p++, dots++);
+
+  end = monotonic_ms() + config.dnstimeout * 1000L;
+
+  /* with enough dots the name is tried as it is first */
+  if (absolute || dots >= resolv.ndots) {
+    if ((ret = lookup(name, port, res, end)) != DNS_ENOTFOUND || absolute)
+      return ret;
+  }
+  for (i = 0; i < resolv.nsearch; i++) {
+    if (snprintf(fqdn, sizeof(fqdn), "%s.%s", name, resolv.search[i])
+	>= (int) sizeof(fqdn))
+      continue;
+    if ((ret = lookup(fqdn, port, res, end)) != DNS_ENOTFOUND)
+      return ret;
+  }
+  if (dots < resolv.ndots)
+    ret = lookup(name, port, res, end);
+  return ret;
+}
+
+/*
+ * Find the addresses of "host" and fill them into "res" with "port".
+ * Returns 0 if there is at least one, else one of the DNS_E* errors.
+ */
+int dns_resolve(const char *host, uint16_t port, struct dns_result_s *res)
+{
+  size_t len = strlen(host);
+  int ret;
+
+  res->count = 0;
+  res->ttl = 0;
+  if (add_numeric(host, port, res))
+    return 0;
+
+  if (file_changed(RESOLV_CONF, &resolv.mtime))
+    load_resolv();
+  if (file_changed(HOSTS_FILE, &hosts.mtime))
+    load_hosts();
+
+  lookup_hosts(host, port, res);
+  if (res->count > 0)
+    return 0;
+
+  if (len == 0 || len > DNS_NAME_MAX || !strcmp(host, "."))
+    return DNS_EBADNAME;
+
+  if ((ret = dns_cache_lookup(host, port, res)) != DNS_CACHE_MISS)
+    return ret;
+  ret = search(host, len, port, res);
+  dns_cache_store(host, ret, res);
+  return ret;
+}
+
+const char *dns_strerror(int err)
+{
+  switch (err) {
+  case DNS_ENOTFOUND:
+    return "Name or service not known";
+  case DNS_ETIMEDOUT:
+    return "Timeout while resolving";
+  case DNS_EFAIL:
+    return "Temporary failure in name resolution";
+  case DNS_EBADNAME:
+    return "Invalid host name";
+  case DNS_ESYSTEM:
+    return strerror(errno);
+  }
+  return "Unknown error";
+}
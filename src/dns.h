@@ -0,0 +1,53 @@
+/* $Id$
+ *
+ * See 'dns.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_DNS_H
+#define TINYPROXY_DNS_H
+
+#define DNS_NAME_MAX 255
+#define DNS_MAX_ADDRS 16
+
+/* errors of dns_resolve() */
+#define DNS_ENOTFOUND	-1	/* no such name, or no addresses for it */
+#define DNS_ETIMEDOUT	-2	/* no answer within DNSTimeout */
+#define DNS_EFAIL	-3	/* the nameservers could not answer */
+#define DNS_EBADNAME	-4	/* not a valid host name */
+#define DNS_ESYSTEM	-5	/* no sockets, see errno */
+
+union dns_sockaddr_u {
+  struct sockaddr sa;
+  struct sockaddr_in in;
+  struct sockaddr_in6 in6;
+};
+
+#define DNS_ADDRLEN(a) \
+  ((a)->sa.sa_family == AF_INET6 ? sizeof((a)->in6) : sizeof((a)->in))
+
+/*
+ * The addresses of a name with the port filled in, ready for connect().
+ * "ttl" is how many seconds the answer may be kept.
+ */
+struct dns_result_s {
+  int count;
+  unsigned int ttl;
+  union dns_sockaddr_u addr[DNS_MAX_ADDRS];
+};
+
+extern int dns_add_server(const char *addr, int port);
+extern int dns_resolve(const char *host, uint16_t port,
+		       struct dns_result_s *res);
+extern const char *dns_strerror(int err);
+
+#endif
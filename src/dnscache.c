@@ -0,0 +1,238 @@
+/* $Id$
+ *
+ * The answers of the nameservers, kept for all children as long as their
+ * TTL allows. A name which does not exist is kept as well, as long as
+ * the SOA record of the answer says (RFC 2308), so a mistyped name is not
+ * asked for again on every request.
+ *
+ * The cache is a table of DNSCacheSize entries in shared memory, set up
+ * before the children are forked. A name can only be in one of the
+ * DNS_CACHE_WAYS entries of its set, so the table never grows and a new
+ * answer replaces the entry of the same name in place, or else the one
+ * of the set which expires first.
+ *
+ * Reading takes no lock. Every entry has a sequence word, the process id
+ * of the child writing the entry and a generation which goes up with
+ * every write. A reader copies the entry and uses the copy only if there
+ * was no writer and the word did not change meanwhile. Writers claim an
+ * entry by putting their process id into the word with a compare and
+ * swap, a child which finds the entry claimed already simply does not
+ * store its answer. Should a child die while writing, its claim is taken
+ * over once it is older than DNS_CACHE_STUCK ms and the process is gone.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include "dnscache.h"
+#include "heap.h"
+#include "log.h"
+#include "scan.h"
+#include "stats.h"
+#include "text.h"
+#include "utils.h"
+
+#define DNS_CACHE_WAYS 4
+
+/* no answer is kept longer than this many seconds */
+#define DNS_CACHE_MAX_TTL	86400
+#define DNS_CACHE_MAX_NEGTTL	10800
+
+/* a write takes microseconds, a claim this old (ms) may be left over */
+#define DNS_CACHE_STUCK		1000
+
+/* the sequence word: generation << 32 | process id of the writer */
+#define SEQ_WRITER(seq)	((pid_t) ((seq) & 0xffffffffU))
+#define SEQ_CLAIM(seq, pid) (((seq) & ~(uint64_t) 0xffffffffU) | (uint32_t) (pid))
+#define SEQ_NEXT(seq)	(((seq) | 0xffffffffU) + 1)
+
+struct entry_s {
+  uint64_t seq;
+  long claimed;			/* monotonic_ms() of the latest claim */
+  uint32_t hash;
+  long expires;			/* monotonic_ms(), 0 for an unused entry */
+  int error;			/* 0 or DNS_ENOTFOUND */
+  int count;
+  char name[DNS_NAME_MAX + 1];
+  union dns_sockaddr_u addr[DNS_MAX_ADDRS];
+};
+
+static struct entry_s *table;
+static unsigned int nsets;
+
+/*
+ * Set up the cache for "entries" names (rounded up to a whole set), or
+ * none at all for 0. Must be called before the children are forked.
+ */
+int dns_cache_init(int entries)
+{
+  if (entries <= 0)
+    return 0;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+  nsets = (unsigned int) (entries + DNS_CACHE_WAYS - 1) / DNS_CACHE_WAYS;
+  table = calloc_shared_memory(nsets * DNS_CACHE_WAYS, sizeof(struct entry_s));
+  if (table == MAP_FAILED) {
+    log_message(LOG_ERR, "Could not allocate the DNS cache: %s",
+		strerror(errno));
+    table = NULL;
+    return -1;
+  }
+  log_message(LOG_INFO, "DNS cache for %u names.", nsets * DNS_CACHE_WAYS);
+#else
+  log_message(LOG_WARNING, "No DNS cache without atomic operations.");
+#endif
+  return 0;
+}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+static struct entry_s *find_set(const char *name, uint32_t * hash)
+{
+  *hash = scan_hash(name, strlen(name));
+  return &table[(*hash % nsets) * DNS_CACHE_WAYS];
+}
+
+/*
+ * Copy the entry, returns FALSE if it was written meanwhile.
+ */
+static int read_entry(const struct entry_s *entry, struct entry_s *copy)
+{
+  uint64_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+
+  if (SEQ_WRITER(seq))
+    return FALSE;
+  memcpy(copy, entry, sizeof(*copy));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/*
+ * Fill "res" with the cached answer for "name" and "port". Returns 0 or
+ * DNS_ENOTFOUND like dns_resolve(), or DNS_CACHE_MISS if the name is not
+ * in the cache or its answer expired.
+ */
+int dns_cache_lookup(const char *name, uint16_t port,
+		     struct dns_result_s *res)
+{
+  struct entry_s *set, copy;
+  uint32_t hash;
+  long now;
+  int i, k, expired = FALSE;
+
+  if (!table)
+    return DNS_CACHE_MISS;
+
+  set = find_set(name, &hash);
+  now = monotonic_ms();
+  for (i = 0; i < DNS_CACHE_WAYS; i++) {
+    if (set[i].hash != hash || !read_entry(&set[i], &copy)
+	|| copy.hash != hash || strcasecmp(copy.name, name))
+      continue;
+    if (copy.expires <= now) {
+      expired = TRUE;
+      continue;
+    }
+
+    res->ttl = (unsigned int) ((copy.expires - now + 999) / 1000);
+    res->count = copy.count;
+    memcpy(res->addr, copy.addr, copy.count * sizeof(res->addr[0]));
+    for (k = 0; k < res->count; k++) {
+      if (res->addr[k].sa.sa_family == AF_INET6)
+	res->addr[k].in6.sin6_port = htons(port);
+      else
+	res->addr[k].in.sin_port = htons(port);
+    }
+    update_stats(STAT_DNS_HIT);
+    return copy.error;
+  }
+
+  update_stats(expired ? STAT_DNS_EXPIRED : STAT_DNS_MISS);
+  return DNS_CACHE_MISS;
+}
+
+/*
+ * Is the claim "seq" on the entry left over by a child which died while
+ * writing? Only an old claim is looked at, the writer may still be busy
+ * otherwise.
+ */
+static int claim_stuck(const struct entry_s *entry, uint64_t seq)
+{
+  long claimed = __atomic_load_n(&entry->claimed, __ATOMIC_RELAXED);
+
+  return monotonic_ms() - claimed > DNS_CACHE_STUCK
+      && kill(SEQ_WRITER(seq), 0) == -1 && errno == ESRCH;
+}
+
+/*
+ * Keep the result "err" of dns_resolve() for "name" as long as its TTL
+ * says. Only addresses and names which do not exist are kept, the other
+ * errors say nothing about the name.
+ */
+void dns_cache_store(const char *name, int err,
+		     const struct dns_result_s *res)
+{
+  struct entry_s *set, *entry = NULL;
+  unsigned int ttl;
+  uint64_t seq;
+  uint32_t hash;
+  int i;
+
+  if (!table || res->ttl == 0 || (err != 0 && err != DNS_ENOTFOUND)
+      || strlen(name) > DNS_NAME_MAX)
+    return;
+  ttl = min(res->ttl, err ? DNS_CACHE_MAX_NEGTTL : DNS_CACHE_MAX_TTL);
+
+  /* the entry of the name, else the one which expires first */
+  set = find_set(name, &hash);
+  for (i = 0; i < DNS_CACHE_WAYS; i++) {
+    if (set[i].hash == hash && !strncasecmp(set[i].name, name, DNS_NAME_MAX)) {
+      entry = &set[i];
+      break;
+    }
+    if (!entry || set[i].expires < entry->expires)
+      entry = &set[i];
+  }
+
+  seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+  if ((SEQ_WRITER(seq) && !claim_stuck(entry, seq))
+      || !__atomic_compare_exchange_n(&entry->seq, &seq,
+				      SEQ_CLAIM(seq, getpid()), FALSE,
+				      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+  __atomic_store_n(&entry->claimed, monotonic_ms(), __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  entry->hash = hash;
+  entry->expires = monotonic_ms() + ttl * 1000L;
+  entry->error = err;
+  entry->count = err ? 0 : res->count;
+  strlcpy(entry->name, name, sizeof(entry->name));
+  memcpy(entry->addr, res->addr, entry->count * sizeof(entry->addr[0]));
+
+  __atomic_store_n(&entry->seq, SEQ_NEXT(seq), __ATOMIC_RELEASE);
+}
+
+#else
+
+int dns_cache_lookup(const char *name, uint16_t port,
+		     struct dns_result_s *res)
+{
+  return DNS_CACHE_MISS;
+}
+
+void dns_cache_store(const char *name, int err,
+		     const struct dns_result_s *res)
+{
+}
+
+#endif				/* HAVE_ATOMIC_BUILTINS */
@@ -0,0 +1,30 @@
+/* $Id$
+ *
+ * See 'dnscache.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_DNSCACHE_H
+#define TINYPROXY_DNSCACHE_H
+
+#include "dns.h"
+
+/* dns_cache_lookup() found nothing usable */
+#define DNS_CACHE_MISS 1
+
+extern int dns_cache_init(int entries);
+extern int dns_cache_lookup(const char *name, uint16_t port,
+			    struct dns_result_s *res);
+extern void dns_cache_store(const char *name, int err,
+			    const struct dns_result_s *res);
+
+#endif
@@ -0,0 +1,103 @@
+/* $Id$
+ *
+ * Free lists for the objects every connection needs: the connection
+ * structure, its two buffers, the rings behind them and the blocks of
+ * the request arena (see 'arena.c'). A child gets the same shapes for
+ * every connection it serves, so instead of handing them back to
+ * malloc() they are kept on a list and taken from there for the next
+ * one.
+ *
+ * All the lists of a child together keep at most FreeListMemory bytes,
+ * anything beyond that is freed right away, so an idle child does not
+ * sit on the memory of its busiest moment.
+ *
+ * How often malloc() and free() were called for these objects, and how
+ * often a list could serve instead, is added up per child and passed on
+ * to the statistics with freelist_report().
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include "freelist.h"
+#include "stats.h"
+
+/* bytes kept on all the lists of this process */
+static size_t retained;
+
+/* allocator calls since the last report */
+static unsigned long mallocs, frees, reused;
+
+/*
+ * An object of the list's size, from the list if there is one.
+ */
+void *freelist_get(struct freelist_s *list)
+{
+  void *ptr;
+
+  if ((ptr = list->head)) {
+    list->head = *(void **) ptr;
+    list->count--;
+    retained -= list->size;
+    reused++;
+    return ptr;
+  }
+
+  mallocs++;
+  return malloc(list->size);
+}
+
+/*
+ * Put an object back on the list, or free it if that would keep more than
+ * FreeListMemory bytes.
+ */
+void freelist_put(struct freelist_s *list, void *ptr)
+{
+  if (!ptr)
+    return;
+
+  if (retained + list->size > (size_t) config.freelistmemory) {
+    frees++;
+    free(ptr);
+    return;
+  }
+
+  *(void **) ptr = list->head;
+  list->head = ptr;
+  list->count++;
+  retained += list->size;
+}
+
+/*
+ * Free everything on the list.
+ */
+void freelist_flush(struct freelist_s *list)
+{
+  void *ptr;
+
+  while ((ptr = list->head)) {
+    list->head = *(void **) ptr;
+    frees++;
+    free(ptr);
+  }
+  retained -= list->count * list->size;
+  list->count = 0;
+}
+
+/*
+ * Add the allocator calls since the last time to the statistics.
+ */
+void freelist_report(void)
+{
+  stats_allocs(mallocs, frees, reused);
+  mallocs = frees = reused = 0;
+}
@@ -0,0 +1,35 @@
+/* $Id$
+ *
+ * See 'freelist.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_FREELIST_H
+#define TINYPROXY_FREELIST_H
+
+/*
+ * A list of free objects of one size.
+ */
+struct freelist_s {
+  void *head;
+  size_t size;
+  unsigned int count;
+};
+
+#define FREELIST_INIT(size) { NULL, (size), 0 }
+
+extern void *freelist_get(struct freelist_s *list);
+extern void freelist_put(struct freelist_s *list, void *ptr);
+extern void freelist_flush(struct freelist_s *list);
+extern void freelist_report(void);
+
+#endif
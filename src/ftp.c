@@ -31,6 +31,7 @@
 #include "log.h"
 #include "sock.h"
 #include "htmlerror.h"
+#include "worker.h"
 
 #define slash (info->type == 'd' ? "/" : "")
 
@@ -174,7 +175,8 @@ static void set_ftp_greeting(struct conn_s *connptr, char *str)
   if (!str || strncmp(str, "230-", 4))
     return;
 
-  buf = connptr->ftp_greeting = malloc(strlen(str) + 1);
+  buf = connptr->ftp_greeting =
+      arena_alloc(&connptr->arena, strlen(str) + 1);
 
   if (buf == NULL)
     return;
@@ -189,6 +191,7 @@ static void set_ftp_greeting(struct conn_s *connptr, char *str)
     buf += (tmp - str) + 2;
     str = tmp + 2;
   }
+  *buf = '\0';
 }
 
 #define HTTP_200_OK "HTTP/1.0 200 OK\r\n"
@@ -237,28 +240,25 @@ int send_and_receive(int fd, const char *cmd, char *buf, size_t buflen)
   size_t total = 0;
   char *pos = buf, *end, *tmp;
   int retval = -1, ret;
-  fd_set sfd;
-  struct timeval tv;
+  struct pollfd pfd;
 
-  tv.tv_sec = (long) config.idletimeout;
-  tv.tv_usec = 0;
+  pfd.fd = fd;
 
   if (cmd) {
 #ifdef FTPDEBUG
     log_message(LOG_INFO, "send_and_receive, Sending command '%.*s'.",
 		strlen(cmd) - 2, cmd);
 #endif
-    FD_ZERO(&sfd);
-    FD_SET(fd, &sfd);
-    switch ((ret = select(fd + 1, NULL, &sfd, NULL, &tv))) {
+    pfd.events = POLLOUT;
+    switch ((ret = worker_poll(&pfd, 1, config.idletimeout * 1000))) {
     case 0:
       log_error(buf, buflen,
-		  "send_and_receive, select() timeout while sending command '%.*s'",
+		  "send_and_receive, poll() timeout while sending command '%.*s'",
 		  strlen(cmd) - 2, cmd);
       return -1;
     case -1:
       log_error(buf, buflen,
-		  "send_and_receive, select() error while sending command '%.*s': %m",
+		  "send_and_receive, poll() error while sending command '%.*s': %m",
 		  strlen(cmd) - 2, cmd);
       return -1;
     default:
@@ -277,15 +277,14 @@ int send_and_receive(int fd, const char *cmd, char *buf, size_t buflen)
    * see "ftp.kernel.org" after PASS command
    */
   while (total < buflen) {
-    FD_ZERO(&sfd);
-    FD_SET(fd, &sfd);
-    switch ((ret = select(fd + 1, &sfd, NULL, NULL, &tv))) {
+    pfd.events = POLLIN;
+    switch ((ret = worker_poll(&pfd, 1, config.idletimeout * 1000))) {
     case 0:
-      log_error(buf, buflen, "send_and_receive, select() timeout while reading");
+      log_error(buf, buflen, "send_and_receive, poll() timeout while reading");
       return -1;
     case -1:
       log_error(buf, buflen,
-		  "send_and_receive, select() error while reading, %m");
+		  "send_and_receive, poll() error while reading, %m");
       return -1;
     default:
       ;
@@ -437,13 +436,13 @@ connect_ftp(struct conn_s *connptr, request_t *request, char *errbuf,
   if (code == 250 || code == 230) {
     if (file && *file) {
       ssize_t flen = strlen(file);
-      connptr->ftp_basedir = malloc(flen + 2);
+      connptr->ftp_basedir = arena_alloc(&connptr->arena, flen + 2);
       memcpy(connptr->ftp_basedir, file, flen);
       connptr->ftp_basedir[flen] = '/';
       connptr->ftp_basedir[flen + 1] = '\0';
     }
     file = NULL;
-    connptr->ftp_path = strdup(request->path);
+    connptr->ftp_path = arena_strdup(&connptr->arena, request->path);
   } else if (path) {
     snprintf(buf, sizeof(buf), "CWD %s\r\n", path);
     if ((code = send_and_receive(fd, buf, buf, sizeof(buf))) == -1)
@@ -453,7 +452,7 @@ connect_ftp(struct conn_s *connptr, request_t *request, char *errbuf,
       log_message(LOG_WARNING, "CWD: Unexpected answer: (%d), %s", code, buf);
       goto COMMON_ERROR_QUIT;
     }
-    connptr->ftp_path = strdup(path);
+    connptr->ftp_path = arena_strdup(&connptr->arena, path);
   }
 
   /* 
@@ -481,7 +480,8 @@ connect_ftp(struct conn_s *connptr, request_t *request, char *errbuf,
    * open the data connection
    */
   connptr->server_fd = opensock(host, port, buf, sizeof(buf));
-  if (connptr->server_fd == -1) {
+  if (connptr->server_fd < 0) {
+    connptr->server_fd = -1;
     log_message(LOG_WARNING, "Could not setup data channel. %s", buf);
     indicate_http_error(connptr, 404, "Unable to setup data channel",
 			"detail",
@@ -783,20 +783,31 @@ COMMON_EXIT:
 }
 
 
+#define FTP_LISTING_SIZE (READ_BUFFER_SIZE * 2)
+
+/*
+ * Format the directory listing in "inbuf" into "buffptr". A line which is
+ * not complete yet stays in the connection until the rest comes, in
+ * worker mode the listings of several connections are read in turns.
+ */
 ssize_t
 add_to_buffer_formatted(struct buffer_s * buffptr, unsigned char *inbuf,
 			size_t buflen, struct conn_s * connptr)
 {
-  static char buf[READ_BUFFER_SIZE * 2] = { 0 };
   char outbuf[READ_BUFFER_SIZE * 4] = { 0 };
-  char *this, *next, *outpos, *eob;
+  char *buf, *this, *next, *outpos, *eob;
   struct ftpinfo_s info = {};
   size_t len;
 
-  if (buflen + connptr->offset >= sizeof(buf)) {
+  if (buflen + connptr->offset >= FTP_LISTING_SIZE) {
     log_message(LOG_ERR, "overlong line. %d", buflen + connptr->offset);
     return -1;
   }
+  if (!connptr->ftp_listing
+      && !(connptr->ftp_listing = arena_alloc(&connptr->arena,
+					      FTP_LISTING_SIZE)))
+    return -1;
+  buf = connptr->ftp_listing;
 
   memcpy(buf + connptr->offset, inbuf, buflen);
 
@@ -26,6 +26,7 @@
 #include "acl.h"
 #include "anonymous.h"
 #include "child.h"
+#include "dns.h"
 #include "filter.h"
 #include "htmlerror.h"
 #include "log.h"
@@ -45,10 +46,16 @@ static char *no_filter_support = "Filter support was not compiled in.";
 }
 
 /* statements */
-%token KW_PORT KW_LISTEN
+%token KW_PORT KW_LISTEN KW_LISTENSHARDING KW_LISTENSHARDING_CPU
 %token KW_LOGFILE KW_PIDFILE KW_SYSLOG
 %token KW_MAXCLIENTS KW_MAXSPARESERVERS KW_MINSPARESERVERS KW_STARTSERVERS
-%token KW_MAXREQUESTSPERCHILD
+%token KW_MAXREQUESTSPERCHILD KW_WORKERCONNECTIONS KW_ACCEPTQUEUE
+%token KW_RELAYOFFLOAD KW_IOURING
+%token KW_KEEPALIVETIMEOUT KW_MAXKEEPALIVEREQUESTS
+%token KW_CONNECTIONPOOL KW_CONNECTIONPOOLIDLE KW_CONNECTIONPOOLMAXAGE
+%token KW_RELAYBUFFERSIZE
+%token KW_FREELISTMEMORY
+%token KW_DNSTIMEOUT KW_DNSSERVER KW_DNSCACHESIZE
 %token KW_TIMEOUT
 %token KW_USER KW_GROUP
 %token KW_ANONYMOUS KW_XTINYPROXY
@@ -57,6 +64,8 @@ static char *no_filter_support = "Filter support was not compiled in.";
 %token KW_REVERSELOOKUP
 %token KW_UPSTREAM
 %token KW_BIND KW_CONNECTPORT KW_CONNECTTIMEOUT KW_CONNECTRETRIES
+%token KW_CONNECTATTEMPTDELAY KW_CONNECTORDER
+%token KW_CIRCUITBREAKER KW_CIRCUITBREAKERBACKOFF
 %token KW_STATHOST
 %token KW_ERRORPAGE KW_DEFAULT_ERRORPAGE
 %token KW_STATPAGE
@@ -121,6 +130,14 @@ statement
 	| KW_MINSPARESERVERS NUMBER	{ child_configure(CHILD_MINSPARESERVERS, $2); }
 	| KW_STARTSERVERS NUMBER	{ child_configure(CHILD_STARTSERVERS, $2); }
 	| KW_MAXREQUESTSPERCHILD NUMBER	{ child_configure(CHILD_MAXREQUESTSPERCHILD, $2); }
+	| KW_WORKERCONNECTIONS NUMBER
+	  {
+#ifdef WORKER_SUPPORT
+		  child_configure(CHILD_WORKERCONNECTIONS, $2);
+#else
+		  log_message(LOG_WARNING, "Worker support was not compiled in.");
+#endif
+	  }
         | KW_LOGFILE string
 	  {
 	          config.logf_name = $2;
@@ -252,10 +269,34 @@ statement
 		  log_message(LOG_INFO, "Establishing listening socket on IP %s", $2);
                   add_listener($2, $4);
           }
+	| KW_LISTENSHARDING NUMBER	{ config.listensharding = $2; }
+	| KW_LISTENSHARDING_CPU yesno	{ config.listensharding_cpu = $2; }
+	| KW_ACCEPTQUEUE NUMBER		{ config.acceptqueue = $2; }
+	| KW_RELAYOFFLOAD NUMBER	{ config.relayoffload = $2; }
+	| KW_IOURING yesno		{ config.iouring = $2; }
+	| KW_KEEPALIVETIMEOUT NUMBER	{ config.keepalivetimeout = $2; }
+	| KW_MAXKEEPALIVEREQUESTS NUMBER { config.maxkeepaliverequests = $2; }
+	| KW_CONNECTIONPOOL NUMBER	{ config.connectionpool = $2; }
+	| KW_CONNECTIONPOOLIDLE NUMBER	{ config.connectionpoolidle = $2; }
+	| KW_CONNECTIONPOOLMAXAGE NUMBER { config.connectionpoolmaxage = $2; }
+	| KW_RELAYBUFFERSIZE NUMBER	{ config.relaybuffersize = $2; }
+	| KW_FREELISTMEMORY NUMBER	{ config.freelistmemory = $2; }
         | KW_LOGLEVEL loglevels         { set_log_level($2); }
         | KW_CONNECTPORT NUMBER         { add_connect_port_allowed($2); }
 	| KW_CONNECTTIMEOUT NUMBER      { config.connecttimeout = $2; }
 	| KW_CONNECTRETRIES NUMBER      { config.connectretries = $2; }
+	| KW_CONNECTATTEMPTDELAY NUMBER	{ config.connectdelay = $2; }
+	| KW_CIRCUITBREAKER NUMBER	{ config.circuitbreaker = $2; }
+	| KW_CIRCUITBREAKERBACKOFF NUMBER { config.circuitbreakerbackoff = $2; }
+	| KW_CONNECTORDER string
+	  {
+		  if (set_connect_order($2) < 0)
+			  log_message(LOG_WARNING, "Unknown ConnectOrder \"%s\", using the default.", $2);
+	  }
+	| KW_DNSTIMEOUT NUMBER		{ config.dnstimeout = $2; }
+	| KW_DNSCACHESIZE NUMBER	{ config.dnscachesize = $2; }
+	| KW_DNSSERVER NUMERIC_ADDRESS	{ dns_add_server($2, 53); }
+	| KW_DNSSERVER NUMERIC_ADDRESS ':' NUMBER { dns_add_server($2, $4); }
         | KW_BIND NUMERIC_ADDRESS
           {
 #ifndef TRANSPARENT_PROXY
@@ -28,6 +28,7 @@
 #include "tinyproxy-ex.h"
 
 #include "hashmap.h"
+#include "scan.h"
 
 
 /*
@@ -74,13 +75,7 @@ static int hashfunc(const char *key, unsigned int size)
   if (size == 0)
     return -ERANGE;
 
-  for (hash = tolower(*key++); *key != '\0'; key++) {
-    uint32_t bit = (hash & 1) ? (1 << (sizeof(uint32_t) - 1)) : 0;
-
-    hash >>= 1;
-
-    hash += tolower(*key) + bit;
-  }
+  hash = scan_hash(key, strlen(key));
 
   /* Keep the hash within the table limits */
   return hash % size;
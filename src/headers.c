@@ -0,0 +1,205 @@
+/* $Id$
+ *
+ * The headers of a request or response. They are kept in a flat array in
+ * the order they arrived, which is also the order they are passed on in,
+ * and found through a small open addressing index on a case-insensitive
+ * hash of their names (see scan_hash()), which is computed once when a
+ * header is added.
+ *
+ * A name may appear more than once, headers_find_next() returns the next
+ * one. Removing a header only marks it as removed, the slot stays where
+ * it is until the table goes away. The table lives for one message, so it
+ * never needs to be compacted.
+ *
+ * Nothing is copied, the names and values point into the head of the
+ * message (see parse_head()) and have to stay there while the table is
+ * in use. The table itself is allocated from the arena of the request
+ * and goes away with it.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include "headers.h"
+#include "scan.h"
+
+/*
+ * Enough for almost every message. The entries and the index come with
+ * the table itself, they only get allocated separately once it grows.
+ */
+#define HEADERS_INITIAL 32
+
+headers_t headers_create(struct arena_s *arena)
+{
+  headers_t headers;
+
+  headers = arena_calloc(arena, 1, sizeof(struct headers_s)
+			 + HEADERS_INITIAL * sizeof(struct header_s)
+			 + 2 * HEADERS_INITIAL * sizeof(unsigned int));
+  if (!headers)
+    return NULL;
+
+  headers->arena = arena;
+  headers->entry = (struct header_s *) (headers + 1);
+  headers->allocated = HEADERS_INITIAL;
+  headers->index = (unsigned int *) (headers->entry + HEADERS_INITIAL);
+  headers->mask = 2 * HEADERS_INITIAL - 1;
+  return headers;
+}
+
+/*
+ * Double the room for entries, the index stays at twice that size and is
+ * built again without the removed headers. The old arrays stay in the
+ * arena.
+ */
+static int headers_grow(headers_t headers)
+{
+  unsigned int allocated = headers->allocated * 2, i, slot;
+  struct header_s *entry;
+  unsigned int *index;
+
+  index = arena_calloc(headers->arena, 2 * allocated, sizeof(unsigned int));
+  entry = arena_alloc(headers->arena, allocated * sizeof(struct header_s));
+  if (!index || !entry)
+    return -1;
+  memcpy(entry, headers->entry, headers->count * sizeof(struct header_s));
+
+  headers->entry = entry;
+  headers->allocated = allocated;
+  headers->index = index;
+  headers->mask = 2 * allocated - 1;
+
+  for (i = 0; i < headers->count; i++) {
+    if (entry[i].removed)
+      continue;
+    for (slot = entry[i].hash & headers->mask; index[slot];
+	 slot = (slot + 1) & headers->mask);
+    index[slot] = i + 1;
+  }
+  return 0;
+}
+
+/*
+ * Add a header after the ones already there. Name and value are not
+ * copied and must be NUL terminated.
+ *
+ * Returns: negative on error
+ *          0 upon successful insert
+ */
+int headers_add(headers_t headers, char *name, size_t namelen,
+		char *value, size_t valuelen)
+{
+  struct header_s *hdr;
+  unsigned int slot;
+
+  if (headers->count == headers->allocated && headers_grow(headers) < 0)
+    return -1;
+
+  hdr = &headers->entry[headers->count++];
+  hdr->name = name;
+  hdr->namelen = namelen;
+  hdr->value = value;
+  hdr->valuelen = valuelen;
+  hdr->hash = scan_hash(name, namelen);
+  hdr->removed = FALSE;
+
+  for (slot = hdr->hash & headers->mask; headers->index[slot];
+       slot = (slot + 1) & headers->mask);
+  headers->index[slot] = headers->count;
+  return 0;
+}
+
+/*
+ * Find the first header called "name", or remove all of them and count
+ * them in "*removed" if it is given. Along a probe sequence the headers
+ * are in the order they arrived, the index is always filled that way.
+ */
+static struct header_s *headers_lookup(headers_t headers, const char *name,
+				       unsigned int *removed)
+{
+  size_t len = strlen(name);
+  uint32_t hash = scan_hash(name, len);
+  unsigned int slot;
+  struct header_s *hdr;
+
+  for (slot = hash & headers->mask; headers->index[slot];
+       slot = (slot + 1) & headers->mask) {
+    hdr = &headers->entry[headers->index[slot] - 1];
+    if (hdr->hash != hash || hdr->removed || hdr->namelen != len
+	|| strncasecmp(hdr->name, name, len) != 0)
+      continue;
+    if (!removed)
+      return hdr;
+    hdr->removed = TRUE;
+    (*removed)++;
+  }
+  return NULL;
+}
+
+/*
+ * The first header called "name", NULL if there is none.
+ */
+struct header_s *headers_find(headers_t headers, const char *name)
+{
+  return headers_lookup(headers, name, NULL);
+}
+
+/*
+ * The next header with the same name as "prev", NULL if there is none.
+ * "prev" may have been removed in the meantime.
+ */
+struct header_s *headers_find_next(headers_t headers, struct header_s *prev)
+{
+  struct header_s *hdr = prev, *end = headers->entry + headers->count;
+
+  while (++hdr < end)
+    if (!hdr->removed && hdr->hash == prev->hash && hdr->namelen == prev->namelen
+	&& strncasecmp(hdr->name, prev->name, prev->namelen) == 0)
+      return hdr;
+  return NULL;
+}
+
+/*
+ * The value of the first header called "name", NULL if there is none.
+ */
+char *headers_get(headers_t headers, const char *name)
+{
+  struct header_s *hdr = headers_lookup(headers, name, NULL);
+
+  return hdr ? hdr->value : NULL;
+}
+
+/*
+ * Remove all the headers called "name", returns how many there were.
+ */
+unsigned int headers_remove(headers_t headers, const char *name)
+{
+  unsigned int removed = 0;
+
+  headers_lookup(headers, name, &removed);
+  return removed;
+}
+
+/*
+ * The header after "prev" which was not removed, the first one if "prev"
+ * is NULL.
+ */
+struct header_s *headers_next(headers_t headers, struct header_s *prev)
+{
+  struct header_s *hdr = prev ? prev + 1 : headers->entry;
+  struct header_s *end = headers->entry + headers->count;
+
+  for (; hdr < end; hdr++)
+    if (!hdr->removed)
+      return hdr;
+  return NULL;
+}
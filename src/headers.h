@@ -0,0 +1,62 @@
+/* $Id$
+ *
+ * See 'headers.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_HEADERS_H
+#define TINYPROXY_HEADERS_H
+
+#include "arena.h"
+
+/*
+ * A header of a message. Name and value point into the head it was read
+ * from.
+ */
+struct header_s {
+  char *name;
+  char *value;
+  size_t namelen, valuelen;
+  uint32_t hash;
+  unsigned int removed:1;
+};
+
+struct headers_s {
+  struct arena_s *arena;
+  struct header_s *entry;	/* in the order they arrived */
+  unsigned int count, allocated;
+  unsigned int *index;		/* entry number + 1, 0 for a free slot */
+  unsigned int mask;
+};
+
+typedef struct headers_s *headers_t;
+
+extern headers_t headers_create(struct arena_s *arena);
+
+extern int headers_add(headers_t headers, char *name, size_t namelen,
+		       char *value, size_t valuelen);
+extern struct header_s *headers_find(headers_t headers, const char *name);
+extern struct header_s *headers_find_next(headers_t headers,
+					  struct header_s *prev);
+extern char *headers_get(headers_t headers, const char *name);
+extern unsigned int headers_remove(headers_t headers, const char *name);
+
+/*
+ * Walk through the headers still there in the order they arrived:
+ *
+ *	for (hdr = headers_first(h); hdr; hdr = headers_next(h, hdr))
+ */
+#define headers_first(h) headers_next((h), NULL)
+extern struct header_s *headers_next(headers_t headers,
+				     struct header_s *prev);
+
+#endif
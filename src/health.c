@@ -0,0 +1,496 @@
+/* $Id$
+ *
+ * How the connects to each server address went lately, shared by all
+ * children. An address which failed CircuitBreaker times in a row is
+ * taken out ("the breaker opens"): nobody tries it for the next
+ * CircuitBreakerBackoff seconds, and a request for a name without any
+ * other address gets an error page right away instead of waiting for the
+ * connect timeout once more. After that time a single connect is let
+ * through as a probe. If it works the address is back, if not it stays
+ * out twice as long as before, up to HEALTH_MAX_BACKOFF seconds.
+ *
+ * Upstream proxies are reached through opensock() as well, so they are
+ * looked after the same way, by the addresses of their names.
+ *
+ * The table has a fixed size and lives in shared memory. It is divided
+ * into sets of HEALTH_WAYS entries, an address goes into the set of its
+ * hash and replaces the entry used the longest time ago, preferably one
+ * which is not out. Only a failed connect makes an entry. Each set has
+ * a lock which is only held while its entries are looked at, never while
+ * waiting for anything.
+ *
+ * A second, smaller table in the same form keeps which address family
+ * the last connection to each name and port went over, for the stats
+ * page. It is there with or without the circuit breaker.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include <sched.h>
+
+#include "health.h"
+#include "heap.h"
+#include "log.h"
+#include "scan.h"
+#include "stats.h"
+#include "text.h"
+#include "utils.h"
+
+#define HEALTH_SETS 256
+#define HEALTH_WAYS 4
+#define HEALTH_NAME 64
+#define HEALTH_MAX_BACKOFF 300
+#define HEALTH_DEST_SETS 16
+
+#define STATE_CLOSED	0	/* the address is used */
+#define STATE_OPEN	1	/* ... is not, until "retry" */
+#define STATE_PROBING	2	/* ... one connect is under way */
+
+struct health_s {
+  union dns_sockaddr_u addr;	/* family 0 for an unused entry */
+  char name[HEALTH_NAME];
+  int state;
+  int timeouts;			/* the last failure was a timeout */
+  unsigned int failures;	/* in a row */
+  unsigned int backoff;		/* seconds */
+  long retry;			/* monotonic_ms() */
+  long last_used;
+  unsigned long connects, failed;
+};
+
+struct set_s {
+  int lock;			/* pid of the holder, 0 if free */
+  struct health_s entry[HEALTH_WAYS];
+};
+
+struct dest_s {
+  uint32_t hash;		/* 0 for an unused entry */
+  uint16_t port;
+  char name[HEALTH_NAME];
+  int won;			/* family of the last connection */
+  unsigned long inet, inet6;	/* connections over each family */
+  long last_used;
+};
+
+struct dest_set_s {
+  int lock;
+  struct dest_s entry[HEALTH_WAYS];
+};
+
+static struct set_s *table;
+static struct dest_set_s *dests;
+
+/*
+ * Set up the tables before the children are forked, the one of the
+ * circuit breaker unless it is off.
+ */
+int health_init(void)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+  dests = calloc_shared_memory(HEALTH_DEST_SETS, sizeof(struct dest_set_s));
+  if (dests == MAP_FAILED) {
+    log_message(LOG_WARNING, "Could not allocate the destination families: %s",
+		strerror(errno));
+    dests = NULL;
+  }
+  if (config.circuitbreaker <= 0)
+    return 0;
+
+  table = calloc_shared_memory(HEALTH_SETS, sizeof(struct set_s));
+  if (table == MAP_FAILED) {
+    log_message(LOG_ERR, "Could not allocate the destination table: %s",
+		strerror(errno));
+    table = NULL;
+    return -1;
+  }
+#else
+  if (config.circuitbreaker > 0)
+    log_message(LOG_WARNING, "No circuit breaker without atomic operations.");
+#endif
+  return 0;
+}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+/*
+ * The lock word is the pid of the child holding the set. A child which
+ * dies while it holds one, killed or crashed, leaves its pid behind, so
+ * once that process is gone the next one takes the set over. What the
+ * dead child left in the entries is used as it is, at worst a count is
+ * off by one.
+ */
+static void lock_set(int *lock)
+{
+  int self = getpid(), owner = 0;
+
+  while (!__atomic_compare_exchange_n(lock, &owner, self, FALSE,
+				      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    /* a failed exchange left the holder in "owner", try to take it over */
+    if (kill(owner, 0) == -1 && errno == ESRCH)
+      continue;
+    owner = 0;
+    sched_yield();
+  }
+}
+
+static void unlock_set(int *lock)
+{
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static int same_addr(const union dns_sockaddr_u *a,
+		     const union dns_sockaddr_u *b)
+{
+  if (a->sa.sa_family != b->sa.sa_family)
+    return FALSE;
+  if (a->sa.sa_family == AF_INET6)
+    return a->in6.sin6_port == b->in6.sin6_port
+	&& !memcmp(&a->in6.sin6_addr, &b->in6.sin6_addr, 16);
+  return a->in.sin_port == b->in.sin_port
+      && a->in.sin_addr.s_addr == b->in.sin_addr.s_addr;
+}
+
+/*
+ * Lock the set of the address and return its entry, NULL if there is
+ * none and "create" is not set. A new entry is zeroed.
+ */
+static struct health_s *find_entry(const union dns_sockaddr_u *addr,
+				   int create, struct set_s **setp)
+{
+  unsigned char key[18];
+  struct health_s *entry, *victim = NULL;
+  size_t len;
+  int i;
+
+  if (addr->sa.sa_family == AF_INET6) {
+    memcpy(key, &addr->in6.sin6_addr, 16);
+    memcpy(key + 16, &addr->in6.sin6_port, 2);
+    len = 18;
+  } else {
+    memcpy(key, &addr->in.sin_addr, 4);
+    memcpy(key + 4, &addr->in.sin_port, 2);
+    len = 6;
+  }
+  *setp = &table[scan_hash((char *) key, len) % HEALTH_SETS];
+  lock_set(&(*setp)->lock);
+
+  for (i = 0; i < HEALTH_WAYS; i++) {
+    entry = &(*setp)->entry[i];
+    if (same_addr(&entry->addr, addr))
+      return entry;
+    if (!victim || (victim->state != STATE_CLOSED) > (entry->state != STATE_CLOSED)
+	|| ((victim->state != STATE_CLOSED) == (entry->state != STATE_CLOSED)
+	    && entry->last_used < victim->last_used))
+      victim = entry;
+  }
+  if (!create)
+    return NULL;
+
+  memset(victim, 0, sizeof(*victim));
+  victim->addr = *addr;
+  return victim;
+}
+
+static const char *entry_str(const struct health_s *entry, char *buf,
+			     size_t len)
+{
+  char ip[INET6_ADDRSTRLEN];
+
+  if (entry->addr.sa.sa_family == AF_INET6) {
+    inet_ntop(AF_INET6, &entry->addr.in6.sin6_addr, ip, sizeof(ip));
+    snprintf(buf, len, "[%s]:%u (%s)", ip, ntohs(entry->addr.in6.sin6_port),
+	     entry->name);
+  } else {
+    inet_ntop(AF_INET, &entry->addr.in.sin_addr, ip, sizeof(ip));
+    snprintf(buf, len, "%s:%u (%s)", ip, ntohs(entry->addr.in.sin_port),
+	     entry->name);
+  }
+  return buf;
+}
+
+/*
+ * The name goes to the stats page, so only what a host name consists of
+ * is kept.
+ */
+static void copy_name(char *dst, const char *name)
+{
+  size_t i;
+
+  for (i = 0; name[i] && i < HEALTH_NAME - 1; i++)
+    dst[i] = isalnum((unsigned char) name[i]) || strchr("-._", name[i])
+	? name[i] : '?';
+  dst[i] = '\0';
+}
+
+/*
+ * May a connect to "addr" be tried? Returns HEALTH_UP or HEALTH_PROBE if
+ * so, else HEALTH_DOWN or HEALTH_DOWN_TIMEOUT. A probe which takes longer
+ * than the connect timeout is given up, so the next request probes.
+ */
+int health_check(const union dns_sockaddr_u *addr)
+{
+  struct health_s *entry;
+  struct set_s *set;
+  int ret = HEALTH_UP;
+  long now;
+
+  if (!table)
+    return HEALTH_UP;
+
+  if (!(entry = find_entry(addr, FALSE, &set))) {
+    unlock_set(&set->lock);
+    return HEALTH_UP;
+  }
+  if (entry->state != STATE_CLOSED) {
+    now = monotonic_ms();
+    if (now >= entry->retry) {
+      entry->state = STATE_PROBING;
+      entry->retry = now + config.connecttimeout * 1000L + 1000;
+      ret = HEALTH_PROBE;
+    } else
+      ret = entry->timeouts ? HEALTH_DOWN_TIMEOUT : HEALTH_DOWN;
+  }
+  unlock_set(&set->lock);
+  return ret;
+}
+
+/*
+ * Record how the connect to "addr" for the host "name" went.
+ */
+void health_report(const union dns_sockaddr_u *addr, const char *name,
+		   int outcome)
+{
+  struct health_s *entry;
+  struct set_s *set;
+  char buf[INET6_ADDRSTRLEN + HEALTH_NAME + 16];
+  char msg[sizeof(buf) + 64] = "";
+  int level = LOG_NOTICE, opened = FALSE;
+  long now;
+
+  if (!table)
+    return;
+
+  /*
+   * Only a failure makes an entry, a connect which worked or was given up
+   * just updates the one there is. Otherwise every server talked to would
+   * push the failing ones out of their sets.
+   */
+  entry = find_entry(addr, outcome == HEALTH_FAILED
+		     || outcome == HEALTH_TIMEDOUT, &set);
+  if (!entry) {
+    unlock_set(&set->lock);
+    return;
+  }
+
+  now = monotonic_ms();
+  entry->last_used = now;
+  if (!entry->name[0] || outcome != HEALTH_CONNECTED)
+    copy_name(entry->name, name);
+
+  switch (outcome) {
+  case HEALTH_CONNECTED:
+    entry->connects++;
+    if (entry->state != STATE_CLOSED)
+      snprintf(msg, sizeof(msg), "%s is reachable again.",
+	       entry_str(entry, buf, sizeof(buf)));
+    entry->state = STATE_CLOSED;
+    entry->failures = 0;
+    entry->backoff = 0;
+    break;
+
+  case HEALTH_FAILED:
+  case HEALTH_TIMEDOUT:
+    entry->failed++;
+    entry->failures++;
+    entry->timeouts = outcome == HEALTH_TIMEDOUT;
+    if (entry->state == STATE_PROBING) {
+      entry->backoff = min(entry->backoff * 2,
+			   max(HEALTH_MAX_BACKOFF,
+			       (unsigned int) config.circuitbreakerbackoff));
+    } else if (entry->state == STATE_CLOSED
+	       && entry->failures >= (unsigned int) config.circuitbreaker) {
+      entry->backoff = config.circuitbreakerbackoff;
+      opened = TRUE;
+    } else
+      break;
+    entry->state = STATE_OPEN;
+    entry->retry = now + entry->backoff * 1000L;
+    level = LOG_WARNING;
+    snprintf(msg, sizeof(msg),
+	     "%s failed %u times in a row, not trying it for %u seconds.",
+	     entry_str(entry, buf, sizeof(buf)), entry->failures,
+	     entry->backoff);
+    break;
+
+  case HEALTH_ABORTED:
+    /* the probe is off, let the next request try */
+    if (entry->state == STATE_PROBING) {
+      entry->state = STATE_OPEN;
+      entry->retry = now;
+    }
+    break;
+  }
+  unlock_set(&set->lock);
+
+  /* the log may block, the other children must not wait for it */
+  if (opened)
+    update_stats(STAT_CIRCUIT_OPEN);
+  if (msg[0])
+    log_message(level, "%s", msg);
+}
+
+/*
+ * Record that the connection to "name" and "port" went over "family".
+ * A name not known yet replaces the one used the longest time ago.
+ */
+void health_winner(const char *name, uint16_t port, int family)
+{
+  struct dest_set_s *set;
+  struct dest_s *entry, *victim = NULL;
+  char copy[HEALTH_NAME];
+  uint32_t hash;
+  int i;
+
+  if (!dests)
+    return;
+
+  copy_name(copy, name);
+  if (!(hash = scan_hash(copy, strlen(copy)) ^ port))
+    hash = 1;
+  set = &dests[hash % HEALTH_DEST_SETS];
+  lock_set(&set->lock);
+
+  for (i = 0; i < HEALTH_WAYS; i++) {
+    entry = &set->entry[i];
+    if (entry->hash == hash && entry->port == port
+	&& strcmp(entry->name, copy) == 0)
+      break;
+    if (!victim || entry->last_used < victim->last_used)
+      victim = entry;
+  }
+  if (i == HEALTH_WAYS) {
+    entry = victim;
+    memset(entry, 0, sizeof(*entry));
+    entry->hash = hash;
+    entry->port = port;
+    strlcpy(entry->name, copy, sizeof(entry->name));
+  }
+
+  entry->won = family;
+  if (family == AF_INET6)
+    entry->inet6++;
+  else
+    entry->inet++;
+  entry->last_used = monotonic_ms();
+  unlock_set(&set->lock);
+}
+
+/*
+ * Format the family of the last connection to each destination for the
+ * stats page, as "name:port IPv6 (n over IPv6, m over IPv4), ..." or "-".
+ */
+void health_winners(char *buf, size_t len)
+{
+  struct dest_s copy;
+  size_t pos = 0;
+  int i, k;
+
+  strlcpy(buf, "-", len);
+  if (!dests)
+    return;
+
+  for (i = 0; i < HEALTH_DEST_SETS && pos < len; i++) {
+    for (k = 0; k < HEALTH_WAYS && pos < len; k++) {
+      lock_set(&dests[i].lock);
+      copy = dests[i].entry[k];
+      unlock_set(&dests[i].lock);
+      if (!copy.hash)
+	continue;
+
+      pos += snprintf(buf + pos, len - pos,
+		      "%s%s:%u %s (%lu over IPv6, %lu over IPv4)",
+		      pos ? ", " : "", copy.name, copy.port,
+		      copy.won == AF_INET6 ? "IPv6" : "IPv4", copy.inet6,
+		      copy.inet);
+    }
+  }
+}
+
+/*
+ * Format the addresses which are out or failed lately for the stats
+ * page, as "address:port (name) state, ..." or "-" if there are none.
+ */
+void health_list(char *buf, size_t len)
+{
+  struct health_s copy;
+  char addr[INET6_ADDRSTRLEN + HEALTH_NAME + 16];
+  size_t pos = 0;
+  long now;
+  int i, k;
+
+  strlcpy(buf, "-", len);
+  if (!table)
+    return;
+
+  now = monotonic_ms();
+  for (i = 0; i < HEALTH_SETS && pos < len; i++) {
+    for (k = 0; k < HEALTH_WAYS && pos < len; k++) {
+      lock_set(&table[i].lock);
+      copy = table[i].entry[k];
+      unlock_set(&table[i].lock);
+      if (!copy.addr.sa.sa_family || copy.failures == 0)
+	continue;
+
+      entry_str(&copy, addr, sizeof(addr));
+      pos += snprintf(buf + pos, len - pos, "%s%s %u failed in a row%s",
+		      pos ? ", " : "", addr, copy.failures,
+		      copy.timeouts ? " (timeout)" : "");
+      if (pos < len && copy.state == STATE_OPEN)
+	pos += snprintf(buf + pos, len - pos, ", down for %ld s",
+			copy.retry > now ? (copy.retry - now + 999) / 1000 : 0);
+      else if (pos < len && copy.state == STATE_PROBING)
+	pos += snprintf(buf + pos, len - pos, ", being tried");
+      if (pos < len)
+	pos += snprintf(buf + pos, len - pos, ", %lu of %lu connects worked",
+			copy.connects, copy.connects + copy.failed);
+    }
+  }
+}
+
+#else
+
+int health_check(const union dns_sockaddr_u *addr)
+{
+  return HEALTH_UP;
+}
+
+void health_report(const union dns_sockaddr_u *addr, const char *name,
+		   int outcome)
+{
+}
+
+void health_winner(const char *name, uint16_t port, int family)
+{
+}
+
+void health_winners(char *buf, size_t len)
+{
+  strlcpy(buf, "-", len);
+}
+
+void health_list(char *buf, size_t len)
+{
+  strlcpy(buf, "-", len);
+}
+
+#endif				/* HAVE_ATOMIC_BUILTINS */
@@ -0,0 +1,41 @@
+/* $Id$
+ *
+ * See 'health.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_HEALTH_H
+#define TINYPROXY_HEALTH_H
+
+#include "dns.h"
+
+/* results of health_check() */
+#define HEALTH_UP		0	/* go ahead */
+#define HEALTH_PROBE		1	/* go ahead, the first try after a break */
+#define HEALTH_DOWN		2	/* don't, the connects failed */
+#define HEALTH_DOWN_TIMEOUT	3	/* don't, the connects timed out */
+
+/* outcomes for health_report() */
+#define HEALTH_CONNECTED	0
+#define HEALTH_FAILED		1
+#define HEALTH_TIMEDOUT		2
+#define HEALTH_ABORTED		3	/* given up, another address won */
+
+extern int health_init(void);
+extern int health_check(const union dns_sockaddr_u *addr);
+extern void health_report(const union dns_sockaddr_u *addr, const char *name,
+			  int outcome);
+extern void health_list(char *buf, size_t len);
+extern void health_winner(const char *name, uint16_t port, int family);
+extern void health_winners(char *buf, size_t len);
+
+#endif
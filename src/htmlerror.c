@@ -86,8 +86,8 @@ static char *lookup_variable(struct conn_s *connptr, char *varname)
   int i;
 
   for (i = 0; i != connptr->error_variable_count; i++) {
-    if (!strcasecmp(connptr->error_variables[i]->error_key, varname))
-      return connptr->error_variables[i]->error_val;
+    if (!strcasecmp(connptr->error_variables[i].error_key, varname))
+      return connptr->error_variables[i].error_val;
   }
 
   return (NULL);
@@ -97,57 +97,59 @@ static char *lookup_variable(struct conn_s *connptr, char *varname)
 
 /*
  * Send an already-opened file to the client with variable substitution.
+ * The text between the variables goes to the head buffer of the
+ * connection as it is, after the headers from send_http_headers(), and
+ * everything is flushed at the end of the file.
  */
 int send_html_file(FILE * infile, struct conn_s *connptr)
 {
-  char inbuf[HTML_BUFSIZE], *varstart = NULL, *p;
+  struct headbuf_s *hb = &connptr->head_out;
+  char inbuf[HTML_BUFSIZE], *varstart = NULL, *run, *p;
   char *varval;
-  int in_variable = 0, writeret;
+  int in_variable = 0;
 
   while (fgets(inbuf, HTML_BUFSIZE, infile) != NULL) {
-    for (p = inbuf; *p; p++) {
+    /* "run" is where the text not sent yet starts */
+    for (p = run = inbuf; *p; p++) {
       switch (*p) {
       case '}':
 	if (in_variable) {
 	  *p = '\0';
-	  if ((varval = lookup_variable(connptr, varstart))) {
-	    writeret = send_message(connptr->client_fd, "%s", varval);
-	    if (writeret < 0)
-	      return (writeret);
-	  }
+	  if ((varval = lookup_variable(connptr, varstart)))
+	    headbuf_write(hb, varval, strlen(varval));
 	  in_variable = 0;
-	} else {
-	  writeret = send_message(connptr->client_fd, "%c", *p);
-	  if (writeret < 0)
-	    return (writeret);
+	  run = p + 1;
 	}
 	break;
       case '{':
 	/* a {{ will print a single {.  If we are NOT
 	 * already in a { variable, then proceed with
 	 * setup.  If we ARE already in a { variable,
-	 * this code will fallthrough to the code that
-	 * just dumps a character to the client fd.
+	 * this { is the start of the text again.
 	 */
 	if (!in_variable) {
+	  headbuf_write(hb, run, p - run);
 	  varstart = p + 1;
 	  in_variable++;
-	} else
+	} else {
 	  in_variable = 0;
-      default:
-	if (!in_variable) {
-	  writeret = send_message(connptr->client_fd, "%c", *p);
-	  if (writeret < 0)
-	    return (writeret);
+	  run = p;
 	}
-
+	break;
       }
     }
+    if (!in_variable)
+      headbuf_write(hb, run, p - run);
     in_variable = 0;
   }
-  return (0);
+  return headbuf_flush(hb, FALSE);
 }
 
+/*
+ * Send the headers of a page whose length is not known in advance, so
+ * the client connection ends with it. They are only collected here and
+ * go out along with the page.
+ */
 int send_http_headers(struct conn_s *connptr, int code, char *message)
 {
   char *headers =
@@ -155,8 +157,11 @@ int send_http_headers(struct conn_s *connptr, int code, char *message)
       "Server: %s/%s\r\n"
       "Content-Type: text/html\r\n" "Connection: close\r\n" "\r\n";
 
-  return (send_message(connptr->client_fd, headers,
-		       code, message, PACKAGE, VERSION));
+  connptr->keepalive = FALSE;
+
+  headbuf_start(&connptr->head_out, connptr->client_fd);
+  return (headbuf_printf(&connptr->head_out, headers,
+			 code, message, PACKAGE, VERSION));
 }
 
 /*
@@ -179,13 +184,14 @@ int send_http_error_message(struct conn_s *connptr)
   ret =
       send_http_headers(connptr, connptr->error_number, connptr->error_string);
 
-  if (ret != -1) {
+  if (ret >= 0) {
     error_file = get_html_file(connptr->error_number);
     if (!(infile = fopen(error_file, "r"))) {
-      ret = send_message(connptr->client_fd, fallback_error,
-			 connptr->error_string,
-			 PACKAGE, VERSION,
-			 errno, strerror(errno), connptr->error_string);
+      headbuf_printf(&connptr->head_out, fallback_error,
+		     connptr->error_string,
+		     PACKAGE, VERSION,
+		     errno, strerror(errno), connptr->error_string);
+      ret = headbuf_flush(&connptr->head_out, FALSE);
     } else {
       ret = send_html_file(infile, connptr);
       fclose(infile);
@@ -199,38 +205,32 @@ int send_http_error_message(struct conn_s *connptr)
  */
 int add_error_variable(struct conn_s *connptr, char *key, char *val)
 {
-  connptr->error_variable_count++;
+  struct error_variable_s *var;
 
-  /* Add space for a new pointer to the error_variables structure. */
-  if (!connptr->error_variables)
-    connptr->error_variables =
-	malloc(sizeof(struct error_variables_s *) *
-		   connptr->error_variable_count);
-  else
-    connptr->error_variables =
-	realloc(connptr->error_variables,
-		    sizeof(struct error_variable_s *) *
-		    connptr->error_variable_count);
-
-  if (!connptr->error_variables)
-    return (-1);
+  /*
+   * The variables live in the arena of the request, a full array is
+   * replaced by one twice its size.
+   */
+  if (connptr->error_variable_count == connptr->error_variable_room) {
+    int room = connptr->error_variable_room ? 2 * connptr->error_variable_room
+	: 16;
 
-  /* Allocate a new variable mapping structure. */
-  connptr->error_variables[connptr->error_variable_count - 1] =
-      malloc(sizeof(struct error_variable_s));
-  if (!connptr->error_variables[connptr->error_variable_count - 1])
-    return (-1);
+    if (!(var = arena_alloc(&connptr->arena, room * sizeof(*var))))
+      return (-1);
+    if (connptr->error_variable_count)
+      memcpy(var, connptr->error_variables,
+	     connptr->error_variable_count * sizeof(*var));
+    connptr->error_variables = var;
+    connptr->error_variable_room = room;
+  }
 
-  /* Set values for variable mapping. */
-  connptr->error_variables[connptr->error_variable_count - 1]->error_key =
-      strdup(key);
-  connptr->error_variables[connptr->error_variable_count - 1]->error_val =
-      strdup(val);
-  if ((!connptr->error_variables[connptr->error_variable_count - 1]->error_key)
-      || (!connptr->
-	  error_variables[connptr->error_variable_count - 1]->error_val))
+  var = &connptr->error_variables[connptr->error_variable_count];
+  var->error_key = arena_strdup(&connptr->arena, key);
+  var->error_val = arena_strdup(&connptr->arena, val);
+  if (!var->error_key || !var->error_val)
     return (-1);
 
+  connptr->error_variable_count++;
   return (0);
 }
 
@@ -276,7 +276,7 @@ int indicate_http_error(struct conn_s *connptr, int number, char *message, ...)
   }
 
   connptr->error_number = number;
-  connptr->error_string = strdup(message);
+  connptr->error_string = arena_strdup(&connptr->arena, message);
 
   va_end(ap);
 
@@ -221,6 +221,7 @@ http_message_add_headers(http_message_t msg, char **headers, int num_headers)
  */
 int http_message_send(http_message_t msg, int fd)
 {
+  struct headbuf_s hb;
   char timebuf[30];
   time_t global_time;
   unsigned int i;
@@ -235,29 +236,34 @@ int http_message_send(http_message_t msg, int fd)
   if (!is_http_message_valid(msg))
     return -EINVAL;
 
+  /* The whole message goes out at once */
+  headbuf_start(&hb, fd);
+
   /* Write the response line */
-  if (send_message(fd, "HTTP/1.0 %d %s\r\n",
-		   msg->response.code, msg->response.string) < 0)
-    return -1;
+  headbuf_printf(&hb, "HTTP/1.0 %d %s\r\n",
+		 msg->response.code, msg->response.string);
 
   /* Go through all the headers */
-  for (i = 0; i != msg->headers.used; ++i)
-    if (send_message(fd, "%s\r\n", msg->headers.strings[i]) < 0)
-      return -1;
+  for (i = 0; i != msg->headers.used; ++i) {
+    headbuf_add(&hb, msg->headers.strings[i],
+		strlen(msg->headers.strings[i]));
+    headbuf_add(&hb, "\r\n", 2);
+  }
 
   /* Output the date, content-length and the separator between the headers
    * and body */
   global_time = time(NULL);
   strftime(timebuf, sizeof(timebuf), "%a, %d %b %Y %H:%M:%S GMT",
 	   gmtime(&global_time));
-  if (send_message(fd, "Date: %s\r\nContent-length: %u\r\n\r\n",
-		   timebuf, msg->body.length) < 0)
-    return -1;
+  headbuf_printf(&hb, "Date: %s\r\nContent-length: %u\r\n\r\n",
+		 timebuf, msg->body.length);
 
   /* If there's a body, send it! */
   if (msg->body.length > 0)
-    if (safe_send(fd, msg->body.text, msg->body.length) < 0)
-      return -1;
+    headbuf_add(&hb, msg->body.text, msg->body.length);
+
+  if (headbuf_flush(&hb, FALSE) < 0)
+    return -1;
 
   return 0;
 }
@@ -163,7 +163,7 @@ void log_message(int level, char *fmt, ...)
     char time_string[TIME_LENGTH];
     struct iovec iov[3];
     char pfx[PREFIX_LENGTH];
-    int truncated = 0;
+    int truncated = 0, len;
 
     assert(log_file_fd >= 0);
 
@@ -176,7 +176,10 @@ void log_message(int level, char *fmt, ...)
 	snprintf(pfx, PREFIX_LENGTH, "%-9s %s [%ld]: ", syslog_level[level],
 		 time_string, (long int) getpid());
     iov[1].iov_base = str;
-    iov[1].iov_len = vsnprintf(str, STRING_LENGTH, fmt, args);
+    /* vsnprintf() returns the length the message would have had */
+    len = vsnprintf(str, STRING_LENGTH, fmt, args);
+    iov[1].iov_len = len < 0 ? 0
+	: len < STRING_LENGTH ? (size_t) len : STRING_LENGTH - 1;
     iov[2].iov_base = "\n";
     iov[2].iov_len = 1;
 #ifdef HAVE_FTRUNCATE
@@ -23,21 +23,31 @@
 
 
 #include "network.h"
+#include "scan.h"
 #include "log.h"
+#include "worker.h"
 
-#ifdef TCP_CORK
-void enable_tcp_cork(int fd)
+/*
+ * Wait until the socket becomes ready for the given events, but no
+ * longer than the idle timeout. In worker mode this lets other
+ * connections of the child run in the meantime.
+ *
+ * Returns 0 if the socket is ready and -ETIMEDOUT otherwise.
+ */
+static int wait_socket(int fd, short events)
 {
-  int state = 1;
-  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &state, sizeof(state));
-}
+  struct pollfd pfd;
+  int ret;
 
-void disable_tcp_cork(int fd)
-{
-  int state = 0;
-  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &state, sizeof(state));
+  pfd.fd = fd;
+  pfd.events = events;
+
+  do {
+    ret = worker_poll(&pfd, 1, config.idletimeout * 1000);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret > 0 ? 0 : -ETIMEDOUT;
 }
-#endif
 
 /*
  * Write the buffer to the socket. If an EINTR occurs, pick up and try
@@ -52,12 +62,16 @@ ssize_t safe_send(int fd, const char *buffer, size_t count)
   assert(bytestosend > 0);
 
   while (1) {
-    len = send(fd, buffer, bytestosend, MSG_NOSIGNAL);
+    len = send(fd, buffer, bytestosend, MSG_NOSIGNAL | MSG_DONTWAIT);
 
     if (len < 0) {
       if (errno == EINTR)
 	continue;
-      else
+      else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	if (wait_socket(fd, POLLOUT) < 0)
+	  return -ETIMEDOUT;
+	continue;
+      } else
 	return -errno;
     }
 
@@ -80,181 +94,375 @@ ssize_t safe_recv(int fd, char *buffer, size_t count)
   ssize_t len;
 
   do {
-    len = recv(fd, buffer, count, 0);
+    len = recv(fd, buffer, count, MSG_DONTWAIT);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (wait_socket(fd, POLLIN) < 0) {
+	errno = ETIMEDOUT;
+	return -1;
+      }
+      errno = EINTR;
+    }
   } while (len < 0 && errno == EINTR);
 
   return len;
 }
 
+#ifndef MSG_MORE
+#  define MSG_MORE 0
+#endif
+
 /*
- * Send a "message" to the file descriptor provided. This handles the
- * differences between the various implementations of vsnprintf. This code
- * was basically stolen from the snprintf() man page of Debian Linux
- * (although I did fix a memory leak. :)
- *
- * Return the bytes written to the file descriptor or -1 in case of an error.
+ * Start collecting a message head for the socket "fd".
  */
-int send_message(int fd, const char *fmt, ...)
+void headbuf_start(struct headbuf_s *hb, int fd)
 {
-  ssize_t n;
-  ssize_t size = (1024 * 8);	/* start with 8 KB and go from there */
-  char *buf, *tmpbuf;
-  va_list ap;
+  hb->fd = fd;
+  hb->count = 0;
+  hb->used = 0;
+  hb->error = 0;
+}
 
-  if ((buf = malloc(size)) == NULL)
-    return -1;
+/*
+ * Send everything collected so far with a single sendmsg(), which is a
+ * writev() taking flags. With "more" set the kernel holds back a partial
+ * segment for what follows, like TCP_CORK does.
+ *
+ * Returns 0, or a negative error which also stays in the buffer.
+ */
+int headbuf_flush(struct headbuf_s *hb, int more)
+{
+  int flags = MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0);
+  struct iovec *iov = hb->iov;
+  int count = hb->count;
+  struct msghdr msg;
+  ssize_t len;
 
-  while (1) {
-    va_start(ap, fmt);
-    n = vsnprintf(buf, size, fmt, ap);
-    va_end(ap);
+  hb->count = 0;
+  hb->used = 0;
+  if (hb->error)
+    return hb->error;
 
-    /* If that worked, break out so we can send the buffer */
-    if (n > -1 && n < size)
-      break;
+  while (count > 0) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
 
-    /* Else, try again with more space */
-    if (n > -1)
-      /* precisely what is needed (glibc2.1) */
-      size = n + 1;
-    else
-      /* twice the old size (glibc2.0) */
-      size *= 2;
+    if ((len = sendmsg(hb->fd, &msg, flags)) < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	if (wait_socket(hb->fd, POLLOUT) < 0)
+	  return hb->error = -ETIMEDOUT;
+	continue;
+      }
+      return hb->error = -errno;
+    }
 
-    if ((tmpbuf = realloc(buf, size)) == NULL) {
-      free(buf);
-      return -1;
-    } else
-      buf = tmpbuf;
+    /* skip what went out, a partial write leaves the rest of an iovec */
+    while (count > 0 && (size_t) len >= iov->iov_len) {
+      len -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + len;
+      iov->iov_len -= len;
+    }
   }
 
-  n = safe_send(fd, buf, n);
-  free(buf);
-  return n;
+  return 0;
 }
 
 /*
- * Read in a "line" from the socket. It might take a few loops through
- * the read sequence. The full string is allocate off the heap and stored
- * at the whole_buffer pointer. The caller needs to free the memory when
- * it is no longer in use. The returned line is NULL terminated.
- *
- * Returns the length of the buffer on success (not including the NULL
- * termination), 0 if the socket was closed, and -1 on all other errors.
+ * Append "len" bytes of the scratch space to the head, NULL if there is
+ * no room left. Pieces in the scratch space which follow each other end
+ * up in the same iovec.
  */
-#define SEGMENT_LEN (512)
-#define MAXIMUM_BUFFER_LENGTH (128 * 1024)
-ssize_t recvline(int fd, char **whole_buffer)
+static char *headbuf_reserve(struct headbuf_s *hb, size_t len)
 {
-  ssize_t whole_buffer_len;
-  char buffer[SEGMENT_LEN];
-  char *ptr;
-  time_t starttime;
+  char *ptr = hb->scratch + hb->used;
+  struct iovec *last = hb->count > 0 ? &hb->iov[hb->count - 1] : NULL;
+
+  if (len > sizeof(hb->scratch) - hb->used)
+    return NULL;
+
+  if (last && (char *) last->iov_base + last->iov_len == ptr)
+    last->iov_len += len;
+  else if (hb->count < HEADBUF_IOV) {
+    hb->iov[hb->count].iov_base = ptr;
+    hb->iov[hb->count].iov_len = len;
+    hb->count++;
+  } else
+    return NULL;
+
+  hb->used += len;
+  return ptr;
+}
 
-  ssize_t ret;
-  ssize_t diff;
+/*
+ * Add "len" bytes to the head. Short pieces are copied to the scratch
+ * space, longer ones are not copied and have to stay where they are until
+ * the head is flushed. Once the iovecs are used up the head so far is
+ * sent on.
+ */
+int headbuf_add(struct headbuf_s *hb, const char *data, size_t len)
+{
+  char *ptr;
 
-  struct read_lines_s {
-    char *data;
-    size_t len;
-    struct read_lines_s *next;
-  };
-  struct read_lines_s *first_line, *line_ptr;
+  if (len == 0 || hb->error)
+    return hb->error;
 
-  first_line = calloc(sizeof(struct read_lines_s), 1);
-  if (!first_line)
-    return -ENOMEM;
+  if (len <= HEADBUF_COPY && (ptr = headbuf_reserve(hb, len))) {
+    memcpy(ptr, data, len);
+    return 0;
+  }
 
-  line_ptr = first_line;
+  if (hb->count == HEADBUF_IOV && headbuf_flush(hb, TRUE) < 0)
+    return hb->error;
 
-  whole_buffer_len = 0;
-  for (;;) {
+  hb->iov[hb->count].iov_base = (void *) data;
+  hb->iov[hb->count].iov_len = len;
+  hb->count++;
+  return 0;
+}
 
-    starttime = time(NULL);
-    while ((ret = recv(fd, buffer, SEGMENT_LEN, MSG_PEEK | MSG_DONTWAIT)) < 0
-	   && errno == EAGAIN) {
+/*
+ * Copy "len" bytes to the head, for data which does not stay where it is
+ * until the head is flushed. Whenever the scratch space is full the head
+ * so far is sent on, so there is no limit on "len".
+ */
+int headbuf_write(struct headbuf_s *hb, const char *data, size_t len)
+{
+  size_t n;
+  char *ptr;
 
-      if ((long) (time(NULL) - starttime) > (long) config.idletimeout) {
-	log_message(LOG_INFO,
-		    "Idle Timeout in recvline %u.", config.idletimeout);
-	goto CLEANUP;
-      }
-      usleep(200000);
+  while (len > 0 && !hb->error) {
+    n = sizeof(hb->scratch) - hb->used;
+    if (n > len)
+      n = len;
+    if (n == 0 || !(ptr = headbuf_reserve(hb, n))) {
+      headbuf_flush(hb, TRUE);
+      continue;
     }
+    memcpy(ptr, data, n);
+    data += n;
+    len -= n;
+  }
+  return hb->error;
+}
 
-    if (ret <= 0)
-      goto CLEANUP;
+/*
+ * Add a header line.
+ */
+int headbuf_header(struct headbuf_s *hb, const char *name, size_t namelen,
+		   const char *value, size_t valuelen)
+{
+  headbuf_add(hb, name, namelen);
+  headbuf_add(hb, ": ", 2);
+  headbuf_add(hb, value, valuelen);
+  return headbuf_add(hb, "\r\n", 2);
+}
 
-    ptr = memchr(buffer, '\n', ret);
-    if (ptr)
-      diff = ptr - buffer + 1;
-    else
-      diff = ret;
+/*
+ * Format a piece of the head into the scratch space. Should that be full,
+ * the head so far is sent on, and anything larger than the scratch space
+ * is formatted on the heap and copied in with headbuf_write().
+ *
+ * Returns the length of the piece, or a negative error.
+ */
+static int headbuf_vprintf(struct headbuf_s *hb, const char *fmt,
+			   va_list args)
+{
+  size_t room = sizeof(hb->scratch) - hb->used;
+  va_list ap;
+  char *buf;
+  int n;
+
+  if (hb->error)
+    return hb->error;
+
+  va_copy(ap, args);
+  n = vsnprintf(hb->scratch + hb->used, room, fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return hb->error = -EINVAL;
+  if ((size_t) n < room && headbuf_reserve(hb, n))
+    return n;
+
+  if (headbuf_flush(hb, TRUE) < 0)
+    return hb->error;
+
+  if ((size_t) n < sizeof(hb->scratch)) {
+    va_copy(ap, args);
+    vsnprintf(hb->scratch, sizeof(hb->scratch), fmt, ap);
+    va_end(ap);
+    headbuf_reserve(hb, n);
+    return n;
+  }
 
-    whole_buffer_len += diff;
+  if ((buf = malloc((size_t) n + 1)) == NULL)
+    return hb->error = -ENOMEM;
+  va_copy(ap, args);
+  vsnprintf(buf, (size_t) n + 1, fmt, ap);
+  va_end(ap);
+  headbuf_write(hb, buf, n);
+  free(buf);
 
-    /*
-     * Don't allow the buffer to grow without bound. If we
-     * get to more than MAXIMUM_BUFFER_LENGTH close.
-     */
-    if (whole_buffer_len > MAXIMUM_BUFFER_LENGTH) {
-      ret = -ERANGE;
-      goto CLEANUP;
-    }
+  return hb->error ? hb->error : n;
+}
 
-    line_ptr->data = malloc(diff);
-    if (!line_ptr->data) {
-      ret = -ENOMEM;
-      goto CLEANUP;
-    }
+int headbuf_printf(struct headbuf_s *hb, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
 
-    ret = recv(fd, line_ptr->data, diff, 0);
-    /* to be safe */
-    if (ret <= 0)
-      goto CLEANUP;
+  va_start(ap, fmt);
+  n = headbuf_vprintf(hb, fmt, ap);
+  va_end(ap);
+  return n < 0 ? n : 0;
+}
 
-    line_ptr->len = diff;
+/*
+ * Send a "message" to the file descriptor provided, for callers which
+ * have all of it at once. It goes out through a head buffer of its own.
+ *
+ * Return the bytes written to the file descriptor or -1 in case of an error.
+ */
+int send_message(int fd, const char *fmt, ...)
+{
+  struct headbuf_s hb;
+  va_list ap;
+  int n;
+
+  headbuf_start(&hb, fd);
+  va_start(ap, fmt);
+  n = headbuf_vprintf(&hb, fmt, ap);
+  va_end(ap);
+  if (headbuf_flush(&hb, FALSE) < 0) {
+    errno = -hb.error;
+    return -1;
+  }
+  return n;
+}
 
-    if (ptr) {
-      line_ptr->next = NULL;
-      break;
+/*
+ * Read a message head, the request or response line and the headers up
+ * to the empty line, from the socket through its line buffer. The buffer
+ * takes whatever the socket has, so a head usually needs a single recv(),
+ * and scan_head_end() finds its end. "*head" points into the buffer and
+ * stays valid until the next call for the same buffer, parse_head() splits
+ * it in place. Bytes read beyond the head are kept for the next call or
+ * for linebuf_take(). Empty lines before the head are skipped.
+ *
+ * Waits at most the idle timeout in total for the head to be complete.
+ * Returns the length of the head, -1 if the socket was closed or on
+ * errors, and -ERANGE if the head is longer than MAXIMUM_BUFFER_LENGTH.
+ */
+#define LINEBUF_SIZE (4 * 1024)
+#define MAXIMUM_BUFFER_LENGTH (128 * 1024)
+ssize_t recvhead(int fd, struct linebuf_s *lb, char **head)
+{
+  time_t starttime = time(NULL);
+  size_t scanned = 0, len;	/* from lb->start */
+  ssize_t ret;
+
+  for (;;) {
+    /* skip empty lines in front of the head */
+    while (scanned == 0 && lb->end > lb->start
+	   && (lb->data[lb->start] == '\n'
+	       || (lb->data[lb->start] == '\r' && lb->end - lb->start > 1
+		   && lb->data[lb->start + 1] == '\n')))
+      lb->start += lb->data[lb->start] == '\n' ? 1 : 2;
+
+    if (lb->end - lb->start > scanned
+	&& !(lb->data[lb->start] == '\r' && lb->end - lb->start == 1)) {
+      len = scan_head_end(lb->data + lb->start, scanned,
+			  lb->end - lb->start);
+      if (len > 0) {
+	*head = lb->data + lb->start;
+	lb->start += len;
+	return (ssize_t) len;
+      }
+      scanned = lb->end - lb->start;
     }
 
-    line_ptr->next = calloc(sizeof(struct read_lines_s), 1);
-    if (!line_ptr->next) {
-      ret = -ENOMEM;
-      goto CLEANUP;
+    /* make room at the end, moving the data to the front first */
+    if (lb->end == lb->size && lb->start > 0) {
+      memmove(lb->data, lb->data + lb->start, scanned);
+      lb->start = 0;
+      lb->end = scanned;
     }
-    line_ptr = line_ptr->next;
-  }
+    if (lb->end == lb->size) {
+      size_t size = lb->size ? lb->size * 2 : LINEBUF_SIZE;
+      char *data;
+
+      if (lb->size >= MAXIMUM_BUFFER_LENGTH)
+	return -ERANGE;
+      if (!(data = realloc(lb->data, size)))
+	return -1;
+      lb->data = data;
+      lb->size = size;
+    }
+
+    ret = recv(fd, lb->data + lb->end, lb->size - lb->end, MSG_DONTWAIT);
+    if (ret > 0) {
+      lb->end += (size_t) ret;
+    } else if (ret == 0) {
+      return -1;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      long left = (long) config.idletimeout - (long) (time(NULL) - starttime);
+      struct pollfd pfd;
 
-  *whole_buffer = malloc(whole_buffer_len + 1);
-  if (!*whole_buffer) {
-    ret = -ENOMEM;
-    goto CLEANUP;
+      if (left <= 0) {
+	log_message(LOG_INFO,
+		    "Idle Timeout in recvhead %u.", config.idletimeout);
+	return -1;
+      }
+
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      worker_poll(&pfd, 1, left * 1000);
+    } else if (errno != EINTR) {
+      return -1;
+    }
   }
+}
+
+/*
+ * The number of bytes in the line buffer which were not handed out yet.
+ */
+size_t linebuf_pending(struct linebuf_s *lb)
+{
+  return lb->end - lb->start;
+}
 
-  *(*whole_buffer + whole_buffer_len) = '\0';
+/*
+ * Take up to "len" of the pending bytes out of the line buffer. Returns
+ * a pointer to them and stores their number in "len".
+ */
+char *linebuf_take(struct linebuf_s *lb, size_t *len)
+{
+  char *data = lb->data + lb->start;
 
-  whole_buffer_len = 0;
-  line_ptr = first_line;
-  while (line_ptr) {
-    memcpy(*whole_buffer + whole_buffer_len, line_ptr->data, line_ptr->len);
-    whole_buffer_len += line_ptr->len;
+  if (*len > lb->end - lb->start)
+    *len = lb->end - lb->start;
+  lb->start += *len;
+  if (lb->start == lb->end)
+    lb->start = lb->end = 0;
 
-    line_ptr = line_ptr->next;
-  }
+  return data;
+}
 
-  ret = whole_buffer_len;
+/*
+ * Forget the pending bytes, the buffer itself is kept for reuse.
+ */
+void linebuf_clear(struct linebuf_s *lb)
+{
+  lb->start = lb->end = 0;
+}
 
-CLEANUP:
-  do {
-    line_ptr = first_line->next;
-    if (first_line->data)
-      free(first_line->data);
-    free(first_line);
-    first_line = line_ptr;
-  } while (first_line);
-
-  return ret;
+void linebuf_free(struct linebuf_s *lb)
+{
+  free(lb->data);
+  memset(lb, 0, sizeof(struct linebuf_s));
 }
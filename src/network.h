@@ -18,19 +18,52 @@
 #ifndef TINYPROXY_NETWORK_H
 #define TINYPROXY_NETWORK_H
 
-#include <netinet/tcp.h>
-#ifdef TCP_CORK
-extern void enable_tcp_cork(int fd);
-extern void disable_tcp_cork(int fd);
-#else
-#define enable_tcp_cork(fd)
-#define disable_tcp_cork(fd)
-#endif
-
 extern ssize_t safe_send(int fd, const char *buffer, size_t count);
 extern ssize_t safe_recv(int fd, char *buffer, size_t count);
 
 extern int send_message(int fd, const char *fmt, ...);
-extern ssize_t recvline(int fd, char **whole_buffer);
+
+/*
+ * A message head on its way out. The pieces are collected as iovecs and
+ * go out with a single sendmsg() once the head is complete. Formatted and
+ * short pieces are copied to the scratch space, longer ones (a message
+ * body, say) are not copied unless headbuf_write() is used. Every
+ * connection has one for what it sends, error pages included.
+ */
+#define HEADBUF_IOV 32
+#define HEADBUF_SCRATCH (4 * 1024)
+#define HEADBUF_COPY 256
+struct headbuf_s {
+  int fd;
+  int count;
+  int error;
+  size_t used;
+  struct iovec iov[HEADBUF_IOV];
+  char scratch[HEADBUF_SCRATCH];
+};
+
+extern void headbuf_start(struct headbuf_s *hb, int fd);
+extern int headbuf_add(struct headbuf_s *hb, const char *data, size_t len);
+extern int headbuf_write(struct headbuf_s *hb, const char *data,
+			 size_t len);
+extern int headbuf_header(struct headbuf_s *hb, const char *name,
+			  size_t namelen, const char *value, size_t valuelen);
+extern int headbuf_printf(struct headbuf_s *hb, const char *fmt, ...);
+extern int headbuf_flush(struct headbuf_s *hb, int more);
+
+/*
+ * The bytes read from a socket which recvhead() did not hand out yet.
+ * A zeroed structure is an empty buffer.
+ */
+struct linebuf_s {
+  char *data;
+  size_t start, end, size;
+};
+
+extern ssize_t recvhead(int fd, struct linebuf_s *lb, char **head);
+extern size_t linebuf_pending(struct linebuf_s *lb);
+extern char *linebuf_take(struct linebuf_s *lb, size_t *len);
+extern void linebuf_clear(struct linebuf_s *lb);
+extern void linebuf_free(struct linebuf_s *lb);
 
 #endif
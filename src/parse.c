@@ -4,53 +4,162 @@
 #include <stdio.h>
 #include <errno.h>
 #include "conns.h"
+#include "headers.h"
 #include "parse.h"
+#include "scan.h"
 #include "log.h"
 
+/*
+ * A request with room for "size" bytes of strings. The request and all
+ * its strings are a single allocation from the arena of the connection.
+ */
+request_t *new_request(struct arena_s *arena, size_t size)
+{
+  request_t *req;
+
+  if (NULL == (req = arena_calloc(arena, 1, sizeof(request_t) + size)))
+    return NULL;
+  req->size = size;
+  return req;
+}
+
+/*
+ * Room for "len" bytes from the strings of the request, NULL if there is
+ * not enough left.
+ */
+char *request_alloc(request_t *req, size_t len)
+{
+  char *ptr;
+
+  if (len > req->size - req->used)
+    return NULL;
+  ptr = req->strings + req->used;
+  req->used += len;
+  return ptr;
+}
+
+char *request_strndup(request_t *req, const char *str, size_t len)
+{
+  char *ptr;
+
+  if (NULL == (ptr = request_alloc(req, len + 1)))
+    return NULL;
+  memcpy(ptr, str, len);
+  ptr[len] = '\0';
+  return ptr;
+}
+
 /*
  * See: https://tools.ietf.org/html/rfc3986#section-3.1
+ *
+ * The request line is copied once into the strings of the request and
+ * split there in place.
 **/
 int parse_request_line(request_t *req, struct conn_s *connptr) {
-  char *line = connptr->request_line;
   size_t length = connptr->request_len;
-  char *space;
-  char *method = line;
-  char *uri = NULL;
-  char *proto = NULL;
-  int ret = -ENOMEM;
+  char *line, *space;
+
+  if (NULL == (line = request_strndup(req, connptr->request_line, length)))
+    return -ENOMEM;
 
   if (NULL == (space = memchr(line, ' ', length))) {
     /* missing first space */
     log_message(LOG_ERR, "missing first space");
-    ret = -EINVAL;
-  } else if (NULL == (method = strndup(line, space - line))) {
-    /* OOM */
-  } else {
-    length -= (space - line - 1);
-    line = ++space;
-    if (NULL == (space = memchr(line, ' ', length))) {
-      log_message(LOG_ERR, "missing second space");
-      /* missing second space */
-      ret = -EINVAL;
-    } else if (NULL == (uri = strndup(line, space - line))) {
-      /* OOM */
-    } else {
-      length -= (space - line - 1);
-      line = ++space;
-      if (NULL == (proto = strndup(line, length))) {
-        /* OOM */
-      } else {
-	/* TODO: we have three pieces now, let check them */
-	req->method = method;
-	req->url = uri;
-	req->protocol = proto;
-        return 0;
-      }
-    }
+    return -EINVAL;
+  }
+  *space++ = '\0';
+  req->method = line;
+  length -= (size_t) (space - line);
+  line = space;
+
+  if (NULL == (space = memchr(line, ' ', length))) {
+    /* missing second space */
+    log_message(LOG_ERR, "missing second space");
+    return -EINVAL;
+  }
+  *space++ = '\0';
+  req->url = line;
+  /* TODO: we have three pieces now, let check them */
+  req->protocol = space;
+  return 0;
+}
+
+struct head_s {
+  char **first;
+  headers_t headers;
+  unsigned int double_cgi;	/* boolean */
+};
+
+/*
+ * One line of the head, see scan_lines(). Returns 1 at the empty line
+ * which ends the head.
+ */
+static int head_line(void *arg, char *line, char *sep, char *nl)
+{
+  struct head_s *head = arg;
+  size_t namelen;
+
+  if (nl > line && nl[-1] == '\r')
+    nl--;
+  *nl = '\0';
+
+  if (!*head->first) {
+    *head->first = line;
+    return 0;
+  }
+
+  /* the empty line at the end of the head */
+  if (nl == line)
+    return 1;
+
+  /*
+   * BUG FIX: The following code detects a "Double CGI"
+   * situation so that we can handle the nonconforming system.
+   * This problem was found when accessing cgi.ebay.com, and it
+   * turns out to be a wider spread problem as well.
+   *
+   * If "Double CGI" is in effect, duplicate headers are
+   * ignored.
+   *
+   * FIXME: Might need to change this to a more robust check.
+   */
+  if (strncasecmp(line, "HTTP/", 5) == 0) {
+    head->double_cgi = TRUE;
+    return 0;
   }
+  if (head->double_cgi)
+    return 0;
+
+  if (!sep)
+    return -1;
+  namelen = (size_t) (sep - line);
+
+  /* Blank out colons, spaces, and tabs. */
+  while (*sep == ':' || *sep == ' ' || *sep == '\t')
+    *sep++ = '\0';
+
+  return headers_add(head->headers, line, namelen, sep,
+		     (size_t) (nl - sep)) < 0 ? -1 : 0;
+}
+
+/*
+ * Split a message head read by recvhead() in place. The first line (the
+ * request or response line) is returned in "*first", the headers go into
+ * the header table in the order they arrived, nothing is copied. The line
+ * endings are replaced by NULs, as are the colon and the blanks between
+ * the name and the value of a header. The table must not outlive the
+ * head.
+ *
+ * Returns 0 on success and -1 if there is a line which is not a header.
+ */
+int parse_head(char *head, size_t len, char **first, headers_t headers)
+{
+  struct head_s state;
+
+  *first = NULL;
+  state.first = first;
+  state.headers = headers;
+  state.double_cgi = FALSE;
 
-  free(method);
-  free(proto);
-  free(uri);
-  return ret;
+  return scan_lines(head, head + len, head_line, &state) > 0 ? 0 : -1;
 }
@@ -4,7 +4,12 @@
 #include <sys/types.h>
 #include "reqs.h"
 #include "conns.h"
+#include "headers.h"
 
+request_t *new_request(struct arena_s *arena, size_t size);
+char *request_alloc(request_t *req, size_t len);
+char *request_strndup(request_t *req, const char *str, size_t len);
 int parse_request_line(request_t *req, struct conn_s *connptr);
+int parse_head(char *head, size_t len, char **first, headers_t headers);
 
 #endif
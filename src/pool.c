@@ -0,0 +1,221 @@
+/* $Id$
+ *
+ * The server connection pool (ConnectionPool). Instead of closing the
+ * connection to an origin server or upstream proxy once a response is
+ * through, the child keeps it and uses it for the next request to the
+ * same place. Every child has its own pool, in worker mode all the
+ * connections of a child share it.
+ *
+ * Connections are keyed by host and port, and by the upstream proxy if
+ * one is used. A connection goes back to the pool only if the server
+ * agreed to keep it open and the response ended where it was expected
+ * to. It is dropped once it was idle for ConnectionPoolIdle seconds, is
+ * older than ConnectionPoolMaxAge seconds, or the server closed it in
+ * the meantime.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include "log.h"
+#include "pool.h"
+#include "sock.h"
+#include "stats.h"
+
+struct pooled_s {
+  int fd;
+  unsigned int busy:1;		/* in use by a request */
+  char *host;
+  uint16_t port;
+  struct upstream *up;
+  time_t created, last_used;
+};
+
+static struct {
+  struct pooled_s *conns;
+  int count, allocated;
+  int idle;
+} pool;
+
+static void pool_drop(int i, int doclose)
+{
+  struct pooled_s *p = &pool.conns[i];
+
+  if (doclose)
+    close(p->fd);
+  if (!p->busy)
+    pool.idle--;
+  free(p->host);
+  *p = pool.conns[--pool.count];
+}
+
+/*
+ * A pooled connection must have nothing to read, otherwise the server
+ * closed it or sent something nobody asked for.
+ */
+static int pool_alive(int fd)
+{
+  char c;
+
+  return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+      && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * Close the idle connections which are too old or idle for too long.
+ */
+static void pool_expire(time_t now)
+{
+  int i = 0;
+
+  while (i < pool.count) {
+    struct pooled_s *p = &pool.conns[i];
+
+    if (!p->busy
+	&& (now - p->last_used >= config.connectionpoolidle
+	    || now - p->created >= config.connectionpoolmaxage)) {
+      DEBUG2("pool: expired connection to %s:%d (fd %d)",
+	     p->host, p->port, p->fd);
+      pool_drop(i, TRUE);
+    } else
+      i++;
+  }
+}
+
+/*
+ * Take an idle connection for the given destination out of the pool,
+ * returns -1 if there is none.
+ */
+static int pool_get(char *host, uint16_t port, struct upstream *up)
+{
+  int i = 0;
+
+  while (i < pool.count) {
+    struct pooled_s *p = &pool.conns[i];
+
+    if (p->busy || p->port != port || p->up != up
+	|| strcasecmp(p->host, host) != 0) {
+      i++;
+    } else if (!pool_alive(p->fd)) {
+      DEBUG2("pool: connection to %s:%d (fd %d) is gone", host, port, p->fd);
+      pool_drop(i, TRUE);
+    } else {
+      p->busy = TRUE;
+      pool.idle--;
+      return p->fd;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Remember a new connection, so it can go back to the pool later.
+ */
+static void pool_add(int fd, char *host, uint16_t port, struct upstream *up,
+		     time_t now)
+{
+  struct pooled_s *p;
+
+  if (pool.count == pool.allocated) {
+    int allocated = pool.allocated ? pool.allocated * 2 : 16;
+
+    p = realloc(pool.conns, allocated * sizeof(struct pooled_s));
+    if (!p)
+      return;
+    pool.conns = p;
+    pool.allocated = allocated;
+  }
+
+  p = &pool.conns[pool.count];
+  if (!(p->host = strdup(host)))
+    return;
+  p->fd = fd;
+  p->busy = TRUE;
+  p->port = port;
+  p->up = up;
+  p->created = p->last_used = now;
+  pool.count++;
+}
+
+/*
+ * Get a connection to "host" and "port" (the upstream proxy "up" if it is
+ * not NULL), either from the pool or by opening a new one. Returns the
+ * socket or -1 with the reason in "errbuf", like opensock().
+ */
+int pool_open(char *host, uint16_t port, struct upstream *up,
+	      char *errbuf, size_t errbuflen)
+{
+  struct timeval start, end;
+  int fd;
+
+  if (config.connectionpool <= 0)
+    return opensock(host, port, errbuf, errbuflen);
+
+  gettimeofday(&start, NULL);
+  pool_expire(start.tv_sec);
+
+  if ((fd = pool_get(host, port, up)) != -1) {
+    log_message(LOG_CONN, "Reusing connection to %s:%d (fd %d)",
+		host, port, fd);
+    stats_pool(TRUE, 0);
+    return fd;
+  }
+
+  if ((fd = opensock(host, port, errbuf, errbuflen)) < 0)
+    return fd;
+
+  gettimeofday(&end, NULL);
+  stats_pool(FALSE, (end.tv_sec - start.tv_sec) * 1000000
+	     + end.tv_usec - start.tv_usec);
+
+  pool_add(fd, host, port, up, end.tv_sec);
+  return fd;
+}
+
+/*
+ * Done with the connection "fd". It goes back to the pool if "reuse" is
+ * set and there is room, and is closed otherwise. Returns the result of
+ * close(), 0 if the connection was kept.
+ */
+int pool_release(int fd, int reuse)
+{
+  time_t now = time(NULL);
+  int i, oldest = -1;
+
+  for (i = 0; i < pool.count; i++)
+    if (pool.conns[i].fd == fd)
+      break;
+
+  if (i == pool.count)
+    return close(fd);
+
+  if (!reuse || now - pool.conns[i].created >= config.connectionpoolmaxage) {
+    pool_drop(i, FALSE);
+    return close(fd);
+  }
+
+  pool.conns[i].busy = FALSE;
+  pool.conns[i].last_used = now;
+  pool.idle++;
+
+  /* make room by closing the connection idle for the longest time */
+  if (pool.idle > config.connectionpool) {
+    for (i = 0; i < pool.count; i++)
+      if (!pool.conns[i].busy
+	  && (oldest == -1
+	      || pool.conns[i].last_used < pool.conns[oldest].last_used))
+	oldest = i;
+    pool_drop(oldest, TRUE);
+  }
+
+  return 0;
+}
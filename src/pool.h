@@ -0,0 +1,23 @@
+/* $Id$
+ *
+ * See 'pool.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_POOL_H
+#define TINYPROXY_POOL_H
+
+extern int pool_open(char *host, uint16_t port, struct upstream *up,
+		     char *errbuf, size_t errbuflen);
+extern int pool_release(int fd, int reuse);
+
+#endif
@@ -0,0 +1,659 @@
+/* $Id$
+ *
+ * The relay offload daemon (RelayOffload). Once the headers of a request
+ * are through, all that is left for handle_connection() is to shuffle
+ * bytes with relay_connection(), which keeps a child busy for the whole
+ * life of a CONNECT tunnel or a large download. With RelayOffload the
+ * child passes both sockets and whatever is still in its buffers to this
+ * daemon and is free for the next request right away. The daemon relays
+ * all transfers from a single epoll loop and writes the access log line
+ * once a transfer is finished.
+ *
+ * The parent creates a SOCK_SEQPACKET socket pair and forks the daemon.
+ * Every handover is a single message carrying both sockets (SCM_RIGHTS),
+ * the state needed for the log line and the buffered data. Connections
+ * with more buffered data than fits into a message are relayed by the
+ * child as before, as are FTP transfers.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include <sys/epoll.h>
+
+#include "acceptor.h"
+#include "buffer.h"
+#include "conns.h"
+#include "daemon.h"
+#include "freelist.h"
+#include "log.h"
+#include "network.h"
+#include "proctitle.h"
+#include "relay.h"
+#include "reqs.h"
+#include "sock.h"
+#include "stats.h"
+
+/* maximum size of the data passed along with the sockets */
+#define RELAY_DATA_MAX (64 * 1024)
+
+/* Number of events fetched with a single epoll_wait() */
+#define RELAY_EVENTS 64
+
+/* epoll data used for the channel from the children */
+#define RELAY_CHANNEL UINT64_C(-1)
+
+#define CLIENT 0
+#define SERVER 1
+
+/* everything handle_connection() knows about a request, but the sockets */
+struct relay_msg_s {
+  struct timeval start;
+  uint64_t server_processed, client_processed;
+  uint64_t content_length;
+  int error_number;
+  int statuscode;
+  uint32_t request_len;		/* request line */
+  uint32_t peer_len;		/* client ip address */
+  uint32_t cdata_len;		/* buffered data for the server */
+  uint32_t sdata_len;		/* buffered data for the client */
+};
+
+struct relay_s {
+  struct conn_s *conn;
+  struct timeval start;
+  time_t last_access;
+  unsigned int closing:1;	/* only flushing the buffers */
+  unsigned int shutdown:1;	/* sent FIN to the client */
+  uint32_t watched[2];		/* events registered with epoll */
+};
+
+static pid_t relay_pid = -1;
+static int channel[2] = { -1, -1 };	/* daemon, children */
+
+static struct {
+  int epfd;
+  int orphaned;			/* the parent is gone */
+  int count, allocated;
+  struct relay_s **relays;
+} relayd;
+
+/*
+ * Allocate a connection structure for the daemon. Unlike initialize_conn()
+ * this does not count the connection a second time in the stats.
+ */
+static struct conn_s *relay_conn(int client_fd, int server_fd)
+{
+  struct conn_s *connptr;
+
+  if (!(connptr = calloc(1, sizeof(struct conn_s))))
+    return NULL;
+
+  connptr->client_fd = client_fd;
+  connptr->server_fd = server_fd;
+#ifdef FTP_SUPPORT
+  connptr->server_cfd = -1;
+#endif
+  connptr->cbuffer = new_buffer();
+  connptr->sbuffer = new_buffer();
+  if (!connptr->cbuffer || !connptr->sbuffer) {
+    if (connptr->cbuffer)
+      delete_buffer(connptr->cbuffer);
+    if (connptr->sbuffer)
+      delete_buffer(connptr->sbuffer);
+    free(connptr);
+    return NULL;
+  }
+  return connptr;
+}
+
+static void relay_free(struct relay_s *r)
+{
+  struct conn_s *connptr = r->conn;
+
+  close(connptr->client_fd);
+  close(connptr->server_fd);
+  delete_buffer(connptr->cbuffer);
+  delete_buffer(connptr->sbuffer);
+  free(connptr->request_line);
+  free(connptr->client_ip_addr);
+  free(connptr);
+  free(r);
+  freelist_report();
+}
+
+/*
+ * Register the events the transfer in "slot" is waiting for.
+ */
+static void relay_watch(int slot)
+{
+  struct relay_s *r = relayd.relays[slot];
+  struct conn_s *connptr = r->conn;
+  struct epoll_event ev;
+  uint32_t events[2] = { 0, 0 };
+  int fd[2], i, op;
+
+  fd[CLIENT] = connptr->client_fd;
+  fd[SERVER] = connptr->server_fd;
+
+  if (!r->closing) {
+    if (buffer_room(connptr->cbuffer) > 0)
+      events[CLIENT] |= EPOLLIN;
+    if (buffer_room(connptr->sbuffer) > 0)
+      events[SERVER] |= EPOLLIN;
+  }
+  if (buffer_size(connptr->sbuffer) > 0)
+    events[CLIENT] |= EPOLLOUT;
+  if (buffer_size(connptr->cbuffer) > 0 && (!r->closing || r->shutdown))
+    events[SERVER] |= EPOLLOUT;
+
+  for (i = CLIENT; i <= SERVER; i++) {
+    if (events[i] == r->watched[i])
+      continue;
+
+    /* a hangup is reported even without any events, so drop the fd */
+    if (!events[i])
+      op = EPOLL_CTL_DEL;
+    else
+      op = r->watched[i] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    ev.events = events[i];
+    ev.data.u64 = ((uint64_t) slot << 1) | i;
+    if (epoll_ctl(relayd.epfd, op, fd[i], &ev) == -1)
+      log_message(LOG_ERR, "relay_watch: epoll_ctl() %s", strerror(errno));
+    r->watched[i] = events[i];
+  }
+}
+
+/*
+ * The transfer in "slot" is finished, log it and free everything.
+ */
+static void relay_end(int slot)
+{
+  struct relay_s *r = relayd.relays[slot];
+
+  if (r->watched[CLIENT])
+    epoll_ctl(relayd.epfd, EPOLL_CTL_DEL, r->conn->client_fd, NULL);
+  if (r->watched[SERVER])
+    epoll_ctl(relayd.epfd, EPOLL_CTL_DEL, r->conn->server_fd, NULL);
+
+  log_message(LOG_CONN,
+	      "Closed connection between local client (fd:%d) and remote client (fd:%d)",
+	      r->conn->client_fd, r->conn->server_fd);
+  log_access(r->conn, &r->start);
+  update_stats(STAT_OFFLOAD_DONE);
+
+  relay_free(r);
+  relayd.relays[slot] = NULL;
+  relayd.count--;
+}
+
+/*
+ * Same as the end of relay_connection(): write the remainder to the
+ * client, send it a FIN and try to send the rest to the server.
+ */
+static void relay_close(int slot)
+{
+  struct relay_s *r = relayd.relays[slot];
+  struct conn_s *connptr = r->conn;
+
+  r->closing = TRUE;
+
+  if (!r->shutdown && buffer_size(connptr->sbuffer) == 0) {
+    shutdown(connptr->client_fd, SHUT_WR);
+    r->shutdown = TRUE;
+  }
+
+  if (r->shutdown && buffer_size(connptr->cbuffer) == 0)
+    relay_end(slot);
+  else
+    relay_watch(slot);
+}
+
+/*
+ * Do whatever the events on one side of the transfer in "slot" allow.
+ */
+static void relay_io(int slot, int side, uint32_t events)
+{
+  struct relay_s *r = relayd.relays[slot];
+  struct conn_s *connptr = r->conn;
+  ssize_t ret;
+
+  r->last_access = time(NULL);
+
+  if (events & (EPOLLERR | EPOLLHUP))
+    events |= r->watched[side];
+
+  if (side == SERVER && (events & EPOLLIN) && !r->closing) {
+    if ((ret = recv_buffer(connptr->server_fd, connptr->sbuffer, connptr)) < 0)
+      goto CLOSE;
+    connptr->server.content_length -= (uint64_t) ret;
+    if (connptr->server.content_length == 0)
+      goto CLOSE;
+  }
+  if (side == CLIENT && (events & EPOLLIN) && !r->closing) {
+    if (recv_buffer(connptr->client_fd, connptr->cbuffer, connptr) < 0)
+      goto CLOSE;
+  }
+  if (side == SERVER && (events & EPOLLOUT)) {
+    if ((ret = send_buffer(connptr->server_fd, connptr->cbuffer)) < 0)
+      goto END;
+    connptr->server.processed += (uint64_t) ret;
+  }
+  if (side == CLIENT && (events & EPOLLOUT)) {
+    if ((ret = send_buffer(connptr->client_fd, connptr->sbuffer)) < 0)
+      goto END;
+    connptr->client.processed += (uint64_t) ret;
+  }
+
+  if (r->closing)
+    relay_close(slot);
+  else
+    relay_watch(slot);
+  return;
+
+CLOSE:
+  relay_close(slot);
+  return;
+
+END:
+  relay_end(slot);
+}
+
+/*
+ * Store a new transfer, returns its slot or -1.
+ */
+static int relay_add(struct relay_s *r)
+{
+  int slot;
+
+  if (relayd.count == relayd.allocated) {
+    struct relay_s **new;
+    int n = relayd.allocated ? relayd.allocated * 2 : 64;
+
+    new = realloc(relayd.relays, n * sizeof(struct relay_s *));
+    if (!new)
+      return -1;
+    memset(new + relayd.allocated, 0,
+	   (n - relayd.allocated) * sizeof(struct relay_s *));
+    relayd.relays = new;
+    relayd.allocated = n;
+  }
+
+  for (slot = 0; relayd.relays[slot]; slot++);
+  relayd.relays[slot] = r;
+  relayd.count++;
+  return slot;
+}
+
+/*
+ * Take over a transfer from a child. Returns -1 if the channel is
+ * drained or closed.
+ */
+static int relay_receive(void)
+{
+  static unsigned char data[sizeof(struct relay_msg_s) + RELAY_DATA_MAX];
+  struct relay_msg_s hdr;
+  struct iovec iov = {.iov_base = data,.iov_len = sizeof(data) };
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+  } ctrl;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct relay_s *r = NULL;
+  unsigned char *p;
+  ssize_t len;
+  int fds[2], slot;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+
+  if ((len = recvmsg(channel[0], &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) <= 0) {
+    if (len == 0) {
+      log_message(LOG_WARNING, "Relay daemon lost its parent.");
+      relayd.orphaned = TRUE;
+    } else if (errno != EAGAIN && errno != EINTR)
+      log_message(LOG_ERR, "relay_receive: recvmsg() %s", strerror(errno));
+    return -1;
+  }
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+    log_message(LOG_ERR, "relay_receive: message without sockets");
+    return 0;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  memcpy(&hdr, data, sizeof(hdr));
+  if ((size_t) len != sizeof(hdr) + hdr.request_len + hdr.peer_len
+      + hdr.cdata_len + hdr.sdata_len) {
+    log_message(LOG_ERR, "relay_receive: truncated message");
+    goto ERROR_EXIT;
+  }
+
+  if (!(r = calloc(1, sizeof(struct relay_s)))
+      || !(r->conn = relay_conn(fds[0], fds[1])))
+    goto ERROR_EXIT;
+
+  p = data + sizeof(hdr);
+  r->conn->request_line = strndup((char *) p, hdr.request_len);
+  p += hdr.request_len;
+  r->conn->client_ip_addr = strndup((char *) p, hdr.peer_len);
+  p += hdr.peer_len;
+  if (!r->conn->request_line || !r->conn->client_ip_addr)
+    goto ERROR_EXIT;
+
+  if ((hdr.cdata_len && add_to_buffer(r->conn->cbuffer, p, hdr.cdata_len) < 0)
+      || (hdr.sdata_len
+	  && add_to_buffer(r->conn->sbuffer, p + hdr.cdata_len,
+			   hdr.sdata_len) < 0))
+    goto ERROR_EXIT;
+
+  r->conn->server.processed = hdr.server_processed;
+  r->conn->client.processed = hdr.client_processed;
+  r->conn->server.content_length = hdr.content_length;
+  r->conn->error_number = hdr.error_number;
+  r->conn->statuscode = hdr.statuscode;
+  r->start = hdr.start;
+  r->last_access = time(NULL);
+
+  if ((slot = relay_add(r)) < 0)
+    goto ERROR_EXIT;
+
+  socket_nonblocking(fds[0]);
+  socket_nonblocking(fds[1]);
+  relay_watch(slot);
+  return 0;
+
+ERROR_EXIT:
+  log_message(LOG_ERR, "Relay daemon could not take over connection.");
+  if (r && r->conn) {
+    /* close the sockets, but log the request anyway */
+    log_access(r->conn, &hdr.start);
+    relay_free(r);
+  } else {
+    close(fds[0]);
+    close(fds[1]);
+    free(r);
+  }
+  update_stats(STAT_OFFLOAD_DONE);
+  return 0;
+}
+
+/*
+ * End the transfers which were idle for too long.
+ */
+static void relay_timeouts(void)
+{
+  time_t now = time(NULL);
+  int slot;
+
+  for (slot = 0; slot < relayd.allocated; slot++) {
+    struct relay_s *r = relayd.relays[slot];
+
+    if (r && now - r->last_access >= (time_t) config.idletimeout) {
+      log_message(LOG_INFO, "Idle Timeout (after poll) as %li > %u.",
+		  (long) (now - r->last_access), config.idletimeout);
+      relay_end(slot);
+    }
+  }
+}
+
+/*
+ * The main loop of the relay relayd.
+ */
+static void relay_main(void)
+{
+  struct epoll_event events[RELAY_EVENTS], ev;
+  time_t last_check = time(NULL);
+  int i, n, slot;
+
+  if ((relayd.epfd = epoll_create(RELAY_EVENTS)) == -1) {
+    log_message(LOG_ERR, "relay_main: epoll_create() %s", strerror(errno));
+    exit(EX_OSERR);
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = RELAY_CHANNEL;
+  epoll_ctl(relayd.epfd, EPOLL_CTL_ADD, channel[0], &ev);
+
+  while (!relayd.orphaned || relayd.count) {
+    proctitle("relay (%d transfers)", relayd.count);
+
+    n = epoll_wait(relayd.epfd, events, RELAY_EVENTS, 1000);
+    if (n == -1) {
+      if (errno != EINTR)
+	log_message(LOG_ERR, "relay_main: epoll_wait() %s", strerror(errno));
+      n = 0;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.u64 == RELAY_CHANNEL) {
+	while (relay_receive() == 0);
+	if (relayd.orphaned)
+	  epoll_ctl(relayd.epfd, EPOLL_CTL_DEL, channel[0], NULL);
+	continue;
+      }
+
+      slot = (int) (events[i].data.u64 >> 1);
+      /* ended by an earlier event of this round */
+      if (!relayd.relays[slot])
+	continue;
+      relay_io(slot, (int) (events[i].data.u64 & 1), events[i].events);
+    }
+
+    if (time(NULL) != last_check) {
+      relay_timeouts();
+      last_check = time(NULL);
+    }
+  }
+
+  exit(0);
+}
+
+/*
+ * Fork the relay relayd. The channel is kept open in the parent, so a
+ * new daemon picks up where a crashed one left off.
+ */
+int relay_start(void)
+{
+  if (config.relayoffload <= 0)
+    return 0;
+
+  if (channel[0] == -1) {
+    int bufsize = 2 * (sizeof(struct relay_msg_s) + RELAY_DATA_MAX);
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channel) == -1) {
+      log_message(LOG_ERR, "relay_start: socketpair() %s", strerror(errno));
+      return -1;
+    }
+    setsockopt(channel[1], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(channel[0], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    socket_nonblocking(channel[0]);
+  }
+
+  if ((relay_pid = fork()) != 0) {
+    if (relay_pid < 0) {
+      log_message(LOG_ERR, "relay_start: fork() %s", strerror(errno));
+      return -1;
+    }
+    log_message(LOG_INFO, "Started relay daemon (pid %d).", relay_pid);
+    return 0;
+  }
+
+  set_signal_handler(SIGCHLD, SIG_DFL);
+  set_signal_handler(SIGTERM, SIG_DFL);
+  set_signal_handler(SIGHUP, SIG_IGN);
+
+  close(channel[1]);
+  close_listeners();
+  acceptor_release();
+
+  relay_main();			/* never returns */
+  return -1;
+}
+
+/*
+ * Terminate the relay daemon, the running transfers are cut off just
+ * like those of the children.
+ */
+void relay_stop(void)
+{
+  if (relay_pid > 0)
+    kill(relay_pid, SIGTERM);
+  relay_pid = -1;
+}
+
+/*
+ * Called from the SIGCHLD handler, returns TRUE if "pid" was the daemon.
+ */
+int relay_exited(pid_t pid)
+{
+  if (pid != relay_pid || pid <= 0)
+    return FALSE;
+  relay_pid = -1;
+  return TRUE;
+}
+
+/*
+ * Restart the relay daemon if it died.
+ */
+void relay_check(void)
+{
+  if (config.relayoffload > 0 && channel[0] != -1 && relay_pid == -1)
+    relay_start();
+}
+
+/*
+ * Called in a new child, the daemon end of the channel belongs to the
+ * daemon only.
+ */
+void relay_child(void)
+{
+  if (channel[0] != -1)
+    close(channel[0]);
+  channel[0] = -1;
+}
+
+/*
+ * Pass the connection to the relay daemon instead of relaying it here.
+ * Only CONNECT tunnels and responses of unknown length or at least
+ * "RelayOffload" bytes are worth it. Returns 0 if the daemon took over,
+ * the caller still has to clean up its copy of the connection.
+ */
+int relay_offload(struct conn_s *connptr, const struct timeval *start)
+{
+  struct relay_msg_s hdr;
+  unsigned char *data;
+  struct iovec iov[2];
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+  } ctrl;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  int fds[2];
+  ssize_t ret;
+
+  if (channel[1] == -1 || config.relayoffload <= 0)
+    return -1;
+  if (connptr->local_request
+      || (connptr->method != METH_CONNECT && connptr->method != METH_HTTP))
+    return -1;
+  if (connptr->method == METH_HTTP
+      && connptr->server.content_length != LENGTH_NONE
+      && connptr->server.content_length < (uint64_t) config.relayoffload)
+    return -1;
+  /* the daemon copies until the end, it does not parse chunks */
+  if (connptr->chunked.state != CHUNK_NONE
+      && (connptr->chunked.decode || REQUEST_COMPLETE(connptr)))
+    return -1;
+
+  /* get rid of whatever the sockets take right now */
+  socket_nonblocking(connptr->client_fd);
+  socket_nonblocking(connptr->server_fd);
+  while ((ret = send_buffer(connptr->client_fd, connptr->sbuffer)) > 0)
+    connptr->client.processed += (uint64_t) ret;
+  while ((ret = send_buffer(connptr->server_fd, connptr->cbuffer)) > 0)
+    connptr->server.processed += (uint64_t) ret;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.start = *start;
+  hdr.server_processed = connptr->server.processed;
+  hdr.client_processed = connptr->client.processed;
+  hdr.content_length = connptr->server.content_length;
+  hdr.error_number = connptr->error_number;
+  hdr.statuscode = connptr->statuscode;
+  hdr.request_len = connptr->request_line ? strlen(connptr->request_line) : 0;
+  hdr.peer_len = strlen(connptr->client_ip_addr);
+  hdr.cdata_len = buffer_size(connptr->cbuffer);
+  hdr.sdata_len = buffer_size(connptr->sbuffer);
+
+  if (hdr.request_len + hdr.peer_len + hdr.cdata_len + hdr.sdata_len
+      > RELAY_DATA_MAX)
+    return -1;
+
+  data = malloc(hdr.request_len + hdr.peer_len + hdr.cdata_len
+		+ hdr.sdata_len + 1);
+  if (!data)
+    return -1;
+
+  memcpy(data, connptr->request_line, hdr.request_len);
+  memcpy(data + hdr.request_len, connptr->client_ip_addr, hdr.peer_len);
+  copy_from_buffer(connptr->cbuffer,
+		   data + hdr.request_len + hdr.peer_len, hdr.cdata_len);
+  copy_from_buffer(connptr->sbuffer,
+		   data + hdr.request_len + hdr.peer_len + hdr.cdata_len,
+		   hdr.sdata_len);
+
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = data;
+  iov[1].iov_len = hdr.request_len + hdr.peer_len + hdr.cdata_len
+      + hdr.sdata_len;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&ctrl, 0, sizeof(ctrl));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+
+  fds[0] = connptr->client_fd;
+  fds[1] = connptr->server_fd;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  /* never wait for a busy daemon, relay the connection here instead */
+  ret = sendmsg(channel[1], &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  free(data);
+  if (ret < 0) {
+    if (errno != EAGAIN)
+      log_message(LOG_WARNING, "Could not pass connection to relay daemon: %s",
+		  strerror(errno));
+    return -1;
+  }
+
+  log_message(LOG_CONN,
+	      "Passed connection (client_fd:%d, server_fd:%d) to the relay daemon",
+	      connptr->client_fd, connptr->server_fd);
+  update_stats(STAT_OFFLOADED);
+  return 0;
+}
@@ -0,0 +1,40 @@
+/* $Id$
+ *
+ * See 'relay.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_RELAY_H
+#define TINYPROXY_RELAY_H
+
+#ifdef RELAY_SUPPORT
+struct conn_s;
+
+/* parent */
+extern int relay_start(void);
+extern void relay_stop(void);
+extern int relay_exited(pid_t pid);
+extern void relay_check(void);
+
+/* child */
+extern void relay_child(void);
+extern int relay_offload(struct conn_s *connptr, const struct timeval *start);
+#else
+#define relay_start() 0
+#define relay_stop()
+#define relay_exited(pid) 0
+#define relay_check()
+#define relay_child()
+#define relay_offload(connptr, start) -1
+#endif
+
+#endif
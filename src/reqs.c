@@ -22,6 +22,7 @@
  * General Public License for more details.
  */
 
+#define _GNU_SOURCE /* splice */
 #include <string.h>
 
 #include "tinyproxy-ex.h"
@@ -31,21 +32,26 @@
 #include "buffer.h"
 #include "conns.h"
 #include "filter.h"
-#include "hashmap.h"
+#include "headers.h"
 
 #include "htmlerror.h"
 #include "log.h"
 #include "network.h"
 #include "regexp.h"
+#include "relay.h"
 #include "reqs.h"
+#include "scan.h"
 #include "sock.h"
 #include "stats.h"
 #include "text.h"
+#include "uring.h"
 #include "utils.h"
 #include "vector.h"
 #include "ftp.h"
 #include "proctitle.h"
 #include "parse.h"
+#include "pool.h"
+#include "worker.h"
 
 /*
  * Maximum length of a HTTP line
@@ -136,46 +142,43 @@ static int check_allowed_connect_ports(int port)
 }
 
 /*
- * Read in the first line from the client (the request line for HTTP
- * connections. The request line is allocated from the heap, but it must
- * be freed in another function.
+ * Read the head of the request from the client and put the headers in
+ * the table, they point into the line buffer of the client. The request
+ * line (the first line for HTTP connections) is copied into the arena of
+ * the request.
  */
-static int read_request_line(struct conn_s *connptr)
+static int read_request_head(struct conn_s *connptr, headers_t headers)
 {
+  char *head, *line;
   ssize_t len;
+  int ret;
 
-  len = recvline(connptr->client_fd, &connptr->request_line);
-  if (len <= 0) {
+  len = recvhead(connptr->client_fd, &connptr->client_lines, &head);
+  if (len < 0) {
     log_message(LOG_ERR,
-		"read_request_line: Client (file descriptor: %d) closed socket before read.",
+		"read_request_head: Client (file descriptor: %d) closed socket before read.",
 		connptr->client_fd);
 
     return -1;
   }
 
-  /* Strip the new line characters */
-  len -= chomp(connptr->request_line, len);
-  connptr->request_len = len;
-  log_message(LOG_CONN, "Request (file descriptor %d): %s",
-	      connptr->client_fd, connptr->request_line);
-
-  return 0;
-}
+  ret = parse_head(head, len, &line, headers);
+  if (line) {
+    connptr->request_len = strlen(line);
+    if (!(connptr->request_line = arena_strndup(&connptr->arena, line,
+						connptr->request_len)))
+      return -1;
+    log_message(LOG_CONN, "Request (file descriptor %d): %s",
+		connptr->client_fd, connptr->request_line);
+  }
 
-/*
- * Free all the memory allocated in a request.
- */
-static void free_request_struct(request_t *request)
-{
-  if (!request)
-    return;
+  if (ret < 0) {
+    log_message(LOG_WARNING,
+		"Could not retrieve all the headers from the client");
+    return -1;
+  }
 
-  free(request->method);
-  free(request->protocol);
-  free(request->host);
-  free(request->path);
-  free(request->url);
-  free(request);
+  return 0;
 }
 
 /*
@@ -220,15 +223,15 @@ static int extract_http_url(const char *__url, request_t *request)
   char *url;
 
   if (NULL == (url = strstr(__url, "//")))
-    goto ERROR_EXIT;
+    return -1;
 
   url += 2;
 
-  request->host = malloc(strlen(url) + 1);
-  request->path = malloc(strlen(url) + 1);
+  request->host = request_alloc(request, strlen(url) + 1);
+  request->path = request_alloc(request, strlen(url) + 2);
 
   if (!request->host || !request->path)
-    goto ERROR_EXIT;
+    return -1;
 
   if (tolower(__url[0] == 'f'))
     theport = FTP_PORT;
@@ -245,21 +248,13 @@ static int extract_http_url(const char *__url, request_t *request)
     strcpy(request->path, "/");
   } else {
     log_message(LOG_ERR, "extract_http_url: Can't parse URL.");
-    goto ERROR_EXIT;
+    return -1;
   }
 
   /* Remove the username/password if they're present */
   strip_username_password(request->host);
 
   return 0;
-
-ERROR_EXIT:
-  if (request->host)
-    free(request->host);
-  if (request->path)
-    free(request->path);
-
-  return -1;
 }
 
 /*
@@ -267,7 +262,7 @@ ERROR_EXIT:
  */
 static int extract_ssl_url(const char *url, request_t *request)
 {
-  request->host = malloc(strlen(url) + 1);
+  request->host = request_alloc(request, strlen(url) + 1);
   if (!request->host)
     return -1;
 
@@ -277,7 +272,6 @@ static int extract_ssl_url(const char *url, request_t *request)
     request->port = HTTP_PORT_SSL;
   } else {
     log_message(LOG_ERR, "extract_ssl_url: Can't parse URL.");
-    free(request->host);
     return -1;
   }
 
@@ -291,7 +285,8 @@ static int extract_ssl_url(const char *url, request_t *request)
 /*
  * Build a URL from parts.
  */
-static int build_url(char **url, const char *host, int port, const char *path)
+static int build_url(char **url, request_t *request, const char *host,
+		     int port, const char *path)
 {
   int len;
 
@@ -301,7 +296,7 @@ static int build_url(char **url, const char *host, int port, const char *path)
   assert(path != NULL);
 
   len = strlen(host) + strlen(path) + 14;
-  *url = malloc(len);
+  *url = request_alloc(request, len);
   if (*url == NULL)
     return -1;
 
@@ -328,7 +323,7 @@ upstream_add(const char *host, int port, const char *domain,
   if (domain && strcmp(domain, "any") == 0)
     domain = NULL;
 
-  up->host = up->domain = NULL;
+  up->host = up->domain = up->authentication = NULL;
   up->ip = up->mask = 0;
 
   if (authentication && authentication[0] != '\0')
@@ -480,12 +475,13 @@ establish_http_connection(struct conn_s *connptr, request_t *request)
   else
     portbuff[0] = '\0';
 
-  enable_tcp_cork(connptr->server_fd);
-  return send_message(connptr->server_fd,
-		      "%s %s HTTP/1.0\r\n"
+  headbuf_start(&connptr->head_out, connptr->server_fd);
+  return headbuf_printf(&connptr->head_out,
+		      "%s %s HTTP/1.1\r\n"
 		      "Host: %s%s\r\n"
-		      "Connection: close\r\n",
-		      request->method, request->path, request->host, portbuff);
+		      "Connection: %s\r\n",
+		      request->method, request->path, request->host, portbuff,
+		      connptr->server_keepalive ? "keep-alive" : "close");
 }
 
 /*
@@ -500,23 +496,39 @@ establish_http_connection(struct conn_s *connptr, request_t *request)
  */
 static inline int send_ssl_response(struct conn_s *connptr)
 {
-  return send_message(connptr->client_fd,
-		      "%s\r\n"
-		      "%s\r\n" "\r\n", SSL_CONNECTION_RESPONSE, PROXY_AGENT);
+  static const char response[] =
+      SSL_CONNECTION_RESPONSE "\r\n" PROXY_AGENT "\r\n" "\r\n";
+
+  headbuf_start(&connptr->head_out, connptr->client_fd);
+  headbuf_add(&connptr->head_out, response, sizeof(response) - 1);
+  return headbuf_flush(&connptr->head_out, FALSE);
 }
 
 /*
  * Break the request line apart and figure out where to connect and
  * build a new request line. Finally connect to the remote server.
  */
-static request_t *process_request(struct conn_s *connptr, hashmap_t hashofheaders)
+static request_t *process_request(struct conn_s *connptr, headers_t headers)
 {
   char *url;
   request_t *request;
+  size_t size;
   int ret;
 
-  /* NULL out all the fields so free's don't cause segfaults. */
-  if (NULL == (request = calloc(1, sizeof(request_t))))
+  /*
+   * Room for the pieces of the request line, the host and path taken
+   * from the URL and a rewritten URL or path.
+   */
+  size = 4 * (connptr->request_len + 1) + 64;
+#ifdef TRANSPARENT_PROXY
+  {
+    struct header_s *host = headers_find(headers, "host");
+
+    if (host)
+      size += 2 * (host->valuelen + 1);
+  }
+#endif
+  if (NULL == (request = new_request(&connptr->arena, size)))
     return NULL;
 
   /* it is safe to depend on connptr->request_line since it's presence is
@@ -527,7 +539,6 @@ static request_t *process_request(struct conn_s *connptr, hashmap_t hashofheader
     log_message(LOG_ERR, "process_request: Bad Request on file descriptor %d", connptr->client_fd);
     indicate_http_error(connptr, 400, "Bad Request", "detail", "Request has an invalid format",
 			"request line", connptr->request_line, NULL);
-    free_request_struct(request);
     return NULL;
   }
 
@@ -542,8 +553,6 @@ static request_t *process_request(struct conn_s *connptr, hashmap_t hashofheader
       indicate_http_error(connptr, 400, "Bad Request",
 			  "detail", "Could not parse URL", "url", url, NULL);
 
-      free_request_struct(request);
-
       return NULL;
     }
     if (url[0] == 'f' || url[0] == 'F') {
@@ -558,8 +567,6 @@ static request_t *process_request(struct conn_s *connptr, hashmap_t hashofheader
       indicate_http_error(connptr, 400, "Bad Request",
 			  "detail", "Could not parse URL", "url", url, NULL);
 
-      free_request_struct(request);
-
       return NULL;
     }
 
@@ -570,8 +577,6 @@ static request_t *process_request(struct conn_s *connptr, hashmap_t hashofheader
 			  "with the port you tried to use.", "url", url, NULL);
       log_message(LOG_INFO, "Refused CONNECT method on port %d", request->port);
 
-      free_request_struct(request);
-
       return NULL;
     }
 
@@ -587,11 +592,11 @@ static request_t *process_request(struct conn_s *connptr, hashmap_t hashofheader
      *
      * This code was written by Petr Lampa <lampa@fit.vutbr.cz>
      */
-    int length;
-    void *data;
-    length = hashmap_entry_by_key(hashofheaders, "host", &data);
-    if (length <= 0) {
+    struct header_s *host = headers_find(headers, "host");
+
+    if (!host) {
       struct sockaddr_in dest_addr;
+      socklen_t length = sizeof(dest_addr);
 
       if (getsockname
 	  (connptr->client_fd, (struct sockaddr *) &dest_addr, &length)
@@ -601,28 +606,25 @@ static request_t *process_request(struct conn_s *connptr, hashmap_t hashofheader
 		    connptr->client_fd);
 	indicate_http_error(connptr, 400, "Bad Request", "detail",
 			    "Unknown destination", "url", url, NULL);
-	free_request_struct(request);
 	return NULL;
       }
-      request->host = malloc(17);
-      strcpy(request->host, inet_ntoa(dest_addr.sin_addr));
+      request->host = request_strndup(request, inet_ntoa(dest_addr.sin_addr),
+				      strlen(inet_ntoa(dest_addr.sin_addr)));
       request->port = ntohs(dest_addr.sin_port);
-      request->path = malloc(strlen(url) + 1);
-      strcpy(request->path, url);
-      build_url(&url, request->host, request->port, request->path);
+      request->path = request_strndup(request, url, strlen(url));
+      build_url(&url, request, request->host, request->port, request->path);
       log_message(LOG_INFO,
 		  "process_request: trans IP %s %s for %d",
 		  request->method, url, connptr->client_fd);
     } else {
-      request->host = malloc(length + 1);
-      if (sscanf((char *) data, "%[^:]:%hu", request->host, &request->port) !=
+      request->host = request_alloc(request, host->valuelen + 1);
+      if (sscanf(host->value, "%[^:]:%hu", request->host, &request->port) !=
 	  2) {
-	strcpy(request->host, (char *) data);
+	strcpy(request->host, host->value);
 	request->port = HTTP_PORT;
       }
-      request->path = malloc(strlen(url) + 1);
-      strcpy(request->path, url);
-      build_url(&url, request->host, request->port, request->path);
+      request->path = request_strndup(request, url, strlen(url));
+      build_url(&url, request, request->host, request->port, request->path);
       log_message(LOG_INFO,
 		  "process_request: trans Host %s %s for %d",
 		  request->method, url, connptr->client_fd);
@@ -635,7 +637,6 @@ static request_t *process_request(struct conn_s *connptr, hashmap_t hashofheader
 			  "detail",
 			  "You tried to connect to the machine the proxy is running on",
 			  "url", url, NULL);
-      free_request_struct(request);
       return NULL;
     }
 #else
@@ -645,8 +646,6 @@ static request_t *process_request(struct conn_s *connptr, hashmap_t hashofheader
     indicate_http_error(connptr, 400, "Bad Request",
 			"detail", "Unknown URL type", "url", url, NULL);
 
-    free_request_struct(request);
-
     return NULL;
 #endif
   }
@@ -659,7 +658,6 @@ static request_t *process_request(struct conn_s *connptr, hashmap_t hashofheader
   if (config.stathost && strcmp(config.stathost, request->host) == 0) {
     log_message(LOG_DEBUG, "Request for the stathost.");
     connptr->show_stats = TRUE;
-    free_request_struct(request);
     return NULL;
   } else if (strcmp(INTERNALNAME, request->host) == 0) {
     log_message(LOG_DEBUG, "Request for a local file.");
@@ -720,7 +718,6 @@ static request_t *process_request(struct conn_s *connptr, hashmap_t hashofheader
 			    "url", url, NULL);
       }
       free(status);
-      free_request_struct(request);
 
       return NULL;
     }
@@ -757,7 +754,15 @@ static int pull_client_data(struct conn_s *connptr, uint64_t length)
     return -1;
 
   do {
-    len = safe_recv(connptr->client_fd, buffer, min(MAXBUFFSIZE, length));
+    /* the start of the body may have come along with the headers */
+    if (linebuf_pending(&connptr->client_lines) > 0) {
+      size_t taken = min(MAXBUFFSIZE, length);
+      char *data = linebuf_take(&connptr->client_lines, &taken);
+
+      memcpy(buffer, data, taken);
+      len = (ssize_t) taken;
+    } else
+      len = safe_recv(connptr->client_fd, buffer, min(MAXBUFFSIZE, length));
     if (len <= 0)
       goto ERROR_EXIT;
 
@@ -774,6 +779,16 @@ static int pull_client_data(struct conn_s *connptr, uint64_t length)
    * return and line feed) at the end of a POST message.  These
    * need to be eaten for tinyproxy-ex to work correctly.
    */
+  if (linebuf_pending(&connptr->client_lines) > 0) {
+    char *pending = connptr->client_lines.data + connptr->client_lines.start;
+    size_t taken = 2;
+
+    if (linebuf_pending(&connptr->client_lines) >= 2
+	&& CHECK_CRLF(pending, taken))
+      linebuf_take(&connptr->client_lines, &taken);
+    free(buffer);
+    return 0;
+  }
   socket_nonblocking(connptr->client_fd);
   len = recv(connptr->client_fd, buffer, 2, MSG_PEEK);
   socket_blocking(connptr->client_fd);
@@ -806,8 +821,8 @@ static int add_xtinyproxy_ex_header(struct conn_s *connptr)
   if (connptr->server_fd < 0)
     return 0;
 
-  return send_message(connptr->server_fd,
-		      "X-Tinyproxy: %s\r\n", connptr->client_ip_addr);
+  return headbuf_printf(&connptr->head_out,
+			"X-Tinyproxy: %s\r\n", connptr->client_ip_addr);
 }
 #endif				/* XTINYPROXY */
 
@@ -816,175 +831,193 @@ static int add_proxy_authentication(struct conn_s *connptr)
   if (connptr->server_fd < 0)
     return 0;
 
-  return send_message(connptr->server_fd,
-		      "Proxy-Authorization: Basic %s\r\n",
-		      connptr->upstream_proxy->authentication);
+  return headbuf_printf(&connptr->head_out,
+			"Proxy-Authorization: Basic %s\r\n",
+			connptr->upstream_proxy->authentication);
 }
 
 /*
- * Take a complete header line and break it apart (into a key and the data.)
- * Now insert this information into the hashmap for the connection so it
- * can be retrieved and manipulated later.
+ * Read the head of a message and put its headers in the table, the first
+ * line is returned in "*first". Everything points into the line buffer.
  */
-static inline int
-add_header_to_connection(hashmap_t hashofheaders, char *header, size_t len)
+static int read_head(int fd, struct linebuf_s *lb, char **first,
+		     headers_t headers)
 {
-  char *sep;
-
-  /* Get rid of the new line and return at the end */
-  len -= chomp(header, len);
+  char *head;
+  ssize_t len;
 
-  sep = strchr(header, ':');
-  if (!sep)
+  *first = NULL;
+  if ((len = recvhead(fd, lb, &head)) < 0)
     return -1;
 
-  /* Blank out colons, spaces, and tabs. */
-  while (*sep == ':' || *sep == ' ' || *sep == '\t')
-    *sep++ = '\0';
-
-  /* Calculate the new length of just the data */
-  len -= sep - header - 1;
-
-  return hashmap_insert(hashofheaders, header, sep, len);
+  return parse_head(head, len, first, headers);
 }
 
 /*
- * Read all the headers from the stream
+ * Extract the headers to remove.  These headers were listed in the Connection
+ * and Proxy-Connection headers.
  */
-static int get_all_headers(int fd, hashmap_t hashofheaders)
+static int remove_connection_headers(headers_t headers)
 {
-  char *header;
-  ssize_t len;
-  unsigned int double_cgi = FALSE;	/* boolean */
+  static char *names[] = {
+    "connection",
+    "proxy-connection"
+  };
 
-  assert(fd >= 0);
-  assert(hashofheaders != NULL);
+  struct header_s *hdr;
+  char *ptr, *end;
+  size_t len;
+  int i;
 
-  for (;;) {
-    if ((len = recvline(fd, &header)) <= 0) {
-      free(header);
-      return -1;
+  for (i = 0; i != (sizeof(names) / sizeof(char *)); ++i) {
+    /* Every one of the connection headers lists headers to remove. */
+    for (hdr = headers_find(headers, names[i]); hdr;
+	 hdr = headers_find_next(headers, hdr)) {
+      /*
+       * Go through the tokens of the value, ending each with a NUL,
+       * and remove the headers they name.
+       */
+      end = hdr->value + hdr->valuelen;
+      for (ptr = hdr->value; ptr < end; ptr += len + 1) {
+	len = scan_token(ptr, (size_t) (end - ptr));
+	ptr[len] = '\0';
+	if (len)
+	  headers_remove(headers, ptr);
+      }
     }
 
-    /*
-     * If we received just a CR LF on a line, the headers are
-     * finished.
-     */
-    if (CHECK_CRLF(header, len)) {
-      free(header);
-      return 0;
-    }
+    /* Now remove the connection header it self. */
+    headers_remove(headers, names[i]);
+  }
 
-    /*
-     * BUG FIX: The following code detects a "Double CGI"
-     * situation so that we can handle the nonconforming system.
-     * This problem was found when accessing cgi.ebay.com, and it
-     * turns out to be a wider spread problem as well.
-     *
-     * If "Double CGI" is in effect, duplicate headers are
-     * ignored.
-     *
-     * FIXME: Might need to change this to a more robust check.
-     */
-    if (strncasecmp(header, "HTTP/", 5) == 0) {
-      double_cgi = TRUE;
+  return 0;
+}
 
-      free(header);
-      continue;
-    }
+/*
+ * If there is a Content-Length header, then return the value; otherwise, return
+ * a negative number.
+ */
+static uint64_t get_content_length(headers_t headers)
+{
+  char *data;
+  uint64_t content_length = LENGTH_NONE;
 
-    if (!double_cgi && add_header_to_connection(hashofheaders, header, len) < 0) {
-      free(header);
-      return -1;
-    }
+  if ((data = headers_get(headers, "content-length")))
+    content_length = (uint64_t) strtoull(data, NULL, 10);
 
-    free(header);
-  }
+  return content_length;
 }
 
 /*
- * Extract the headers to remove.  These headers were listed in the Connection
- * and Proxy-Connection headers.
+ * Check whether the comma separated lists in the headers called "key"
+ * contain "token".
  */
-static int remove_connection_headers(hashmap_t hashofheaders)
+static int header_has_token(headers_t headers, const char *key,
+			    const char *token)
 {
-  static char *headers[] = {
-    "connection",
-    "proxy-connection"
-  };
-
-  void *data;
+  size_t toklen = strlen(token), len;
+  struct header_s *hdr;
   char *ptr, *end;
-  ssize_t len;
-  int i;
 
-  for (i = 0; i != (sizeof(headers) / sizeof(char *)); ++i) {
-    /* Look for the connection header.  If it's not found, return. */
-    len = hashmap_entry_by_key(hashofheaders, headers[i], &data);
-    if (len <= 0)
-      return 0;
+  for (hdr = headers_find(headers, key); hdr;
+       hdr = headers_find_next(headers, hdr)) {
+    end = hdr->value + hdr->valuelen;
+    for (ptr = hdr->value; ptr < end; ptr += len ? len : 1) {
+      len = scan_token(ptr, (size_t) (end - ptr));
+      if (len == toklen && strncasecmp(ptr, token, len) == 0)
+	return TRUE;
+    }
+  }
 
-    /*
-     * Go through the data line and replace any special characters
-     * with a NULL.
-     */
-    ptr = (char *) data;
-    while ((ptr = strpbrk(ptr, "()<>@,;:\\\"/[]?={} \t")))
-      *ptr++ = '\0';
+  return FALSE;
+}
 
-    /*
-     * All the tokens are separated by NULLs.  Now go through the
-     * token and remove them from the hashofheaders.
-     */
-    ptr = (char *) data;
-    end = ptr + len;
-    while (ptr < end) {
-      hashmap_remove(hashofheaders, ptr);
-
-      /* Advance ptr to the next token */
-      ptr += strlen(ptr) + 1;
-      while (ptr < end && *ptr == '\0')
+/*
+ * Remove "token" from the lists in all "key" headers, in place, and the
+ * headers it was the only element of.
+ */
+static void header_remove_token(headers_t headers, const char *key,
+				const char *token)
+{
+  size_t toklen = strlen(token), len;
+  struct header_s *hdr;
+  char *ptr, *end, *next, *out;
+
+  for (hdr = headers_find(headers, key); hdr;
+       hdr = headers_find_next(headers, hdr)) {
+    end = hdr->value + hdr->valuelen;
+    out = hdr->value;
+    for (ptr = hdr->value; ptr < end; ptr = next + 1) {
+      if (!(next = memchr(ptr, ',', (size_t) (end - ptr))))
+	next = end;
+      while (ptr < next && (*ptr == ' ' || *ptr == '\t'))
 	ptr++;
+      for (len = (size_t) (next - ptr);
+	   len && (ptr[len - 1] == ' ' || ptr[len - 1] == '\t'); len--);
+      if (len == 0 || (len == toklen && strncasecmp(ptr, token, len) == 0))
+	continue;
+
+      /* never longer than what has been read, so it fits */
+      if (out != hdr->value)
+	*out++ = ',';
+      memmove(out, ptr, len);
+      out += len;
     }
-
-    /* Now remove the connection header it self. */
-    hashmap_remove(hashofheaders, headers[i]);
+    *out = '\0';
+    hdr->valuelen = (size_t) (out - hdr->value);
+    if (hdr->valuelen == 0)
+      hdr->removed = TRUE;
   }
-
-  return 0;
 }
 
 /*
- * If there is a Content-Length header, then return the value; otherwise, return
- * a negative number.
+ * Decide if the client connection may stay open after the response, must
+ * be called before the Connection headers are removed. HTTP/1.1 clients
+ * keep their connections unless they say otherwise, HTTP/1.0 clients have
+ * to ask for it. A request body has to be delimited by Content-Length,
+ * anything else is relayed until the connection ends.
  */
-static uint64_t get_content_length(hashmap_t hashofheaders)
+static int client_keepalive(struct conn_s *connptr, headers_t headers)
 {
-  ssize_t len;
-  void *data;
-  uint64_t content_length = LENGTH_NONE;
+  uint64_t length;
 
-  len = hashmap_entry_by_key(hashofheaders, "content-length", &data);
-  if (len > 0)
-    content_length = (uint64_t) strtoull((char *) data, NULL, 10);
+  if (connptr->method == METH_CONNECT || connptr->method == METH_FTP)
+    return FALSE;
 
-  return content_length;
+  if (headers_find(headers, "transfer-encoding"))
+    return FALSE;
+
+  /* only a forwarded request gets its body pulled */
+  length = get_content_length(headers);
+  if (length != LENGTH_NONE && length != 0
+      && (connptr->show_stats || connptr->local_request))
+    return FALSE;
+
+  if (header_has_token(headers, "connection", "close")
+      || header_has_token(headers, "proxy-connection", "close"))
+    return FALSE;
+
+  if (connptr->client.major > 1
+      || (connptr->client.major == 1 && connptr->client.minor >= 1))
+    return TRUE;
+
+  return header_has_token(headers, "connection", "keep-alive")
+      || header_has_token(headers, "proxy-connection", "keep-alive");
 }
 
 /*
- * Search for Via header in a hash of headers and either write a new Via
- * header, or append our information to the end of an existing Via header.
+ * Search for Via headers and either write a new Via header, or append our
+ * information to the end of the last existing Via header.
  *
  * FIXME: Need to add code to "hide" our internal information for security
  * purposes.
  */
 static int
-write_via_header(int fd, hashmap_t hashofheaders,
+write_via_header(struct headbuf_s *hb, headers_t headers,
 		 unsigned int major, unsigned int minor)
 {
-  ssize_t len;
   char hostname[512];
-  void *data;
+  struct header_s *hdr, *next;
   int ret;
 
   if (config.via_proxy_name) {
@@ -994,30 +1027,26 @@ write_via_header(int fd, hashmap_t hashofheaders,
   }
 
   /*
-   * See if there is a "Via" header.  If so, again we need to do a bit
-   * of processing.
+   * See if there are "Via" headers.  If so, again we need to do a bit
+   * of processing, they have to stay in order.
    */
-  len = hashmap_entry_by_key(hashofheaders, "via", &data);
-  if (len > 0) {
-    ret = send_message(fd,
-		       "Via: %s, %hu.%hu %s (%s/%s)\r\n",
-		       (char *) data, major, minor, hostname, PACKAGE, VERSION);
-
-    hashmap_remove(hashofheaders, "via");
+  if ((hdr = headers_find(headers, "via"))) {
+    for (; (next = headers_find_next(headers, hdr)); hdr = next)
+      headbuf_header(hb, "Via", 3, hdr->value, hdr->valuelen);
+    headbuf_add(hb, "Via: ", 5);
+    headbuf_add(hb, hdr->value, hdr->valuelen);
+    ret = headbuf_printf(hb, ", %hu.%hu %s (%s/%s)\r\n",
+			 major, minor, hostname, PACKAGE, VERSION);
+
+    headers_remove(headers, "via");
   } else {
-    ret = send_message(fd,
-		       "Via: %hu.%hu %s (%s/%s)\r\n",
-		       major, minor, hostname, PACKAGE, VERSION);
+    ret = headbuf_printf(hb, "Via: %hu.%hu %s (%s/%s)\r\n",
+			 major, minor, hostname, PACKAGE, VERSION);
   }
 
   return ret;
 }
 
-/*
- * Number of buckets to use internally in the hashmap.
- */
-#define HEADER_BUCKETS 32
-
 /*
  * Here we loop through all the headers the client is sending. If we
  * are running in anonymous mode, we will _only_ send the headers listed
@@ -1025,7 +1054,7 @@ write_via_header(int fd, hashmap_t hashofheaders,
  *	- rjkaes
  */
 static int
-process_client_headers(struct conn_s *connptr, hashmap_t hashofheaders)
+process_client_headers(struct conn_s *connptr, headers_t headers)
 {
   static const char *skipheaders[] = {
     "host",
@@ -1036,12 +1065,9 @@ process_client_headers(struct conn_s *connptr, hashmap_t hashofheaders)
     "upgrade"
   };
   int i;
-  hashmap_iter iter;
+  struct header_s *hdr;
   int ret = 0;
 
-  char *data;
-  void *header;
-
   /*
    * Don't send headers if there's already an error, if the request was
    * a stats/local request, or if this was a CONNECT/FTP method (unless
@@ -1065,55 +1091,36 @@ process_client_headers(struct conn_s *connptr, hashmap_t hashofheaders)
    * See if there is a "Content-Length" header.  If so, again we need
    * to do a bit of processing.
    */
-  connptr->client.content_length = get_content_length(hashofheaders);
+  connptr->client.content_length = get_content_length(headers);
+
+  /* the server connection ends with a body of unknown length */
+  if (headers_find(headers, "transfer-encoding"))
+    connptr->server_keepalive = FALSE;
 
   /*
    * See if there is a "Connection" header.  If so, we need to do a bit
    * of processing. :)
    */
-  remove_connection_headers(hashofheaders);
+  remove_connection_headers(headers);
 
   /*
    * Delete the headers listed in the skipheaders list
    */
   for (i = 0; i != (sizeof(skipheaders) / sizeof(char *)); i++) {
-    hashmap_remove(hashofheaders, skipheaders[i]);
-  }
-
-  /* Send, or add the Via header */
-  ret = write_via_header(connptr->server_fd, hashofheaders,
-			 connptr->client.major, connptr->client.minor);
-  if (ret < 0) {
-    indicate_http_error(connptr, 503,
-			"Could not send data to remote server",
-			"detail",
-			"A network error occurred while trying to write data to the remote web server.",
-			NULL);
-    goto PULL_CLIENT_DATA;
+    headers_remove(headers, skipheaders[i]);
   }
 
   /*
-   * Output all the remaining headers to the remote machine.
+   * The request line is already in the head, add the Via header and all
+   * the remaining headers. Nothing is sent before the head is complete.
    */
-  iter = hashmap_first(hashofheaders);
-  if (iter >= 0) {
-    for (; !hashmap_is_end(hashofheaders, iter); ++iter) {
-      hashmap_return_entry(hashofheaders, iter, &data, &header);
-
-      if (!is_anonymous_enabled() || anonymous_search(data) > 0) {
-	ret =
-	    send_message(connptr->server_fd, "%s: %s\r\n", data,
-			 (char *) header);
-	if (ret < 0) {
-	  indicate_http_error(connptr, 503,
-			      "Could not send data to remote server",
-			      "detail",
-			      "A network error occurred while trying to write data to the remote web server.",
-			      NULL);
-	  goto PULL_CLIENT_DATA;
-	}
-      }
-    }
+  write_via_header(&connptr->head_out, headers,
+		   connptr->client.major, connptr->client.minor);
+
+  for (hdr = headers_first(headers); hdr; hdr = headers_next(headers, hdr)) {
+    if (!is_anonymous_enabled() || anonymous_search(hdr->name) > 0)
+      headbuf_header(&connptr->head_out, hdr->name, hdr->namelen,
+		     hdr->value, hdr->valuelen);
   }
 #if defined(XTINYPROXY_ENABLE)
   if (config.my_domain)
@@ -1124,13 +1131,22 @@ process_client_headers(struct conn_s *connptr, hashmap_t hashofheaders)
     add_proxy_authentication(connptr);
 
   /* Write the final "blank" line to signify the end of the headers */
-  if (safe_send(connptr->server_fd, "\r\n", 2) < 0)
-    return -1;
+  headbuf_add(&connptr->head_out, "\r\n", 2);
+
+  /* the request body follows right away */
+  ret = headbuf_flush(&connptr->head_out,
+		      connptr->client.content_length
+		      && connptr->client.content_length != LENGTH_NONE);
+  if (ret < 0)
+    indicate_http_error(connptr, 503,
+			"Could not send data to remote server",
+			"detail",
+			"A network error occurred while trying to write data to the remote web server.",
+			NULL);
 
   /*
    * Spin here pulling the data from the client.
    */
-PULL_CLIENT_DATA:
   if (connptr->client.content_length
       && connptr->client.content_length != LENGTH_NONE)
     return pull_client_data(connptr, connptr->client.content_length);
@@ -1138,6 +1154,24 @@ PULL_CLIENT_DATA:
     return ret;
 }
 
+/*
+ * Check if the server keeps its connection open after the response, must
+ * be called before the Connection headers are removed.
+ */
+static int server_keepalive(struct conn_s *connptr, headers_t headers)
+{
+  if (header_has_token(headers, "connection", "close")
+      || header_has_token(headers, "proxy-connection", "close"))
+    return FALSE;
+
+  if (connptr->server.major > 1
+      || (connptr->server.major == 1 && connptr->server.minor >= 1))
+    return TRUE;
+
+  return header_has_token(headers, "connection", "keep-alive")
+      || header_has_token(headers, "proxy-connection", "keep-alive");
+}
+
 /*
  * Loop through all the headers (including the response code) from the
  * server.
@@ -1153,22 +1187,39 @@ static int process_server_headers(struct conn_s *connptr)
 
   char *response_line;
 
-  hashmap_t hashofheaders;
-  hashmap_iter iter;
+  headers_t headers;
+  struct header_s *hdr;
   char *data;
-  void *header;
-  ssize_t len;
-  size_t num;
   int i;
-  int ret;
+  int ret, bodyless;
 
   /* FIXME: Remember to handle a "simple_req" type */
 
   /* Get the response line from the remote server. */
-  len = recvline(connptr->server_fd, &response_line);
-  if (len <= 0)
+READ_RESPONSE:
+  headers = headers_create(&connptr->arena);
+  if (!headers)
     return -1;
 
+  /*
+   * Get all the headers from the remote server
+   */
+  if (read_head(connptr->server_fd, &connptr->server_lines, &response_line,
+		headers) < 0) {
+    log_message(LOG_WARNING,
+		"Could not retrieve all the headers from the remote server.");
+    /* an empty or broken response line is not worth a word */
+    if (!response_line || !strchr(response_line, ' '))
+      return -1;
+
+    indicate_http_error(connptr, 503, "Could not retrieve all the headers",
+			"detail",
+			PACKAGE
+			" was unable to retrieve and process headers from the remote web server.",
+			NULL);
+    return -1;
+  }
+
   /* The first response line should look like this:
    *
    * HTTP/1.0 200 OK or similar
@@ -1178,106 +1229,403 @@ static int process_server_headers(struct conn_s *connptr)
    * return -1, period.
    **/
   if (!(data = strchr(response_line, ' '))
-      || !(connptr->statuscode = atoi(data))) {
-    free(response_line);
+      || !(connptr->statuscode = atoi(data)))
     return -1;
-  }
 
-  /* PARANOIA alarm!
-   * even broken servers should terminate the response line with
-   * '\r' or '\n'. Bail out if not.
-   **/
-  if ((num = strcspn(response_line, "\r\n")) == 0) {
-    free(response_line);
-    return -1;
-  }
+  sscanf(response_line, "HTTP/%u.%u",
+	 &connptr->server.major, &connptr->server.minor);
 
-  response_line[num] = '\0';
+  /*
+   * Skip interim responses like "100 Continue", the request body was
+   * sent without waiting for them.
+   */
+  if (connptr->statuscode >= 100 && connptr->statuscode < 200
+      && connptr->statuscode != 101)
+    goto READ_RESPONSE;
 
-  hashofheaders = hashmap_create(HEADER_BUCKETS);
-  if (!hashofheaders) {
-    free(response_line);
-    return -1;
-  }
+  /* The saved response line goes first */
+  headbuf_start(&connptr->head_out, connptr->client_fd);
+  headbuf_add(&connptr->head_out, response_line, strlen(response_line));
+  headbuf_add(&connptr->head_out, "\r\n", 2);
 
   /*
-   * Get all the headers from the remote server in a big hash
+   * If there is a "Content-Length" header, retrieve the information
+   * from it for later use.
    */
-  if (get_all_headers(connptr->server_fd, hashofheaders) < 0) {
-    log_message(LOG_WARNING,
-		"Could not retrieve all the headers from the remote server.");
-    hashmap_delete(hashofheaders);
-    free(response_line);
+  connptr->server.content_length = get_content_length(headers);
 
-    indicate_http_error(connptr, 503, "Could not retrieve all the headers",
-			"detail",
-			PACKAGE
-			" was unable to retrieve and process headers from the remote web server.",
-			NULL);
-    return -1;
-  }
+  /* the server has to agree to keep its connection open */
+  if (connptr->server_keepalive
+      && !server_keepalive(connptr, headers))
+    connptr->server_keepalive = FALSE;
 
-  /* Set TCP_CORK option were supported */
-  enable_tcp_cork(connptr->client_fd);
+  bodyless = strncmp(connptr->request_line, "HEAD ", 5) == 0
+      || connptr->statuscode == 204 || connptr->statuscode == 304;
 
-  /* Send the saved response line first */
-  ret = send_message(connptr->client_fd, "%s\r\n", response_line);
-  free(response_line);
-  if (ret < 0)
-    goto ERROR_EXIT;
+  /*
+   * A chunked body goes through the chunk parser, which finds its end.
+   * HTTP/1.0 clients do not know the coding, they get the data only and
+   * the end of the connection marks the end of the body. Other codings
+   * (like gzip) stay in the header and the body.
+   */
+  if (connptr->method != METH_CONNECT && !bodyless
+      && header_has_token(headers, "transfer-encoding", "chunked")) {
+    int decode = connptr->client.major < 1
+	|| (connptr->client.major == 1 && connptr->client.minor == 0);
+
+    if (decode)
+      header_remove_token(headers, "transfer-encoding", "chunked");
+    chunked_start(&connptr->chunked, decode);
+
+    /* the chunks take precedence over a Content-Length */
+    headers_remove(headers, "content-length");
+    connptr->server.content_length = LENGTH_NONE;
+    if (decode)
+      connptr->keepalive = FALSE;
+  }
 
   /*
-   * If there is a "Content-Length" header, retrieve the information
-   * from it for later use.
+   * The client and the server connection can only stay open if the end
+   * of the response is known without waiting for the server to close.
+   * Responses large enough for the relay daemon are handed over and end
+   * both connections.
    */
-  connptr->server.content_length = get_content_length(hashofheaders);
+  if (!REQUEST_COMPLETE(connptr)) {
+    /* nothing to decide */
+  } else if (bodyless) {
+    connptr->server.content_length = 0;
+  } else if (connptr->chunked.state != CHUNK_NONE) {
+    /* the last chunk ends the body */
+  } else if (connptr->server.content_length == LENGTH_NONE
+	     || headers_find(headers, "transfer-encoding")
+	     || (config.relayoffload > 0
+		 && connptr->server.content_length
+		 >= (uint64_t) config.relayoffload)) {
+    connptr->keepalive = connptr->server_keepalive = FALSE;
+  }
 
   /*
    * See if there is a connection header.  If so, we need to to a bit of
    * processing.
    */
-  remove_connection_headers(hashofheaders);
+  remove_connection_headers(headers);
 
   /*
    * Delete the headers listed in the skipheaders list
    */
   for (i = 0; i != (sizeof(skipheaders) / sizeof(char *)); i++) {
-    hashmap_remove(hashofheaders, skipheaders[i]);
+    headers_remove(headers, skipheaders[i]);
   }
 
-  /* Send, or add the Via header */
-  ret = write_via_header(connptr->client_fd, hashofheaders,
-			 connptr->client.major, connptr->client.minor);
-  if (ret < 0)
-    goto ERROR_EXIT;
+  /* Add the Via header */
+  write_via_header(&connptr->head_out, headers,
+		   connptr->client.major, connptr->client.minor);
+
+  if (connptr->keepalive)
+    headbuf_add(&connptr->head_out, "Connection: keep-alive\r\n", 24);
 
   /*
-   * All right, output all the remaining headers to the client.
+   * All right, add all the remaining headers and the final blank line,
+   * and send the head to the client. If a body follows, the kernel may
+   * hold back the last segment to fill it with the start of the body.
+   * A tunnel waits for the client to speak first.
    */
-  iter = hashmap_first(hashofheaders);
-  if (iter >= 0) {
-    for (; !hashmap_is_end(hashofheaders, iter); ++iter) {
-      hashmap_return_entry(hashofheaders, iter, &data, &header);
+  for (hdr = headers_first(headers); hdr; hdr = headers_next(headers, hdr))
+    headbuf_header(&connptr->head_out, hdr->name, hdr->namelen,
+		   hdr->value, hdr->valuelen);
+  headbuf_add(&connptr->head_out, "\r\n", 2);
+
+  ret = headbuf_flush(&connptr->head_out,
+		      connptr->method != METH_CONNECT
+		      && connptr->statuscode != 101 && !bodyless
+		      && connptr->server.content_length != 0);
+  return ret < 0 ? -1 : 0;
+}
 
-      ret =
-	  send_message(connptr->client_fd, "%s: %s\r\n", data, (char *) header);
-      if (ret < 0)
-	goto ERROR_EXIT;
-    }
+/*
+ * Account for "len" bytes of the response body, a chunked body ends with
+ * its last chunk. A server sending more than it announced can not be
+ * trusted with another request.
+ */
+static void count_received(struct conn_s *connptr, size_t len)
+{
+  if (connptr->chunked.state == CHUNK_DONE) {
+    connptr->server.content_length = 0;
+  } else if (connptr->chunked.state != CHUNK_NONE) {
+    /* the chunk parser decides */
+  } else if ((uint64_t) len <= connptr->server.content_length) {
+    connptr->server.content_length -= (uint64_t) len;
+  } else {
+    connptr->server.content_length = 0;
+    connptr->server_keepalive = FALSE;
   }
-  hashmap_delete(hashofheaders);
+}
 
-  /* Write the final blank line to signify the end of the headers */
-  if (safe_send(connptr->client_fd, "\r\n", 2) < 0)
-    return -1;
+/*
+ * Move the bytes read along with the headers to the relay buffers. The
+ * start of the response body goes to the client, what the client sent
+ * after its request to the server, unless it is the next request on a
+ * kept alive connection.
+ */
+static int relay_pending(struct conn_s *connptr)
+{
+  size_t len;
+  char *data;
+
+  if ((len = linebuf_pending(&connptr->server_lines)) > 0) {
+    data = linebuf_take(&connptr->server_lines, &len);
+    if (add_received(connptr->sbuffer, (unsigned char *) data, len,
+		     connptr) < 0)
+      return -1;
+    count_received(connptr, len);
+  }
+
+  if (!REQUEST_COMPLETE(connptr)
+      && (len = linebuf_pending(&connptr->client_lines)) > 0) {
+    data = linebuf_take(&connptr->client_lines, &len);
+    if (add_to_buffer(connptr->cbuffer, (unsigned char *) data, len) < 0)
+      return -1;
+  }
 
   return 0;
+}
 
-ERROR_EXIT:
-  hashmap_delete(hashofheaders);
+#define POLL_READABLE(p) \
+  (((p).events & POLLIN) && ((p).revents & (POLLIN | POLLHUP | POLLERR)))
+#define POLL_WRITABLE(p) \
+  (((p).events & POLLOUT) && ((p).revents & (POLLOUT | POLLHUP | POLLERR)))
+
+/*
+ * Write whatever is left in the buffer to the (nonblocking) socket. Gives
+ * up if the socket does not become writable within the idle timeout.
+ */
+static void flush_buffer(int fd, struct buffer_s *buffptr, uint64_t * processed)
+{
+  struct pollfd pfd;
+  ssize_t ret;
+
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+
+  while (buffer_size(buffptr) > 0) {
+    if ((ret = send_buffer(fd, buffptr)) < 0)
+      break;
+    if (ret == 0 && worker_poll(&pfd, 1, config.idletimeout * 1000) <= 0)
+      break;
+    *processed += (uint64_t) ret;
+  }
+}
+
+#ifdef HAVE_SPLICE
+/*
+ * Move up to "len" bytes from "in" to "out" inside the kernel. Returns
+ * the number of bytes moved, 0 if nothing can be moved right now and -1
+ * on EOF or error.
+ */
+static ssize_t splice_bytes(int in, int out, size_t len)
+{
+  ssize_t ret;
+
+  ret = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (ret > 0)
+    return ret;
+  if (ret == 0)
+    return -1;
+  if (errno == EAGAIN || errno == EINTR)
+    return 0;
+  if (errno != EPIPE && errno != ECONNRESET)
+    log_message(LOG_ERR, "splice_bytes: splice() error \"%s\" (%d -> %d)",
+		strerror(errno), in, out);
   return -1;
 }
 
+/*
+ * Send the buffer and then the "*len" bytes in "pipefd" to "fd", waiting
+ * at most the idle timeout for the socket to become writable. Returns -1
+ * if not everything went out.
+ */
+static int flush_pipe(int fd, struct buffer_s *buffptr, int pipefd,
+		      size_t *len, uint64_t * processed)
+{
+  struct pollfd pfd;
+  ssize_t ret;
+
+  flush_buffer(fd, buffptr, processed);
+  if (buffer_size(buffptr) > 0)
+    return -1;
+
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+
+  while (*len > 0) {
+    if ((ret = splice_bytes(pipefd, fd, *len)) < 0)
+      break;
+    if (ret == 0 && worker_poll(&pfd, 1, config.idletimeout * 1000) <= 0)
+      break;
+    *len -= (size_t) ret;
+    *processed += (uint64_t) ret;
+  }
+  return *len > 0 ? -1 : 0;
+}
+
+/*
+ * Create a nonblocking pipe able to hold MAXBUFFSIZE bytes if possible,
+ * returns the number of bytes it holds or -1.
+ */
+static ssize_t splice_pipe(int pipefd[2])
+{
+  ssize_t size = 16 * 4096;	/* the default on Linux */
+
+  if (pipe(pipefd) == -1)
+    return -1;
+
+  fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+  fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+  if (fcntl(pipefd[1], F_SETPIPE_SZ, (int) MAXBUFFSIZE) > 0)
+    size = fcntl(pipefd[1], F_GETPIPE_SZ);
+#endif
+
+  return min(size, (ssize_t) MAXBUFFSIZE);
+}
+
+/*
+ * The same as relay_connection(), but the data goes from one socket
+ * through a pipe to the other with splice() and never gets copied to
+ * user space. Whatever is still waiting in the buffers is sent first.
+ * Returns -1 if the pipes can not be created, nothing has happened to
+ * the connection then.
+ */
+static int splice_connection(struct conn_s *connptr)
+{
+  struct pollfd fds[2];
+  int s2c[2], c2s[2];		/* server to client, client to server */
+  size_t s2c_len = 0, c2s_len = 0;	/* bytes in the pipes */
+  ssize_t room, ret;
+  size_t len;
+  time_t last_access;
+
+  if ((room = splice_pipe(s2c)) < 0)
+    return -1;
+  if (splice_pipe(c2s) < 0) {
+    close(s2c[0]);
+    close(s2c[1]);
+    return -1;
+  }
+
+  last_access = time(NULL);
+
+  for (;;) {
+    long tdiff = (long) time(NULL) - (long) last_access;
+
+    if (tdiff >= (long) config.idletimeout) {
+      log_message(LOG_INFO,
+		  "Idle Timeout (after poll) as %li > %u.",
+		  tdiff, config.idletimeout);
+      goto CLOSE_PIPES;
+    }
+
+    fds[0].fd = connptr->client_fd;
+    fds[0].events = 0;
+    fds[1].fd = connptr->server_fd;
+    fds[1].events = 0;
+
+    if (buffer_size(connptr->sbuffer) > 0 || s2c_len > 0)
+      fds[0].events |= POLLOUT;
+    if (buffer_size(connptr->cbuffer) > 0 || c2s_len > 0)
+      fds[1].events |= POLLOUT;
+    if (s2c_len < (size_t) room)
+      fds[1].events |= POLLIN;
+    if (c2s_len < (size_t) room && !REQUEST_COMPLETE(connptr))
+      fds[0].events |= POLLIN;
+
+    if (!fds[0].events)
+      fds[0].fd = -1;
+    if (!fds[1].events)
+      fds[1].fd = -1;
+
+    ret = worker_poll(fds, 2, ((long) config.idletimeout - tdiff) * 1000);
+
+    if (ret == 0) {
+      continue;
+    } else if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      log_message(LOG_ERR,
+		  "splice_connection: poll() error \"%s\". Closing connection (client_fd:%d, server_fd:%d)",
+		  strerror(errno), connptr->client_fd, connptr->server_fd);
+      goto CLOSE_PIPES;
+    }
+
+    last_access = time(NULL);
+
+    if (POLL_READABLE(fds[1])) {
+      len = (size_t) room - s2c_len;
+      if (len > connptr->server.content_length)
+	len = (size_t) connptr->server.content_length;
+      if ((ret = splice_bytes(connptr->server_fd, s2c[1], len)) < 0)
+	break;
+      s2c_len += (size_t) ret;
+      connptr->server.content_length -= (uint64_t) ret;
+      if (connptr->server.content_length == 0)
+	break;
+    }
+    if (POLL_READABLE(fds[0])) {
+      if ((ret = splice_bytes(connptr->client_fd, c2s[1],
+			      (size_t) room - c2s_len)) < 0)
+	break;
+      c2s_len += (size_t) ret;
+    }
+    /* the buffered data has to go out before the data in the pipe */
+    if (POLL_WRITABLE(fds[1])) {
+      if (buffer_size(connptr->cbuffer) > 0)
+	ret = send_buffer(connptr->server_fd, connptr->cbuffer);
+      else if ((ret = splice_bytes(c2s[0], connptr->server_fd, c2s_len)) > 0)
+	c2s_len -= (size_t) ret;
+      if (ret < 0)
+	break;
+      connptr->server.processed += (uint64_t) ret;
+    }
+    if (POLL_WRITABLE(fds[0])) {
+      if (buffer_size(connptr->sbuffer) > 0)
+	ret = send_buffer(connptr->client_fd, connptr->sbuffer);
+      else if ((ret = splice_bytes(s2c[0], connptr->client_fd, s2c_len)) > 0)
+	s2c_len -= (size_t) ret;
+      if (ret < 0)
+	break;
+      connptr->client.processed += (uint64_t) ret;
+    }
+  }
+
+  /*
+   * Write the remainder to the client, then to the server. What is left
+   * in a pipe is lost, the connection can not be used again then.
+   */
+  if (flush_pipe(connptr->client_fd, connptr->sbuffer, s2c[0], &s2c_len,
+		 &connptr->client.processed) < 0)
+    connptr->keepalive = connptr->server_keepalive = FALSE;
+  socket_blocking(connptr->client_fd);
+  if (!connptr->keepalive)
+    shutdown(connptr->client_fd, SHUT_WR);
+
+  if (flush_pipe(connptr->server_fd, connptr->cbuffer, c2s[0], &c2s_len,
+		 &connptr->server.processed) < 0)
+    connptr->server_keepalive = FALSE;
+  socket_blocking(connptr->server_fd);
+
+CLOSE_PIPES:
+  if (s2c_len > 0)
+    connptr->keepalive = connptr->server_keepalive = FALSE;
+  if (c2s_len > 0)
+    connptr->server_keepalive = FALSE;
+  close(s2c[0]);
+  close(s2c[1]);
+  close(c2s[0]);
+  close(c2s[1]);
+  return 0;
+}
+#endif
+
 /*
  * Switch the sockets into nonblocking mode and begin relaying the bytes
  * between the two connections. We continue to use the buffering code
@@ -1288,16 +1636,27 @@ ERROR_EXIT:
  */
 static void relay_connection(struct conn_s *connptr)
 {
-  fd_set rset, wset;
-  struct timeval tv;
+  struct pollfd fds[2];
   time_t last_access;
   int ret;
-  int maxfd = max(connptr->client_fd, connptr->server_fd) + 1;
   ssize_t bytes_received;
 
   socket_nonblocking(connptr->client_fd);
   socket_nonblocking(connptr->server_fd);
 
+  /*
+   * FTP needs the copy, directory listings are formatted on the way,
+   * and so does a chunked body to find its end.
+   */
+  if (connptr->method != METH_FTP && connptr->chunked.state == CHUNK_NONE) {
+    if (uring_relay(connptr) == 0)
+      return;
+#ifdef HAVE_SPLICE
+    if (splice_connection(connptr) == 0)
+      return;
+#endif
+  }
+
   last_access = time(NULL);
 
 #ifdef FTP_SUPPORT
@@ -1310,33 +1669,41 @@ static void relay_connection(struct conn_s *connptr)
 
     if (tdiff >= (long) config.idletimeout) {
       log_message(LOG_INFO,
-		  "Idle Timeout (after select) as %li > %u.",
+		  "Idle Timeout (after poll) as %li > %u.",
 		  tdiff, config.idletimeout);
       return;
     }
 
-    FD_ZERO(&rset);
-    FD_ZERO(&wset);
-
-    tv.tv_sec = (long) config.idletimeout - tdiff;
-    tv.tv_usec = 0;
+    fds[0].fd = connptr->client_fd;
+    fds[0].events = 0;
+    fds[1].fd = connptr->server_fd;
+    fds[1].events = 0;
 
     if (buffer_size(connptr->sbuffer) > 0)
-      FD_SET(connptr->client_fd, &wset);
+      fds[0].events |= POLLOUT;
     if (buffer_size(connptr->cbuffer) > 0)
-      FD_SET(connptr->server_fd, &wset);
-    if (buffer_size(connptr->sbuffer) < MAXBUFFSIZE)
-      FD_SET(connptr->server_fd, &rset);
-    if (buffer_size(connptr->cbuffer) < MAXBUFFSIZE)
-      FD_SET(connptr->client_fd, &rset);
+      fds[1].events |= POLLOUT;
+    if (buffer_room(connptr->sbuffer) > 0)
+      fds[1].events |= POLLIN;
+    /* the next request of a kept alive client waits for its turn */
+    if (buffer_room(connptr->cbuffer) > 0 && !REQUEST_COMPLETE(connptr))
+      fds[0].events |= POLLIN;
 
-    ret = select(maxfd, &rset, &wset, NULL, &tv);
+    /* don't watch a descriptor we have nothing to do with */
+    if (!fds[0].events)
+      fds[0].fd = -1;
+    if (!fds[1].events)
+      fds[1].fd = -1;
+
+    ret = worker_poll(fds, 2, ((long) config.idletimeout - tdiff) * 1000);
 
     if (ret == 0) {
       continue;
     } else if (ret < 0) {
+      if (errno == EINTR)
+	continue;
       log_message(LOG_ERR,
-		  "relay_connection: select() error \"%s\". Closing connection (client_fd:%d, server_fd:%d)",
+		  "relay_connection: poll() error \"%s\". Closing connection (client_fd:%d, server_fd:%d)",
 		  strerror(errno), connptr->client_fd, connptr->server_fd);
       return;
     } else {
@@ -1346,13 +1713,13 @@ static void relay_connection(struct conn_s *connptr)
       last_access = time(NULL);
     }
 
-    if (FD_ISSET(connptr->server_fd, &rset)) {
+    if (POLL_READABLE(fds[1])) {
       bytes_received = recv_buffer(connptr->server_fd,
 				   connptr->sbuffer, connptr);
       if (bytes_received < 0)
 	break;
 
-      connptr->server.content_length -= (uint64_t) bytes_received;
+      count_received(connptr, (size_t) bytes_received);
       if (connptr->server.content_length == 0)
 	break;
     }
@@ -1360,14 +1727,14 @@ static void relay_connection(struct conn_s *connptr)
      * read request body from client, normally allready done by
      * pull_client_data()
      */
-    if (FD_ISSET(connptr->client_fd, &rset)
+    if (POLL_READABLE(fds[0])
 	&& recv_buffer(connptr->client_fd, connptr->cbuffer, connptr) < 0) {
       break;
     }
     /*
      * write the request body to the server
      */
-    if (FD_ISSET(connptr->server_fd, &wset)) {
+    if (POLL_WRITABLE(fds[1])) {
       if ((ret = send_buffer(connptr->server_fd, connptr->cbuffer)) < 0)
 	break;
       connptr->server.processed += (uint64_t) ret;
@@ -1375,7 +1742,7 @@ static void relay_connection(struct conn_s *connptr)
     /*
      * write response body to the client
      */
-    if (FD_ISSET(connptr->client_fd, &wset)) {
+    if (POLL_WRITABLE(fds[0])) {
       if ((ret = send_buffer(connptr->client_fd, connptr->sbuffer)) < 0)
 	break;
       connptr->client.processed += (uint64_t) ret;
@@ -1392,24 +1759,19 @@ static void relay_connection(struct conn_s *connptr)
 		  sizeof(FTP_FOOT) - 1);
 #endif
 
+  flush_buffer(connptr->client_fd, connptr->sbuffer,
+	       &connptr->client.processed);
   socket_blocking(connptr->client_fd);
-  while (buffer_size(connptr->sbuffer) > 0) {
-    if ((ret = send_buffer(connptr->client_fd, connptr->sbuffer)) < 0)
-      break;
-    connptr->client.processed += (uint64_t) ret;
-  }
 
-  shutdown(connptr->client_fd, SHUT_WR);
+  if (!connptr->keepalive)
+    shutdown(connptr->client_fd, SHUT_WR);
 
   /*
    * Try to send any remaining data to the server if we can.
    */
+  flush_buffer(connptr->server_fd, connptr->cbuffer,
+	       &connptr->server.processed);
   socket_blocking(connptr->server_fd);
-  while (buffer_size(connptr->cbuffer) > 0) {
-    if ((ret = send_buffer(connptr->server_fd, connptr->cbuffer)) < 0)
-      break;
-    connptr->server.processed += (uint64_t) ret;
-  }
 #ifdef FTP_SUPPORT
   /*
    * Try to close the FTP session gracefully.
@@ -1434,6 +1796,28 @@ static void relay_connection(struct conn_s *connptr)
   return;
 }
 
+/*
+ * opensock() did not even try "what", because its connects failed
+ * lately. The error page goes out at once: 504 if they timed out, 502
+ * otherwise.
+ */
+static void indicate_server_down(struct conn_s *connptr, int fd,
+				 const char *what, char *errbuf)
+{
+  char detail[256];
+
+  snprintf(detail, sizeof(detail),
+	   PACKAGE " did not try to connect to the %s, since the last "
+	   "attempts failed. It will try again in a while.", what);
+  if (fd == SOCK_EDOWN_TIMEOUT)
+    indicate_http_error(connptr, 504, "Gateway Timeout",
+			"detail", detail, "error", errbuf, NULL);
+  else
+    indicate_http_error(connptr, 502, "Bad Gateway",
+			"detail", detail, "error", errbuf, NULL);
+  connptr->server_fd = -1;
+}
+
 /*
  * Establish a connection to the upstream proxy server.
  */
@@ -1459,10 +1843,20 @@ connect_to_upstream(struct conn_s *connptr, request_t *request)
     return -1;
   }
 
-  connptr->server_fd =
-      opensock(cur_upstream->host, cur_upstream->port, errbuf, sizeof(errbuf));
-
-  if (connptr->server_fd < 0) {
+  /* tunnels and FTP transfers use their connection up */
+  if (connptr->method == METH_HTTP) {
+    connptr->server_fd = pool_open(cur_upstream->host, cur_upstream->port,
+				   cur_upstream, errbuf, sizeof(errbuf));
+    connptr->server_keepalive = config.connectionpool > 0;
+  } else
+    connptr->server_fd = opensock(cur_upstream->host, cur_upstream->port,
+				  errbuf, sizeof(errbuf));
+
+  if (connptr->server_fd <= SOCK_EDOWN) {
+    indicate_server_down(connptr, connptr->server_fd, "upstream proxy",
+			 errbuf);
+    return -1;
+  } else if (connptr->server_fd < 0) {
     log_message(LOG_WARNING, "Could not connect to upstream proxy.");
     indicate_http_error(connptr, 404, "Unable to connect to upstream proxy",
 			"detail",
@@ -1483,7 +1877,7 @@ connect_to_upstream(struct conn_s *connptr, request_t *request)
   if (connptr->method == METH_CONNECT) {
     len = strlen(request->host) + 7;
 
-    combined_string = malloc(len);
+    combined_string = request_alloc(request, len);
     if (!combined_string) {
       return -1;
     }
@@ -1491,7 +1885,7 @@ connect_to_upstream(struct conn_s *connptr, request_t *request)
     snprintf(combined_string, len, "%s:%d", request->host, request->port);
   } else {
     len = strlen(request->host) + strlen(request->path) + 14;
-    combined_string = malloc(len);
+    combined_string = request_alloc(request, len);
     if (!combined_string) {
       return -1;
     }
@@ -1503,8 +1897,6 @@ connect_to_upstream(struct conn_s *connptr, request_t *request)
 
   log_message(LOG_CONN, "request_path: %s %s", request->path, combined_string);
 
-  if (request->path)
-    free(request->path);
   request->path = combined_string;
 
   return establish_http_connection(connptr, request);
@@ -1512,52 +1904,96 @@ connect_to_upstream(struct conn_s *connptr, request_t *request)
 }
 
 /*
- * This is the main drive for each connection. As you can tell, for the
- * first few steps we are using a blocking socket. If you remember the
- * older tinyproxy-ex code, this use to be a very confusing state machine.
- * Well, no more! :) The sockets are only switched into nonblocking mode
- * when we start the relay portion. This makes most of the original
- * tinyproxy-ex code, which was confusing, redundant. Hail progress.
- * 	- rjkaes
+ * Write the access log line of a finished request which started at
+ * "start". Also used by the relay daemon for the connections it took
+ * over.
  */
-void handle_connection(int fd)
+void log_access(struct conn_s *connptr, const struct timeval *start)
 {
-  struct timeval tv_s, tv_e;
-  struct conn_s *connptr;
-  request_t *request = NULL;
-  hashmap_t hashofheaders = NULL;
-
-  char peer_ipaddr[PEER_IP_LENGTH];
-  char peer_string[PEER_STRING_LENGTH];
-  char errbuf[4096];
+  struct timeval tv_e;
   char *tmp;
 
-  gettimeofday(&tv_s, NULL);
-
-  getpeer_information(fd, peer_ipaddr, peer_string);
-
-  log_message(LOG_CONN, "Connect (file descriptor %d): %s [%s]",
-	      fd, peer_string, peer_ipaddr);
+  gettimeofday(&tv_e, NULL);
 
-  connptr = initialize_conn(fd, peer_ipaddr, peer_string);
-  if (!connptr) {
-    close(fd);
-    return;
+  tv_e.tv_sec -= start->tv_sec;
+  tv_e.tv_usec -= start->tv_usec;
+  if (tv_e.tv_usec < 0) {
+    tv_e.tv_usec += 1000000;
+    tv_e.tv_sec--;
   }
+  tv_e.tv_usec /= 1000;
 
-  /*
-   * If the client closes the connection before we can read any data, it
-   * doesn't make much sense to send a error page. :-)
-   */
-  if (read_request_line(connptr) < 0) {
-    update_stats(STAT_BADCONN);
-    goto COMMON_EXIT;
+  /* 
+   * strip the arguments from the request line, to preserve
+   * privacy.
+   *
+   * Assume that 'connptr->request_line' ends with HTTP/X.X
+   * and copy everything found after ' HTTP/' to the position
+   * of the former arguments.
+   **/
+  if (connptr->request_line && (tmp = strchr(connptr->request_line, '?'))) {
+    char *proto = strrchr(tmp, '/');
+    if (proto && proto > tmp + 6 && strncmp(proto - 5, " HTTP/", 6) == 0)	/* paranoia */
+      strcpy(tmp + 1, proto - 5);
+    else
+      *++tmp = '\0';
   }
 
+  /* sort of apache/squid style logline */
+  log_message(LOG_NOTICE, "%s %s %d/%d [%llu:%llu] %d.%03d",
+	      connptr->client_ip_addr,
+	      connptr->request_line,
+	      connptr->error_number != -1 ? connptr->error_number : 200,
+	      connptr->statuscode,
+	      connptr->server.processed, connptr->client.processed,
+	      tv_e.tv_sec, tv_e.tv_usec);
+}
+
+/*
+ * Wait up to KeepAliveTimeout seconds for the next request on a kept
+ * alive client connection. Returns FALSE if the client closed the
+ * connection or did not send anything in time.
+ */
+static int wait_next_request(struct conn_s *connptr)
+{
+  int fd = connptr->client_fd;
+  struct pollfd pfd;
+  char c;
+  int ret;
+
+  /* a pipelined request may be read already */
+  if (linebuf_pending(&connptr->client_lines) > 0)
+    return TRUE;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  do {
+    ret = worker_poll(&pfd, 1, config.keepalivetimeout * 1000);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret > 0 && recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 1;
+}
+
+/*
+ * Serve a single request of the client. Returns 0 if the response went
+ * out completely, connptr->keepalive then tells whether the client may
+ * send another request on the connection.
+ */
+static int handle_request(struct conn_s *connptr)
+{
+  struct timeval tv_s;
+  request_t *request = NULL;
+  headers_t headers = NULL;
+  char errbuf[4096];
+  int ret = -1;
+
+  gettimeofday(&tv_s, NULL);
+
   /*
-   * The "hashofheaders" store the client's headers.
+   * The "headers" store the client's headers.
    */
-  if (!(hashofheaders = hashmap_create(HEADER_BUCKETS))) {
+  if (!(headers = headers_create(&connptr->arena))) {
     update_stats(STAT_BADCONN);
     indicate_http_error(connptr, 503, "Internal error",
 			"detail",
@@ -1568,16 +2004,17 @@ void handle_connection(int fd)
   }
 
   /*
-   * Get all the headers from the client in a big hash.
+   * If the client closes the connection before we can read any data, it
+   * doesn't make much sense to send a error page. :-)
    */
-  if (get_all_headers(connptr->client_fd, hashofheaders) < 0) {
-    log_message(LOG_WARNING,
-		"Could not retrieve all the headers from the client");
+  if (read_request_head(connptr, headers) < 0) {
     update_stats(STAT_BADCONN);
     goto COMMON_EXIT;
   }
 
-  request = process_request(connptr, hashofheaders);
+  request = process_request(connptr, headers);
+  connptr->keepalive = connptr->keepalive
+      && client_keepalive(connptr, headers);
   if (!request) {
     if (!connptr->error_variables && !connptr->show_stats) {
       update_stats(STAT_BADCONN);
@@ -1588,7 +2025,7 @@ void handle_connection(int fd)
 
   if (connptr->local_request) {
     serve_local_file(connptr, request->path);
-    free_request_struct(request);
+    ret = 0;
     goto COMMON_EXIT;
   }
 
@@ -1610,9 +2047,18 @@ void handle_connection(int fd)
 #endif
   } else {
 
-    connptr->server_fd =
-	opensock(request->host, request->port, errbuf, sizeof(errbuf));
-    if (connptr->server_fd < 0) {
+    if (connptr->method == METH_HTTP) {
+      connptr->server_fd = pool_open(request->host, request->port, NULL,
+				     errbuf, sizeof(errbuf));
+      connptr->server_keepalive = config.connectionpool > 0;
+    } else
+      connptr->server_fd =
+	  opensock(request->host, request->port, errbuf, sizeof(errbuf));
+    if (connptr->server_fd <= SOCK_EDOWN) {
+      indicate_server_down(connptr, connptr->server_fd, "web server",
+			   errbuf);
+      goto send_error;
+    } else if (connptr->server_fd < 0) {
       indicate_http_error(connptr, 500, "Unable to connect",
 			  "detail",
 			  PACKAGE
@@ -1629,12 +2075,11 @@ void handle_connection(int fd)
       establish_http_connection(connptr, request);
   }
 
-  proctitle("%s -> %s", peer_ipaddr, request->host);
+  proctitle("%s -> %s", connptr->client_ip_addr, request->host);
 
 send_error:
-  free_request_struct(request);
 
-  if (process_client_headers(connptr, hashofheaders) < 0) {
+  if (process_client_headers(connptr, headers) < 0) {
     update_stats(STAT_BADCONN);
     if (!connptr->error_variables)
       goto COMMON_EXIT;
@@ -1644,12 +2089,10 @@ send_error:
     send_http_error_message(connptr);
     goto COMMON_EXIT;
   } else if (connptr->show_stats) {
-    showstats(connptr);
+    ret = showstats(connptr);
     goto COMMON_EXIT;
   }
 
-  disable_tcp_cork(connptr->server_fd);
-  
   if (connptr->method == METH_HTTP || (connptr->upstream_proxy != NULL)) {
     if (process_server_headers(connptr) < 0) {
       if (connptr->error_variables)
@@ -1679,7 +2122,25 @@ send_error:
     }
   }
 
-  relay_connection(connptr);
+  if (relay_pending(connptr) < 0)
+    goto COMMON_EXIT;
+
+  /* the relay daemon logs the request when it is done */
+  if (relay_offload(connptr, &tv_s) == 0)
+    goto OFFLOADED;
+
+  /* a short or empty body may be complete with the headers */
+  if (!REQUEST_COMPLETE(connptr) || connptr->server.content_length != 0)
+    relay_connection(connptr);
+  else
+    flush_buffer(connptr->client_fd, connptr->sbuffer,
+		 &connptr->client.processed);
+
+  /* the relay may have ended before the response did */
+  if (connptr->server.content_length == 0
+      && buffer_size(connptr->sbuffer) == 0
+      && buffer_size(connptr->cbuffer) == 0)
+    ret = 0;
 
   log_message(LOG_CONN,
 	      "Closed connection between local client (fd:%d) and remote client (fd:%d)",
@@ -1689,52 +2150,66 @@ send_error:
    * All done... close everything and go home... :)
    */
 COMMON_EXIT:
+  /* the server connection is only reused after a complete response */
+  if (ret < 0)
+    connptr->server_keepalive = FALSE;
 
   /* 
    * do not fill the logs with requests to local files, i.e. FTP
    * directory listings and such
    */
-  if (!connptr->local_request) {
+  if (!connptr->local_request)
+    log_access(connptr, &tv_s);
 
-    gettimeofday(&tv_e, NULL);
+OFFLOADED:
+  return ret;
+}
 
-    tv_e.tv_sec -= tv_s.tv_sec;
-    tv_e.tv_usec -= tv_s.tv_usec;
-    if (tv_e.tv_usec < 0) {
-      tv_e.tv_usec += 1000000;
-      tv_e.tv_sec--;
-    }
-    tv_e.tv_usec /= 1000;
+/*
+ * This is the main drive for each connection. As you can tell, for the
+ * first few steps we are using a blocking socket. If you remember the
+ * older tinyproxy-ex code, this use to be a very confusing state machine.
+ * Well, no more! :) The sockets are only switched into nonblocking mode
+ * when we start the relay portion. This makes most of the original
+ * tinyproxy-ex code, which was confusing, redundant. Hail progress.
+ * 	- rjkaes
+ *
+ * With KeepAliveTimeout the client connection is served request after
+ * request, as long as the responses allow it.
+ */
+void handle_connection(int fd)
+{
+  struct conn_s *connptr;
+  int requests;
 
-    /* 
-     * strip the arguments from the request line, to preserve
-     * privacy.
-     *
-     * Assume that 'connptr->request_line' ends with HTTP/X.X
-     * and copy everything found after ' HTTP/' to the position
-     * of the former arguments.
-     **/
-    if (connptr->request_line && (tmp = strchr(connptr->request_line, '?'))) {
-      char *proto = strrchr(tmp, '/');
-      if (proto && proto > tmp + 6 && strncmp(proto - 5, " HTTP/", 6) == 0)	/* paranoia */
-	strcpy(tmp + 1, proto - 5);
-      else
-	*++tmp = '\0';
-    }
+  char peer_ipaddr[PEER_IP_LENGTH];
+  char peer_string[PEER_STRING_LENGTH];
 
-    /* sort of apache/squid style logline */
-    log_message(LOG_NOTICE, "%s %s %d/%d [%llu:%llu] %d.%03d",
-		peer_ipaddr,
-		connptr->request_line,
-		connptr->error_number != -1 ? connptr->error_number : 200,
-		connptr->statuscode,
-		connptr->server.processed, connptr->client.processed,
-		tv_e.tv_sec, tv_e.tv_usec);
+  getpeer_information(fd, peer_ipaddr, peer_string);
 
+  log_message(LOG_CONN, "Connect (file descriptor %d): %s [%s]",
+	      fd, peer_string, peer_ipaddr);
+
+  connptr = initialize_conn(fd, peer_ipaddr, peer_string);
+  if (!connptr) {
+    close(fd);
+    return;
   }
 
-  if (hashofheaders)
-    hashmap_delete(hashofheaders);
+  for (requests = 1;; requests++) {
+    connptr->keepalive = config.keepalivetimeout > 0
+	&& (config.maxkeepaliverequests <= 0
+	    || requests < config.maxkeepaliverequests);
+
+    if (handle_request(connptr) < 0 || !connptr->keepalive)
+      break;
+
+    reset_conn(connptr);
+    if (!wait_next_request(connptr))
+      break;
+
+    update_stats(STAT_REUSED);
+  }
 
   destroy_conn(connptr);
   return;
@@ -23,7 +23,8 @@
 #include <stdint.h>
 
 /*
- * This structure holds the information pulled from a URL request.
+ * This structure holds the information pulled from a URL request. The
+ * strings are allocated along with it, see new_request().
  */
 typedef struct {
   char *method;
@@ -33,9 +34,15 @@ typedef struct {
   char *url;
   uint16_t port;
   uint16_t pad0;
+
+  size_t used, size;
+  char strings[];
 } request_t;
 
+struct conn_s;
+
 extern void handle_connection(int fd);
+extern void log_access(struct conn_s *connptr, const struct timeval *start);
 extern void add_connect_port_allowed(int port);
 extern void upstream_add(const char *host, int port, const char *domain,
 			 const char *authentication);
@@ -0,0 +1,302 @@
+/* $Id$
+ *
+ * The scanning done on every message head: splitting it into lines and
+ * finding the colon of each header, the empty line which ends the head,
+ * the tokens of a list like "Connection: close, TE", and the
+ * case-insensitive hash of a header name.
+ *
+ * On x86 the search for the end of the head and for the end of a token
+ * look at 16 bytes at a time with SSE2, or 32 with AVX2 if the processor
+ * has it, which is found out on the first call. Elsewhere they go byte by
+ * byte. Lines are split with memchr(), which the C library already does
+ * with vector instructions, and a loop of our own over bit masks was not
+ * faster for the short lines of a head. The hash folds and mixes eight
+ * bytes at a time in a plain 64 bit word, header names are too short for
+ * more.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include "scan.h"
+
+#if defined(__GNUC__) && defined(__SSE2__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#  define SCAN_X86
+#  include <immintrin.h>
+#endif
+
+/*
+ * The characters allowed in a token (RFC 7230, section 3.2.6), set up on
+ * the first call along with the implementation.
+ */
+static unsigned char tchar[256];
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * A '\n' at "i" ends an empty line if the line before ended right in
+ * front of it, with or without a '\r'.
+ */
+#define EMPTY_LINE(p, i) \
+  ((i) > 0 && ((p)[(i) - 1] == '\n' \
+	       || ((i) > 1 && (p)[(i) - 1] == '\r' && (p)[(i) - 2] == '\n')))
+
+static size_t head_end_scalar(const char *p, size_t from, size_t len)
+{
+  const char *nl;
+
+  while (from < len && (nl = memchr(p + from, '\n', len - from))) {
+    from = (size_t) (nl - p);
+    if (EMPTY_LINE(p, from))
+      return from + 1;
+    from++;
+  }
+  return 0;
+}
+
+/*
+ * The length of the run of letters, digits and '-' at "p", which is what
+ * header names and most tokens consist of.
+ */
+#define COMMON(c) \
+  (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') \
+   || ((c) >= '0' && (c) <= '9') || (c) == '-')
+
+static size_t common_scalar(const char *p, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len && COMMON(p[i]); i++);
+  return i;
+}
+
+#ifdef SCAN_X86
+
+/*
+ * Four blocks at a time, most of them have no line end at all.
+ */
+static size_t head_end_sse2(const char *p, size_t from, size_t len)
+{
+  const __m128i lf = _mm_set1_epi8('\n');
+
+  for (; from + 64 <= len; from += 64) {
+    const __m128i *v = (const __m128i *) (p + from);
+    uint64_t n = (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v), lf))
+	| (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v + 1), lf)) << 16
+	| (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v + 2), lf)) << 32
+	| (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v + 3), lf)) << 48;
+
+    for (; n; n &= n - 1) {
+      size_t i = from + (size_t) __builtin_ctzll(n);
+
+      if (EMPTY_LINE(p, i))
+	return i + 1;
+    }
+  }
+  return head_end_scalar(p, from, len);
+}
+
+/*
+ * The bytes in [lo, hi]. Bytes from 0x80 up are negative, so they are in
+ * none of the ranges used here.
+ */
+#define RANGE128(v, lo, hi) \
+  _mm_and_si128(_mm_cmpgt_epi8((v), _mm_set1_epi8((lo) - 1)), \
+		_mm_cmplt_epi8((v), _mm_set1_epi8((hi) + 1)))
+
+static size_t common_sse2(const char *p, size_t len)
+{
+  size_t i;
+
+  for (i = 0; len - i >= 16; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i dash = _mm_cmpeq_epi8(v, _mm_set1_epi8('-'));
+    __m128i ok = _mm_or_si128(RANGE128(lower, 'a', 'z'),
+			      _mm_or_si128(RANGE128(v, '0', '9'), dash));
+    unsigned int m = (unsigned int) _mm_movemask_epi8(ok);
+
+    if (m != 0xffff)
+      return i + (size_t) __builtin_ctz(~m);
+  }
+  return i + common_scalar(p + i, len - i);
+}
+
+__attribute__ ((target("avx2")))
+static size_t head_end_avx2(const char *p, size_t from, size_t len)
+{
+  const __m256i lf = _mm256_set1_epi8('\n');
+
+  for (; from + 64 <= len; from += 64) {
+    const __m256i *v = (const __m256i *) (p + from);
+    uint64_t n = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(v), lf))
+	| (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(v + 1), lf)) << 32;
+
+    for (; n; n &= n - 1) {
+      size_t i = from + (size_t) __builtin_ctzll(n);
+
+      if (EMPTY_LINE(p, i))
+	return i + 1;
+    }
+  }
+  return head_end_scalar(p, from, len);
+}
+
+#define RANGE256(v, lo, hi) \
+  _mm256_and_si256(_mm256_cmpgt_epi8((v), _mm256_set1_epi8((lo) - 1)), \
+		   _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), (v)))
+
+__attribute__ ((target("avx2")))
+static size_t common_avx2(const char *p, size_t len)
+{
+  size_t i;
+
+  for (i = 0; len - i >= 32; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i dash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-'));
+    __m256i ok = _mm256_or_si256(RANGE256(lower, 'a', 'z'),
+				 _mm256_or_si256(RANGE256(v, '0', '9'), dash));
+    unsigned int m = (unsigned int) _mm256_movemask_epi8(ok);
+
+    if (m != 0xffffffffU)
+      return i + (size_t) __builtin_ctz(~m);
+  }
+  return i + common_sse2(p + i, len - i);
+}
+
+#endif				/* SCAN_X86 */
+
+/* ------------------------------------------------------------------ */
+
+static struct {
+  const char *name;
+  size_t (*head_end) (const char *p, size_t from, size_t len);
+  size_t (*common) (const char *p, size_t len);
+} impl;
+
+static void scan_setup(void)
+{
+  static const char specials[] = "!#$%&'*+-.^_`|~";
+  const char *s;
+  int c;
+
+  for (c = 0; c < 256; c++)
+    tchar[c] = COMMON(c);
+  for (s = specials; *s; s++)
+    tchar[(unsigned char) *s] = 1;
+
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    impl.name = "avx2";
+    impl.head_end = head_end_avx2;
+    impl.common = common_avx2;
+  } else {
+    impl.name = "sse2";
+    impl.head_end = head_end_sse2;
+    impl.common = common_sse2;
+  }
+#else
+  impl.name = "scalar";
+  impl.head_end = head_end_scalar;
+  impl.common = common_scalar;
+#endif
+}
+
+#define SETUP() do { if (!impl.name) scan_setup(); } while (0)
+
+/*
+ * The name of the implementation in use.
+ */
+const char *scan_level(void)
+{
+  SETUP();
+  return impl.name;
+}
+
+/*
+ * Call "cb" for every line from "p" to "end" with the start of the line,
+ * its first ':' (NULL if there is none) and its '\n'. Stops when "cb"
+ * returns something else than 0 and returns that, 0 after the last
+ * complete line.
+ */
+int scan_lines(char *p, char *end, scan_line_t cb, void *arg)
+{
+  char *nl;
+  int ret;
+
+  for (; p < end && (nl = memchr(p, '\n', (size_t) (end - p))); p = nl + 1)
+    if ((ret = cb(arg, p, memchr(p, ':', (size_t) (nl - p)), nl)))
+      return ret;
+  return 0;
+}
+
+/*
+ * The length of the head at "p" up to and including the empty line which
+ * ends it, 0 if the "len" bytes do not contain it yet. The head must not
+ * start with an empty line. The bytes before "from" are known not to end
+ * the head, so the search starts there.
+ */
+size_t scan_head_end(const char *p, size_t from, size_t len)
+{
+  SETUP();
+  return impl.head_end(p, from, len);
+}
+
+/*
+ * The length of the token at "p", 0 if it starts with a delimiter.
+ */
+size_t scan_token(const char *p, size_t len)
+{
+  size_t i = 0;
+
+  SETUP();
+  for (;;) {
+    i += impl.common(p + i, len - i);
+    if (i == len || !tchar[(unsigned char) p[i]])
+      return i;
+    i++;
+  }
+}
+
+/*
+ * A hash of the name with upper case letters folded to lower case. Each
+ * word gets the bytes from 'A' to 'Z' marked in their top bit, which is
+ * then shifted down onto the 0x20 bit.
+ */
+uint32_t scan_hash(const char *p, size_t len)
+{
+  const uint64_t ones = UINT64_C(0x0101010101010101);
+  const uint64_t high = UINT64_C(0x8080808080808080);
+  uint64_t hash = len * UINT64_C(0x9e3779b97f4a7c15), w, ascii, ge, gt;
+  size_t n, i;
+
+  for (; len; p += n, len -= n) {
+    n = len < 8 ? len : 8;
+    if (n == 8)
+      memcpy(&w, p, 8);
+    else
+      for (w = 0, i = n; i--;)
+	w = (w << 8) | (unsigned char) p[i];
+
+    ascii = w & ~high;
+    ge = ascii + ones * (0x80 - 'A');
+    gt = ascii + ones * (0x80 - 'Z' - 1);
+    w |= ((ge & ~gt & ~w & high) >> 2);
+
+    hash = (hash ^ w) * UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 32;
+  }
+  return (uint32_t) (hash ^ (hash >> 29));
+}
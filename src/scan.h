@@ -0,0 +1,27 @@
+/* $Id$
+ *
+ * See 'scan.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_SCAN_H
+#define TINYPROXY_SCAN_H
+
+typedef int (*scan_line_t) (void *arg, char *line, char *colon, char *nl);
+
+extern int scan_lines(char *p, char *end, scan_line_t cb, void *arg);
+extern size_t scan_head_end(const char *p, size_t from, size_t len);
+extern size_t scan_token(const char *p, size_t len);
+extern uint32_t scan_hash(const char *p, size_t len);
+extern const char *scan_level(void);
+
+#endif
@@ -21,17 +21,36 @@
  * General Public License for more details.
  */
 
+#define _GNU_SOURCE /* accept4, sched_setaffinity */
 #include "tinyproxy-ex.h"
 
+#include <limits.h>
+#include <sched.h>
+#include <netinet/tcp.h>		/* TCP_INFO */
+
+#ifdef HAVE_SYS_EPOLL_H
+#  include <sys/epoll.h>
+#  ifndef EPOLLEXCLUSIVE
+#    define EPOLLEXCLUSIVE (1u << 28)
+#  endif
+#endif
+
+#include "dns.h"
+#include "health.h"
+#include "heap.h"
 #include "log.h"
 
 #include "sock.h"
+#include "stats.h"
 #include "text.h"
+#include "utils.h"
+#include "worker.h"
 
 struct sock_s {
   int fd;
   struct sockaddr_in addr;
   socklen_t len;
+  int *shards;			/* one socket per shard (ListenSharding) */
 };
 
 /* GT:
@@ -42,9 +61,14 @@ static struct listener_s {
   int total;			/* number of sock_s entries used        */
   int allocated;		/* number of sock_s entries allocated   */
   int maxfd;
+  int nshards;			/* number of SO_REUSEPORT shards or 0   */
+  int shard;			/* shard used by this process or -1     */
+  unsigned long *accepts;	/* accepted connections per shard       */
+  int channel;			/* connections are passed in here or -1 */
   struct sock_s *sock;
 } listeners = {
-.total = 0,.allocated = 0,.maxfd = -1,.sock = NULL};
+.total = 0,.allocated = 0,.maxfd = -1,.nshards = 0,.shard = -1,
+.accepts = NULL,.channel = -1,.sock = NULL};
 
 /*
  * Add and initialize a listener, update maxfd, total, etc.pp
@@ -80,57 +104,15 @@ int listeners_total()
   return listeners.total;
 }
 
-static int do_connect(int sock_fd, struct addrinfo *rp, char *errbuf, size_t errbuflen)
+static const char* addrstr(char *dst, int len, union dns_sockaddr_u *addr)
 {
-  int ret = -1;
-  socket_nonblocking(sock_fd);
-  do {
-    if (0 == (ret = connect(sock_fd, (struct sockaddr *) rp->ai_addr, rp->ai_addrlen))) {
-      /* success */
-    } else if (EINTR == errno) {
-      continue;
-    } else if (EINPROGRESS != errno) {
-      snprintf(errbuf, errbuflen, "socket() error \"%s\".", strerror(errno));
-    } else {
-      struct timeval tv;
-      fd_set fds;
-
-      FD_ZERO(&fds);
-      FD_SET(sock_fd, &fds);
-      tv.tv_sec = config.connecttimeout;
-      tv.tv_usec = 0;
-
-      switch ((ret = select(sock_fd + 1, NULL, &fds, NULL, &tv))) {
-      case -1:
-	snprintf(errbuf, errbuflen, "socket() error \"%s\".", strerror(errno));
-	break;
-      case 0:
-	snprintf(errbuf, errbuflen, "connection timeout.");
-	break;
-      default:
-	ret = 0;
-      }
-    }
-    break;
-  } while(1);
-  socket_blocking(sock_fd);
-  return ret;
-}
-
-static const char* addrstr(char *dst, int len, struct addrinfo *rp)
-{
-  union {
-    struct sockaddr_in *in;
-    struct sockaddr_in6 *in6;
-    struct sockaddr *a;
-  } ptr = { .a = rp->ai_addr };
   const char *ret = NULL;
 
   memset(dst, 0, len);
-  if (rp->ai_family == AF_INET6) {
-    ret = inet_ntop(rp->ai_family, &ptr.in6->sin6_addr, dst, INET6_ADDRSTRLEN);
+  if (addr->sa.sa_family == AF_INET6) {
+    ret = inet_ntop(AF_INET6, &addr->in6.sin6_addr, dst, INET6_ADDRSTRLEN);
   } else {
-    ret = inet_ntop(rp->ai_family, &ptr.in->sin_addr, dst, INET6_ADDRSTRLEN);
+    ret = inet_ntop(AF_INET, &addr->in.sin_addr, dst, INET6_ADDRSTRLEN);
   }
   /* Work around a bug in dietlibc on 64bit systems */
   return ret ? dst : NULL;
@@ -138,6 +120,204 @@ static const char* addrstr(char *dst, int len, struct addrinfo *rp)
 
 
 
+/*
+ * Set the order in which the addresses of a name are tried, returns -1
+ * if "order" is none of the known ones.
+ */
+int set_connect_order(const char *order)
+{
+  if (!strcasecmp(order, "ipv6"))
+    config.connectorder = CONNECT_ORDER_IPV6;
+  else if (!strcasecmp(order, "ipv4"))
+    config.connectorder = CONNECT_ORDER_IPV4;
+  else if (!strcasecmp(order, "resolver"))
+    config.connectorder = CONNECT_ORDER_RESOLVER;
+  else
+    return -1;
+  return 0;
+}
+
+/*
+ * Let the address families take turns (RFC 8305, section 4), so a family
+ * which does not work costs one ConnectAttemptDelay, not one attempt per
+ * address. Unless ConnectOrder says otherwise, the family the resolver
+ * put first starts, which is IPv6 if there is a route for it.
+ */
+static void order_addrs(struct dns_result_s *addrs)
+{
+  union dns_sockaddr_u family[2][DNS_MAX_ADDRS];
+  int n[2] = { 0, 0 }, k[2] = { 0, 0 }, i, f;
+
+  if (config.connectorder == CONNECT_ORDER_RESOLVER || addrs->count < 2)
+    return;
+
+  for (i = 0; i < addrs->count; i++) {
+    f = addrs->addr[i].sa.sa_family == AF_INET6;
+    family[f][n[f]++] = addrs->addr[i];
+  }
+  if (config.connectorder == CONNECT_ORDER_IPV6)
+    f = 1;
+  else if (config.connectorder == CONNECT_ORDER_IPV4)
+    f = 0;
+  else
+    f = addrs->addr[0].sa.sa_family == AF_INET6;
+
+  for (i = 0; i < addrs->count; f = !f) {
+    if (k[f] < n[f])
+      addrs->addr[i++] = family[f][k[f]++];
+  }
+}
+
+/*
+ * Start connecting to "addr" of "host". Returns the socket, with "*done"
+ * set if the connection is established already, or -1 with the reason in
+ * "errbuf".
+ */
+static int start_connect(const char *host, union dns_sockaddr_u *addr,
+			 int *done, char *errbuf, size_t errbuflen)
+{
+  int fd, ret;
+
+  if ((fd = socket(addr->sa.sa_family, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+    snprintf(errbuf, errbuflen, "can't create socket: \"%s\".", strerror(errno));
+    return -1;
+  }
+  socket_nonblocking(fd);
+  while ((ret = connect(fd, &addr->sa, DNS_ADDRLEN(addr))) < 0
+	 && errno == EINTR);
+  *done = ret == 0;
+  if (ret < 0 && errno != EINPROGRESS) {
+    snprintf(errbuf, errbuflen, "connect() error \"%s\".", strerror(errno));
+    close(fd);
+    health_report(addr, host, HEALTH_FAILED);
+    return -1;
+  }
+  if (*done)
+    health_report(addr, host, HEALTH_CONNECTED);
+  return fd;
+}
+
+/*
+ * Connect to one of the addresses the way RFC 8305 ("Happy Eyeballs")
+ * does. The next address is tried once the attempts before it had
+ * ConnectAttemptDelay milliseconds, or right away if they failed, while
+ * those keep going. The first connection established wins, the others
+ * are closed. Each attempt gets up to ConnectTimeout seconds. The index
+ * of the winning address goes to "*winner".
+ *
+ * Addresses the circuit breaker took out (see 'health.c') are skipped.
+ * If that leaves none to try, SOCK_EDOWN or SOCK_EDOWN_TIMEOUT is
+ * returned right away.
+ */
+static int connect_race(const char *host, struct dns_result_s *addrs,
+			int *winner, char *errbuf, size_t errbuflen)
+{
+  struct pollfd pfd[DNS_MAX_ADDRS];
+  int which[DNS_MAX_ADDRS];
+  long deadline[DNS_MAX_ADDRS], now, next_start = 0, timeout;
+  char ipbuf[INET6_ADDRSTRLEN];
+  int active = 0, next = 0, tried = 0, down = HEALTH_UP, fd = -1;
+  int done, s, i, err;
+  socklen_t len;
+
+  while (fd < 0 && (next < addrs->count || active > 0)) {
+    now = monotonic_ms();
+
+    /* the next attempt, if it is time or nothing else is going on */
+    if (next < addrs->count && (active == 0 || now >= next_start)) {
+      addrstr(ipbuf, sizeof(ipbuf), &addrs->addr[next]);
+      if ((s = health_check(&addrs->addr[next])) >= HEALTH_DOWN) {
+	snprintf(errbuf, errbuflen, "%s is down, the last connects failed.",
+		 ipbuf);
+	down = s;
+	next++;
+	continue;
+      }
+      tried++;
+      if ((s = start_connect(host, &addrs->addr[next], &done, errbuf,
+			     errbuflen)) < 0) {
+	log_message(LOG_ERR, "opensock: %s; %s", ipbuf, errbuf);
+	next_start = now;
+      } else if (done) {
+	fd = s;
+	*winner = next;
+      } else {
+	pfd[active].fd = s;
+	pfd[active].events = POLLOUT;
+	which[active] = next;
+	deadline[active] = now + config.connecttimeout * 1000L;
+	active++;
+	next_start = config.connectdelay > 0
+	    ? now + config.connectdelay : LONG_MAX;
+      }
+      next++;
+      continue;
+    }
+
+    for (timeout = LONG_MAX, i = 0; i < active; i++)
+      timeout = min(timeout, deadline[i]);
+    if (next < addrs->count)
+      timeout = min(timeout, next_start);
+    if (worker_poll(pfd, active, (int) max(timeout - now, 0L)) < 0
+	&& errno != EINTR) {
+      snprintf(errbuf, errbuflen, "socket() error \"%s\".", strerror(errno));
+      break;
+    }
+
+    now = monotonic_ms();
+    for (i = 0; i < active;) {
+      if (pfd[i].revents) {
+	/* a refused connect is "ready" as well */
+	err = 0;
+	len = sizeof(err);
+	if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+	  err = errno;
+	if (!err && fd < 0) {
+	  fd = pfd[i].fd;
+	  *winner = which[i];
+	  health_report(&addrs->addr[which[i]], host, HEALTH_CONNECTED);
+	} else if (!err) {
+	  i++;
+	  continue;
+	} else {
+	  snprintf(errbuf, errbuflen, "connect() error \"%s\".", strerror(err));
+	  health_report(&addrs->addr[which[i]], host, HEALTH_FAILED);
+	  next_start = now;
+	}
+      } else if (now >= deadline[i]) {
+	snprintf(errbuf, errbuflen, "connection timeout.");
+	health_report(&addrs->addr[which[i]], host, HEALTH_TIMEDOUT);
+      } else {
+	i++;
+	continue;
+      }
+
+      if (fd != pfd[i].fd) {
+	log_message(LOG_ERR, "opensock: %s; %s",
+		    addrstr(ipbuf, sizeof(ipbuf), &addrs->addr[which[i]]),
+		    errbuf);
+	close(pfd[i].fd);
+      }
+      active--;
+      pfd[i] = pfd[active];
+      which[i] = which[active];
+      deadline[i] = deadline[active];
+    }
+  }
+
+  /* the attempts which lost */
+  for (i = 0; i < active; i++) {
+    close(pfd[i].fd);
+    health_report(&addrs->addr[which[i]], host, HEALTH_ABORTED);
+  }
+
+  if (fd >= 0)
+    socket_blocking(fd);
+  else if (tried == 0 && down != HEALTH_UP)
+    return down == HEALTH_DOWN_TIMEOUT ? SOCK_EDOWN_TIMEOUT : SOCK_EDOWN;
+  return fd;
+}
+
 /* This routine is so old I can't even remember writing it.  But I do
  * remember that it was an .h file because I didn't know putting code in a
  * header was bad magic yet.  anyway, this routine opens a connection to a
@@ -151,55 +331,40 @@ static const char* addrstr(char *dst, int len, struct addrinfo *rp)
  *
  * Rewrote the whole thing to use nonblocking connect
  *	- tenchio
+ *
+ * The names are resolved by dns_resolve(), which does not block either,
+ * and the addresses race each other in connect_race(). Returns the socket,
+ * -1 with the reason in "errbuf", or SOCK_EDOWN(_TIMEOUT) if all addresses
+ * are known to be down.
  */
 int opensock(char *host, uint16_t port, char *errbuf, size_t errbuflen)
 {
-  int sock_fd = -1;
+  int sock_fd;
   char ipbuf[INET6_ADDRSTRLEN];
-
-  struct addrinfo hints;
-  struct addrinfo *result, *rp;
-
-  int r;
-  char service[6];
+  struct dns_result_s addrs;
+  int winner = 0, r;
 
   assert(host != NULL);
   assert(errbuf != NULL);
   assert(errbuflen > 0);
   assert(port > 0);
 
-  snprintf(service, 6, "%hu", port);
-
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
-
-  if (0 != (r = getaddrinfo(host, service, &hints, &result))) {
-    snprintf(errbuf, errbuflen, "getaddrinfo() error \"%s\".", gai_strerror(r));;
-  } else {
-    /*
-     * try to connect to the given address for each returned address
-     */
-    for (rp = result; rp; rp = rp->ai_next) {
-
-      addrstr(ipbuf, sizeof(ipbuf), rp);
+  if (0 != (r = dns_resolve(host, port, &addrs))) {
+    snprintf(errbuf, errbuflen, "DNS error \"%s\".", dns_strerror(r));
+    return -1;
+  }
 
-      if (-1 == (sock_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol))) {
-	snprintf(errbuf, errbuflen, "can't create socket: \"%s\".", strerror(errno));
-	log_message(LOG_ERR, "opensock: %s; %s", ipbuf, errbuf);
-      } else if (-1 == do_connect(sock_fd, rp, errbuf, errbuflen)) {
-	log_message(LOG_ERR, "opensock: %s; %s", ipbuf, errbuf);
-	close(sock_fd);
-	sock_fd = -1;
-      } else {
-	log_message(LOG_INFO, "connected to %s @ %s", host, ipbuf);
-	break;
-      }
-    }
+  order_addrs(&addrs);
+  sock_fd = connect_race(host, &addrs, &winner, errbuf, errbuflen);
+  if (sock_fd >= 0) {
+    addrstr(ipbuf, sizeof(ipbuf), &addrs.addr[winner]);
+    log_message(LOG_INFO, "connected to %s @ %s", host, ipbuf);
+    stats_connect(addrs.addr[winner].sa.sa_family, winner > 0);
+    health_winner(host, port, addrs.addr[winner].sa.sa_family);
+  } else if (sock_fd != -1) {
+    log_message(LOG_CONN, "opensock: %s; %s", host, errbuf);
+    update_stats(STAT_FAST_FAIL);
   }
-  if (result)
-    freeaddrinfo(result);
   return sock_fd;
 }
 
@@ -235,7 +400,7 @@ int socket_blocking(int sock)
  * the pointer, while the socket is returned as a default return.
  *	- rjkaes
  */
-int listen_sock(struct sock_s *sock)
+int listen_sock(struct sock_s *sock, int shard)
 {
   int listenfd;
   const int on = 1;
@@ -245,15 +410,36 @@ int listen_sock(struct sock_s *sock)
   listenfd = socket(AF_INET, SOCK_STREAM, 0);
   setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
+#ifdef SO_REUSEPORT
+  if (shard >= 0) {
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+      log_message(LOG_ERR, "Unable to set SO_REUSEPORT: %s", strerror(errno));
+      close(listenfd);
+      return -1;
+    }
+#  ifdef SO_INCOMING_CPU
+    if (config.listensharding_cpu) {
+      int cpu = shard % max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+      setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+#  endif
+  }
+#endif
+
+  /* more than one child may wake up for a connection, never block */
+  socket_nonblocking(listenfd);
+
   if (bind
       (listenfd, (struct sockaddr *) &sock->addr,
        sizeof(struct sockaddr_in)) < 0) {
     log_message(LOG_ERR, "Unable to bind listening: %s", strerror(errno));
+    close(listenfd);
     return -1;
   }
 
   if (listen(listenfd, MAXLISTEN) < 0) {
     log_message(LOG_ERR, "Unable to start listening: %s", strerror(errno));
+    close(listenfd);
     return -1;
   }
 
@@ -261,83 +447,480 @@ int listen_sock(struct sock_s *sock)
 }
 
 /*
- * wait for a connection on one of our listening sockets and
- * return the socket descriptor
+ * Accept a connection on the (nonblocking) listening socket, the new
+ * socket is nonblocking and close-on-exec as well.
 **/
-int accept_sock(void)
+static int accept_nonblocking(int listenfd)
 {
-  int i, listenfd = -1, fd = -1;
-  fd_set fds;
+#ifdef HAVE_ACCEPT4
+  return accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  int fd = accept(listenfd, NULL, NULL);
+
+  if (fd != -1) {
+    socket_nonblocking(fd);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+#endif
+}
 
-  FD_ZERO(&fds);
+/*
+ * Pass the socket "fd" over the unix domain socket "channel".
+**/
+int send_sock(int channel, int fd)
+{
+  char byte = 0;
+  struct iovec iov = {.iov_base = &byte,.iov_len = 1 };
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctrl;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&ctrl, 0, sizeof(ctrl));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  return sendmsg(channel, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
 
-  for (i = 0; i < listeners.total; i++) {
-    if (listeners.sock[i].fd != -1)
-      FD_SET(listeners.sock[i].fd, &fds);
+/*
+ * Receive a socket passed with send_sock() without waiting. Returns -1
+ * with errno set to EPIPE if the other end is gone.
+**/
+static int recv_sock(int channel)
+{
+  char byte;
+  struct iovec iov = {.iov_base = &byte,.iov_len = 1 };
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctrl;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  ssize_t len;
+  int fd;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+
+  if ((len = recvmsg(channel, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) <= 0) {
+    if (len == 0)
+      errno = EPIPE;
+    return -1;
   }
 
-  if (select(listeners.maxfd + 1, &fds, NULL, NULL, NULL) == -1) {
-    log_message(LOG_ERR, "select() %s", strerror(errno));
-    goto COMMON_EXIT;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS) {
+    errno = EBADMSG;
+    return -1;
+  }
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+/*
+ * Take up to "max" connections passed in by the acceptor (AcceptQueue).
+ * Returns -1 if the acceptor closed the channel.
+**/
+static int recv_sock_batch(int *fds, int max)
+{
+  int n = 0, fd;
+
+  while (n < max) {
+    if ((fd = recv_sock(listeners.channel)) != -1) {
+      fds[n++] = fd;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno == EPIPE && n == 0)
+      return -1;
+    if (errno != EAGAIN && errno != EPIPE)
+      log_message(LOG_ERR, "recvmsg() %s", strerror(errno));
+    break;
+  }
+  return n;
+}
+
+/*
+ * Accept up to "max" pending connections on our listening sockets
+ * without waiting. Returns the number of connections stored in "fds",
+ * or -1 (errno EPIPE) if the acceptor closed our channel.
+**/
+int accept_sock_batch(int *fds, int max)
+{
+  static int next = 0;
+  int i = 0, n = 0, fd;
+
+  if (listeners.channel != -1)
+    return recv_sock_batch(fds, max);
+
+  while (i < listeners.total && n < max) {
+    int listenfd = listeners.sock[(next + i) % listeners.total].fd;
+
+    if (listenfd == -1) {
+      i++;
+      continue;
+    }
+
+    if ((fd = accept_nonblocking(listenfd)) != -1) {
+      log_message(LOG_INFO, "accepted connection on %d", fd);
+      fds[n++] = fd;
+      update_stats(STAT_ACCEPTED);
+      continue;
+    }
+
+    switch (errno) {
+    case EINTR:
+    case ECONNABORTED:
+      continue;
+    case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+    case EWOULDBLOCK:
+#endif
+      break;
+    default:
+      log_message(LOG_ERR, "accept() %s", strerror(errno));
+    }
+    i++;
+  }
+
+  if (n && listeners.shard != -1)
+    ATOMIC_ADD(&listeners.accepts[listeners.shard], n);
+
+  /* start with another listener next time to be fair */
+  if (listeners.total)
+    next = (next + 1) % listeners.total;
+
+  return n;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * Add all listening sockets to (or remove them from) an epoll instance.
+ * EPOLLEXCLUSIVE makes the kernel wake only one of the children waiting
+ * for a new connection instead of all of them.
+**/
+int listeners_epoll(int epfd, int op, uint64_t data)
+{
+  struct epoll_event ev;
+  int i;
+
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.u64 = data;
+
+  if (listeners.channel != -1) {
+    ev.events = EPOLLIN;
+    if (epoll_ctl(epfd, op, listeners.channel, &ev) == -1) {
+      log_message(LOG_ERR, "epoll_ctl() %s", strerror(errno));
+      return -1;
+    }
   }
 
   for (i = 0; i < listeners.total; i++) {
     if (listeners.sock[i].fd == -1)
       continue;
-    if (FD_ISSET(listeners.sock[i].fd, &fds)) {
-      listenfd = listeners.sock[i].fd;
-      break;
+    if (epoll_ctl(epfd, op, listeners.sock[i].fd, &ev) == -1) {
+      /* kernels before 4.5 do not know about EPOLLEXCLUSIVE */
+      if (errno == EINVAL && op == EPOLL_CTL_ADD
+	  && (ev.events & EPOLLEXCLUSIVE)) {
+	ev.events &= ~EPOLLEXCLUSIVE;
+	i--;
+	continue;
+      }
+      log_message(LOG_ERR, "epoll_ctl() %s", strerror(errno));
+      return -1;
     }
   }
+  return 0;
+}
+#endif
 
-  if (listenfd == -1) {
-    log_message(LOG_ERR, "accept_sock: unexpected event");
-    goto COMMON_EXIT;
+/*
+ * wait until one of our listening sockets becomes readable
+**/
+static int wait_listeners(void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  static int epfd = -1;
+  struct epoll_event ev;
+
+  /* every child needs an epoll instance of its own */
+  if (epfd == -1) {
+    if ((epfd = epoll_create(listeners.total + 1)) == -1) {
+      log_message(LOG_ERR, "epoll_create() %s", strerror(errno));
+      return -1;
+    }
+    if (listeners_epoll(epfd, EPOLL_CTL_ADD, 0) < 0) {
+      close(epfd);
+      epfd = -1;
+      return -1;
+    }
   }
 
-  if ((fd = accept(listenfd, NULL, NULL)) == -1) {
-    log_message(LOG_ERR, "accept() %s", strerror(errno));
-    goto COMMON_EXIT;
+  if (epoll_wait(epfd, &ev, 1, -1) == -1) {
+    log_message(LOG_ERR, "epoll_wait() %s", strerror(errno));
+    return -1;
   }
+#else
+  int i;
+  fd_set fds;
 
-  log_message(LOG_INFO, "accepted connection on %d", fd);
+  FD_ZERO(&fds);
 
-COMMON_EXIT:
-  return fd;
+  if (listeners.channel != -1)
+    FD_SET(listeners.channel, &fds);
+  for (i = 0; i < listeners.total; i++) {
+    if (listeners.sock[i].fd != -1)
+      FD_SET(listeners.sock[i].fd, &fds);
+  }
+
+  if (select(listeners.maxfd + 1, &fds, NULL, NULL, NULL) == -1) {
+    log_message(LOG_ERR, "select() %s", strerror(errno));
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+/*
+ * wait for a connection on one of our listening sockets and
+ * return the socket descriptor
+**/
+int accept_sock(void)
+{
+  int fd;
+
+  for (;;) {
+    if (wait_listeners() < 0)
+      return -1;
+
+    update_stats(STAT_ACCEPT_WAKEUP);
+    switch (accept_sock_batch(&fd, 1)) {
+    case 1:
+      return fd;
+    case -1:
+      return -1;
+    }
+
+    /* another child was faster */
+    update_stats(STAT_ACCEPT_IDLE);
+  }
 }
 
 /*
  * start listening
  *
+ * With ListenSharding every address gets one SO_REUSEPORT socket per
+ * shard. All of them are opened here, so respawned children find the
+ * socket of their shard still in place.
+ *
  * return 0 if at least one listener succeeds, -1 otherwise
 **/
 int start_listeners(void)
 {
-  int i;
+  int i, k;
+
+  if (config.listensharding > 1) {
+#ifdef SO_REUSEPORT
+    listeners.accepts = calloc_shared_memory(config.listensharding,
+					     sizeof(unsigned long));
+    if (listeners.accepts == MAP_FAILED) {
+      log_message(LOG_WARNING,
+		  "Could not allocate the shard counters, ignoring ListenSharding: %s",
+		  strerror(errno));
+      listeners.accepts = NULL;
+    } else
+      listeners.nshards = config.listensharding;
+#else
+    log_message(LOG_WARNING,
+		"SO_REUSEPORT is not supported, ignoring ListenSharding.");
+#endif
+  }
+
   for (i = 0; i < listeners.total; i++) {
-    int fd = listen_sock(&listeners.sock[i]);
+    struct sock_s *sock = &listeners.sock[i];
+    int fd;
+
+    if (listeners.nshards) {
+      sock->shards = malloc(listeners.nshards * sizeof(int));
+      if (!sock->shards)
+	return -1;
+      for (k = 0; k < listeners.nshards; k++) {
+	if ((sock->shards[k] = listen_sock(sock, k)) == -1) {
+	  while (k--)
+	    close(sock->shards[k]);
+	  free(sock->shards);
+	  sock->shards = NULL;
+	  break;
+	}
+      }
+      fd = sock->shards ? sock->shards[0] : -1;
+    } else
+      fd = listen_sock(sock, -1);
+
     if (fd != -1) {
       listeners.maxfd = fd;
       log_message(LOG_NOTICE, "Start listening on %s:%d",
-		  inet_ntoa(listeners.sock[i].addr.sin_addr),
-		  ntohs(listeners.sock[i].addr.sin_port));
+		  inet_ntoa(sock->addr.sin_addr),
+		  ntohs(sock->addr.sin_port));
     }
-    listeners.sock[i].fd = fd;
+    sock->fd = fd;
   }
   return listeners.maxfd;
 }
 
+/*
+ * Use only the sockets of a single shard in this (child) process and
+ * close those of all other shards. The shard is derived from the slot
+ * of the child, so a respawned child takes over the same shard.
+**/
+void listeners_use_shard(int slot)
+{
+  int i, k;
+
+  if (!listeners.nshards)
+    return;
+
+  listeners.shard = slot % listeners.nshards;
+  listeners.maxfd = -1;
+
+  for (i = 0; i < listeners.total; i++) {
+    struct sock_s *sock = &listeners.sock[i];
+
+    if (!sock->shards)
+      continue;
+
+    for (k = 0; k < listeners.nshards; k++) {
+      if (k != listeners.shard)
+	close(sock->shards[k]);
+    }
+    sock->fd = sock->shards[listeners.shard];
+    listeners.maxfd = max(listeners.maxfd, sock->fd);
+    free(sock->shards);
+    sock->shards = NULL;
+  }
+
+#ifdef SO_INCOMING_CPU
+  /* process the connections on the CPU which received them */
+  if (config.listensharding_cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(listeners.shard % max(sysconf(_SC_NPROCESSORS_ONLN), 1), &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+#endif
+}
+
+/*
+ * Take connections from the acceptor over "channel" instead of
+ * accepting them on the listening sockets (AcceptQueue).
+**/
+void listeners_use_channel(int channel)
+{
+  close_listeners();
+  listeners.channel = channel;
+  listeners.maxfd = channel;
+}
+
+/*
+ * Fill "fds" with the listening sockets to be polled for POLLIN,
+ * returns the number of entries used.
+**/
+int listeners_pollfds(struct pollfd *fds, int max)
+{
+  int i, n = 0;
+
+  for (i = 0; i < listeners.total && n < max; i++) {
+    if (listeners.sock[i].fd == -1)
+      continue;
+    fds[n].fd = listeners.sock[i].fd;
+    fds[n].events = POLLIN;
+    fds[n].revents = 0;
+    n++;
+  }
+  return n;
+}
+
+/*
+ * Number of listener shards, 0 if ListenSharding is not in use
+**/
+int listeners_shards(void)
+{
+  return listeners.nshards;
+}
+
+/*
+ * Number of connections accepted on a shard so far
+**/
+unsigned long listeners_shard_accepts(int shard)
+{
+  assert(shard >= 0 && shard < listeners.nshards);
+  return ATOMIC_LOAD(&listeners.accepts[shard]);
+}
+
+static int queue_length(int fd)
+{
+#ifdef TCP_INFO
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+
+  /* for listening sockets tcpi_unacked is the accept queue length */
+  if (fd != -1 && getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+    return info.tcpi_unacked;
+#endif
+  return 0;
+}
+
+/*
+ * Number of connections waiting in the accept queues of all listeners
+**/
+int listeners_queued(void)
+{
+  int i, k, n = 0;
+
+  for (i = 0; i < listeners.total; i++) {
+    if (listeners.sock[i].shards) {
+      for (k = 0; k < listeners.nshards; k++)
+	n += queue_length(listeners.sock[i].shards[k]);
+    } else
+      n += queue_length(listeners.sock[i].fd);
+  }
+  return n;
+}
+
 /*
  * close all opened listeners
 **/
 void close_listeners(void)
 {
-  int i;
+  int i, k;
   for (i = 0; i < listeners.total; i++) {
-    if (listeners.sock[i].fd != -1) {
+    if (listeners.sock[i].shards) {
+      for (k = 0; k < listeners.nshards; k++)
+	close(listeners.sock[i].shards[k]);
+      free(listeners.sock[i].shards);
+      listeners.sock[i].shards = NULL;
+    } else if (listeners.sock[i].fd != -1)
       close(listeners.sock[i].fd);
-      listeners.sock[i].fd = -1;
-    }
+    listeners.sock[i].fd = -1;
   }
 }
 
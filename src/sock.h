@@ -24,9 +24,22 @@
 
 #define MAXLINE (1024 * 4)
 
+/* ConnectOrder */
+#define CONNECT_ORDER_AUTO	0	/* interleaved, as the resolver starts */
+#define CONNECT_ORDER_IPV6	1	/* interleaved, IPv6 first */
+#define CONNECT_ORDER_IPV4	2	/* interleaved, IPv4 first */
+#define CONNECT_ORDER_RESOLVER	3	/* as the resolver returned them */
+
+/* opensock() did not try, the addresses failed lately (see 'health.c') */
+#define SOCK_EDOWN		-2
+#define SOCK_EDOWN_TIMEOUT	-3	/* ... by timing out */
+
+extern int set_connect_order(const char *order);
 extern int opensock(char *ip_addr, uint16_t port, char *errbuf,
 		    size_t errbuflen);
 extern int accept_sock(void);
+extern int accept_sock_batch(int *fds, int max);
+extern int send_sock(int channel, int fd);
 
 extern int socket_nonblocking(int sock);
 extern int socket_blocking(int sock);
@@ -34,7 +47,17 @@ extern int socket_blocking(int sock);
 extern int getpeer_information(int fd, char *ipaddr, char *string_addr);
 extern int start_listeners(void);
 extern void close_listeners(void);
+extern void listeners_use_shard(int slot);
+extern void listeners_use_channel(int channel);
+extern int listeners_pollfds(struct pollfd *fds, int max);
+extern int listeners_shards(void);
+extern unsigned long listeners_shard_accepts(int shard);
+extern int listeners_queued(void);
 extern int add_listener(const char *addr, int port);
 extern int listeners_total(void);
 
+#ifdef HAVE_SYS_EPOLL_H
+extern int listeners_epoll(int epfd, int op, uint64_t data);
+#endif
+
 #endif
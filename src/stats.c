@@ -24,9 +24,12 @@
 #include "tinyproxy-ex.h"
 
 #include "log.h"
+#include "health.h"
 #include "heap.h"
 #include "htmlerror.h"
+#include "sock.h"
 #include "stats.h"
+#include "text.h"
 #include "utils.h"
 
 #define STAT_NUM_TYPE unsigned long int
@@ -41,6 +44,33 @@ struct stat_s {
   unsigned long int num_refused;
   unsigned long int num_denied;
   unsigned long int num_ofcdmatch;
+  unsigned long int num_accept_wakeups;
+  unsigned long int num_accept_idle;
+  unsigned long int num_accepted;
+  unsigned long int num_rampups;
+  unsigned long int ramp_last_ms;
+  unsigned long int ramp_max_ms;
+  unsigned long int ramp_from;
+  unsigned long int ramp_to;
+  unsigned long int num_queued;
+  unsigned long int queue_wait_max_ms;
+  unsigned long int num_offloaded;
+  unsigned long int num_offload_done;
+  unsigned long int num_reused;
+  unsigned long int num_pool_hits;
+  unsigned long int num_pool_connects;
+  unsigned long int pool_connect_us;
+  unsigned long int num_mallocs;
+  unsigned long int num_frees;
+  unsigned long int num_alloc_reused;
+  unsigned long int num_dns_hits;
+  unsigned long int num_dns_misses;
+  unsigned long int num_dns_expired;
+  unsigned long int num_connect_inet;
+  unsigned long int num_connect_inet6;
+  unsigned long int num_connect_fallback;
+  unsigned long int num_circuit_open;
+  unsigned long int num_fast_fail;
 };
 
 static struct stat_s *stats;
@@ -64,6 +94,73 @@ int add_stat_variable(struct conn_s *connptr, char *key, STAT_NUM_TYPE value)
   return add_error_variable(connptr, key, buf);
 }
 
+/*
+ * Format the accepted connections per listener shard as "n0 n1 ...",
+ * or "-" if ListenSharding is not in use.
+ */
+static void format_shard_accepts(char *buf, size_t len)
+{
+  size_t pos = 0;
+  int k;
+
+  strlcpy(buf, "-", len);
+  for (k = 0; k < listeners_shards() && pos < len; k++)
+    pos += snprintf(buf + pos, len - pos, k ? " %lu" : "%lu",
+		    listeners_shard_accepts(k));
+}
+
+/*
+ * Percentage of the requests which came in on a kept alive connection.
+ */
+static unsigned long reuse_rate(void)
+{
+  return stats->num_reqs ? stats->num_reused * 100 / stats->num_reqs : 0;
+}
+
+/*
+ * Percentage of the server connections which came from the pool, and an
+ * estimate of the connect time this saved, based on the average time a
+ * new connection took.
+ */
+static unsigned long pool_hit_rate(void)
+{
+  unsigned long total = stats->num_pool_hits + stats->num_pool_connects;
+
+  return total ? stats->num_pool_hits * 100 / total : 0;
+}
+
+/*
+ * Format the malloc() and free() calls for connections, buffers and
+ * request arenas per request with two decimals.
+ */
+static void format_allocs_per_request(char *buf, size_t len)
+{
+  unsigned long calls = stats->num_mallocs + stats->num_frees;
+  unsigned long per100 = stats->num_reqs ? calls * 100 / stats->num_reqs : 0;
+
+  snprintf(buf, len, "%lu.%02lu", per100 / 100, per100 % 100);
+}
+
+/*
+ * Percentage of the name lookups the DNS cache could answer.
+ */
+static unsigned long dns_hit_rate(void)
+{
+  unsigned long total = stats->num_dns_hits + stats->num_dns_misses
+      + stats->num_dns_expired;
+
+  return total ? stats->num_dns_hits * 100 / total : 0;
+}
+
+static unsigned long pool_saved_ms(void)
+{
+  if (!stats->num_pool_connects)
+    return 0;
+  return (unsigned long) ((unsigned long long) stats->pool_connect_us
+			  * stats->num_pool_hits
+			  / stats->num_pool_connects / 1000);
+}
+
 /*
  * Display the statics of the tinyproxy-ex server.
  */
@@ -79,12 +176,32 @@ int showstats(struct conn_s *connptr)
       "Number of bad connections: %lu<br>\r\n"
       "Number of denied connections: %lu<br>\r\n"
       "Number of ofcd matched connections: %lu<br>\r\n"
-      "Number of refused connections due to high load: %lu\r\n"
+      "Number of refused connections due to high load: %lu<br>\r\n"
+      "Number of accepted connections: %lu<br>\r\n"
+      "Number of accept wakeups: %lu (%lu without a connection)<br>\r\n"
+      "Accepted connections per listener shard: %s<br>\r\n"
+      "Pool ramp-ups: %lu, last took %lu ms (%lu to %lu servers), longest %lu ms<br>\r\n"
+      "Connections passed on by the acceptor: %lu, longest wait %lu ms<br>\r\n"
+      "Connections passed to the relay daemon: %lu (%lu active)<br>\r\n"
+      "Requests on kept alive connections: %lu (%lu%%)<br>\r\n"
+      "Server connections from the pool: %lu (%lu%%), about %lu ms of connecting saved<br>\r\n"
+      "Allocator calls for connections, buffers and requests: %lu malloc, %lu free (%s per request), %lu served from the free lists<br>\r\n"
+      "DNS cache: %lu hits (%lu%%), %lu misses, %lu expired<br>\r\n"
+      "New server connections over IPv4: %lu, over IPv6: %lu, %lu not to the first address<br>\r\n"
+      "Server addresses taken out after failed connects: %lu, requests failed without a connect: %lu<br>\r\n"
+      "Server addresses with failed connects: %s<br>\r\n"
+      "Address family of the last connection per destination: %s\r\n"
       "</blockquote>\r\n</body></html>\r\n";
 
   char *message_buffer;
+  char shards[256], allocs[32], down[2048], winners[8192];
   FILE *statfile;
 
+  format_shard_accepts(shards, sizeof(shards));
+  format_allocs_per_request(allocs, sizeof(allocs));
+  health_list(down, sizeof(down));
+  health_winners(winners, sizeof(winners));
+
   if (!config.statpage || (!(statfile = fopen(config.statpage, "r")))) {
     message_buffer = malloc(MAXBUFFSIZE);
     if (!message_buffer)
@@ -95,7 +212,23 @@ int showstats(struct conn_s *connptr)
 	     stats->num_open,
 	     stats->num_reqs,
 	     stats->num_badcons, stats->num_denied, stats->num_ofcdmatch,
-	     stats->num_refused);
+	     stats->num_refused, stats->num_accepted,
+	     stats->num_accept_wakeups, stats->num_accept_idle, shards,
+	     stats->num_rampups, stats->ramp_last_ms, stats->ramp_from,
+	     stats->ramp_to, stats->ramp_max_ms,
+	     stats->num_queued, stats->queue_wait_max_ms,
+	     stats->num_offloaded,
+	     stats->num_offloaded - stats->num_offload_done,
+	     stats->num_reused, reuse_rate(),
+	     stats->num_pool_hits, pool_hit_rate(), pool_saved_ms(),
+	     stats->num_mallocs, stats->num_frees, allocs,
+	     stats->num_alloc_reused,
+	     stats->num_dns_hits, dns_hit_rate(), stats->num_dns_misses,
+	     stats->num_dns_expired,
+	     stats->num_connect_inet, stats->num_connect_inet6,
+	     stats->num_connect_fallback,
+	     stats->num_circuit_open, stats->num_fast_fail, down,
+	     winners);
 
     if (send_http_message(connptr, 200, "OK", message_buffer) < 0) {
       free(message_buffer);
@@ -115,6 +248,40 @@ int showstats(struct conn_s *connptr)
   add_stat_variable(connptr, "deniedconns", stats->num_denied);
   add_stat_variable(connptr, "ofcdmatch", stats->num_ofcdmatch);
   add_stat_variable(connptr, "refusedconns", stats->num_refused);
+  add_stat_variable(connptr, "accepted", stats->num_accepted);
+  add_stat_variable(connptr, "acceptwakeups", stats->num_accept_wakeups);
+  add_stat_variable(connptr, "acceptidle", stats->num_accept_idle);
+  add_error_variable(connptr, "shardaccepts", shards);
+  add_stat_variable(connptr, "rampups", stats->num_rampups);
+  add_stat_variable(connptr, "ramplast", stats->ramp_last_ms);
+  add_stat_variable(connptr, "rampfrom", stats->ramp_from);
+  add_stat_variable(connptr, "rampto", stats->ramp_to);
+  add_stat_variable(connptr, "rampmax", stats->ramp_max_ms);
+  add_stat_variable(connptr, "acceptqueued", stats->num_queued);
+  add_stat_variable(connptr, "acceptwait", stats->queue_wait_max_ms);
+  add_stat_variable(connptr, "offloaded", stats->num_offloaded);
+  add_stat_variable(connptr, "offloadactive",
+		    stats->num_offloaded - stats->num_offload_done);
+  add_stat_variable(connptr, "reused", stats->num_reused);
+  add_stat_variable(connptr, "reuserate", reuse_rate());
+  add_stat_variable(connptr, "poolhits", stats->num_pool_hits);
+  add_stat_variable(connptr, "poolhitrate", pool_hit_rate());
+  add_stat_variable(connptr, "poolsaved", pool_saved_ms());
+  add_stat_variable(connptr, "mallocs", stats->num_mallocs);
+  add_stat_variable(connptr, "frees", stats->num_frees);
+  add_error_variable(connptr, "allocsperreq", allocs);
+  add_stat_variable(connptr, "allocsreused", stats->num_alloc_reused);
+  add_stat_variable(connptr, "dnshits", stats->num_dns_hits);
+  add_stat_variable(connptr, "dnshitrate", dns_hit_rate());
+  add_stat_variable(connptr, "dnsmisses", stats->num_dns_misses);
+  add_stat_variable(connptr, "dnsexpired", stats->num_dns_expired);
+  add_stat_variable(connptr, "connectinet", stats->num_connect_inet);
+  add_stat_variable(connptr, "connectinet6", stats->num_connect_inet6);
+  add_stat_variable(connptr, "connectfallback", stats->num_connect_fallback);
+  add_stat_variable(connptr, "circuitopen", stats->num_circuit_open);
+  add_stat_variable(connptr, "fastfail", stats->num_fast_fail);
+  add_error_variable(connptr, "serversdown", down);
+  add_error_variable(connptr, "destfamilies", winners);
 
   add_standard_vars(connptr);
   send_http_headers(connptr, 200, "Statistic requested");
@@ -160,9 +327,117 @@ int update_stats(status_t update_level)
     ++stats->num_ofcdmatch;
     ++stats->num_denied;
     break;
+  case STAT_ACCEPT_WAKEUP:
+    ++stats->num_accept_wakeups;
+    break;
+  case STAT_ACCEPT_IDLE:
+    ++stats->num_accept_idle;
+    break;
+  case STAT_ACCEPTED:
+    ++stats->num_accepted;
+    break;
+  case STAT_OFFLOADED:
+    ++stats->num_offloaded;
+    break;
+  case STAT_OFFLOAD_DONE:
+    ++stats->num_offload_done;
+    break;
+  case STAT_REUSED:
+    ++stats->num_reqs;
+    ++stats->num_reused;
+    break;
+  case STAT_DNS_HIT:
+    ++stats->num_dns_hits;
+    break;
+  case STAT_DNS_MISS:
+    ++stats->num_dns_misses;
+    break;
+  case STAT_DNS_EXPIRED:
+    ++stats->num_dns_expired;
+    break;
+  case STAT_CIRCUIT_OPEN:
+    ++stats->num_circuit_open;
+    break;
+  case STAT_FAST_FAIL:
+    ++stats->num_fast_fail;
+    break;
   default:
     return -1;
   }
 
   return 0;
 }
+
+/*
+ * Number of connections accepted so far, used to estimate the load.
+ */
+unsigned long stats_accepted(void)
+{
+  return stats->num_accepted;
+}
+
+/*
+ * Record a growth of the child pool which took "ms" milliseconds to go
+ * from "from" to "to" servers.
+ */
+void stats_rampup(unsigned long ms, int from, int to)
+{
+  ++stats->num_rampups;
+  stats->ramp_last_ms = ms;
+  stats->ramp_from = from;
+  stats->ramp_to = to;
+  if (ms > stats->ramp_max_ms)
+    stats->ramp_max_ms = ms;
+}
+
+/*
+ * Record a connection the acceptor passed on to a child after it was
+ * queued for "ms" milliseconds.
+ */
+void stats_queued(unsigned long ms)
+{
+  ++stats->num_queued;
+  if (ms > stats->queue_wait_max_ms)
+    stats->queue_wait_max_ms = ms;
+}
+
+/*
+ * Record a server connection taken from the pool ("hit"), or a new one
+ * which took "us" microseconds to connect.
+ */
+void stats_pool(int hit, unsigned long us)
+{
+  if (hit) {
+    ++stats->num_pool_hits;
+  } else {
+    ++stats->num_pool_connects;
+    stats->pool_connect_us += us;
+  }
+}
+
+/*
+ * Record the malloc() and free() calls a child made for connections,
+ * buffers and request arenas, and how often a free list could serve
+ * instead.
+ */
+void stats_allocs(unsigned long mallocs, unsigned long frees,
+		  unsigned long reused)
+{
+  stats->num_mallocs += mallocs;
+  stats->num_frees += frees;
+  stats->num_alloc_reused += reused;
+}
+
+/*
+ * Record which address family a new server connection went over, and
+ * whether the first address of the name failed or was too slow.
+ */
+void stats_connect(int family, int fallback)
+{
+  if (family == AF_INET6)
+    ++stats->num_connect_inet6;
+  else
+    ++stats->num_connect_inet;
+  if (fallback)
+    ++stats->num_connect_fallback;
+}
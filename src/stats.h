@@ -32,7 +32,18 @@ typedef enum {
   STAT_CLOSE,			/* connection closed */
   STAT_REFUSE,			/* connection refused (to outside world) */
   STAT_DENIED,			/* connection denied to tinyproxy-ex itself */
-  STAT_OFCDMATCH		/* connection matched by ofcd */
+  STAT_OFCDMATCH,		/* connection matched by ofcd */
+  STAT_ACCEPT_WAKEUP,		/* child woken up for a new connection */
+  STAT_ACCEPT_IDLE,		/* ... but there was nothing to accept */
+  STAT_ACCEPTED,		/* connection accepted */
+  STAT_OFFLOADED,		/* connection passed to the relay daemon */
+  STAT_OFFLOAD_DONE,		/* ... and finished there */
+  STAT_REUSED,			/* request on a kept alive connection */
+  STAT_DNS_HIT,			/* name found in the DNS cache */
+  STAT_DNS_MISS,		/* ... not found */
+  STAT_DNS_EXPIRED,		/* ... found, but its TTL was over */
+  STAT_CIRCUIT_OPEN,		/* a server address was taken out */
+  STAT_FAST_FAIL		/* a request failed without a connect */
 } status_t;
 
 /*
@@ -41,5 +52,12 @@ typedef enum {
 extern void init_stats(void);
 extern int showstats(struct conn_s *connptr);
 extern int update_stats(status_t update_level);
+extern unsigned long stats_accepted(void);
+extern void stats_rampup(unsigned long ms, int from, int to);
+extern void stats_queued(unsigned long ms);
+extern void stats_pool(int hit, unsigned long us);
+extern void stats_connect(int family, int fallback);
+extern void stats_allocs(unsigned long mallocs, unsigned long frees,
+			 unsigned long reused);
 
 #endif
@@ -53,18 +53,36 @@ struct config_s {
   unsigned quit:1;
   unsigned reverselookup:1;
   unsigned i18n:1;
+  unsigned listensharding_cpu:1;
+  unsigned iouring:1;
 #ifdef FILTER_SUPPORT
   unsigned filter:1;
   unsigned filter_url:1;
   unsigned filter_extended:1;
   unsigned filter_casesensitive:1;
   unsigned filter_blockunknown:1;
-  unsigned pad0: 23;
+  unsigned pad0: 21;
 #else
-  unsigned pad0: 28;
+  unsigned pad0: 26;
 #endif				/* FILTER_SUPPORT */
+  int listensharding;
+  int acceptqueue;
+  int relayoffload;
+  int keepalivetimeout;
+  int maxkeepaliverequests;
+  int connectionpool;
+  int connectionpoolidle;
+  int connectionpoolmaxage;
+  int relaybuffersize;
+  int freelistmemory;
   int connecttimeout;
   int connectretries;
+  int connectdelay;
+  int connectorder;
+  int circuitbreaker;
+  int circuitbreakerbackoff;
+  int dnstimeout;
+  int dnscachesize;
   char *stathost;
   char *username;
   char *group;
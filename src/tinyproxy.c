@@ -28,11 +28,15 @@
 #include "anonymous.h"
 #include "buffer.h"
 #include "daemon.h"
+#include "dnscache.h"
 
 #include "filter.h"
 #include "child.h"
+#include "health.h"
 #include "log.h"
+#include "relay.h"
 #include "reqs.h"
+#include "scan.h"
 #include "sock.h"
 #include "stats.h"
 #include "utils.h"
@@ -72,6 +76,8 @@ void takesig(int sig)
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
       if (!config.quit && child_mark_empty(pid) == pid)
 	log_message(LOG_ERR, "child %d crashed, parachute deployed.", pid);
+      else if (relay_exited(pid) && !config.quit)
+	log_message(LOG_ERR, "relay daemon %d died, restarting it.", pid);
     }
     break;
   }
@@ -208,6 +214,10 @@ int main(int argc, char **argv)
    * (FIXME: Should have a better API for all this)
    */
   config.errorpages = NULL;
+  config.freelistmemory = -1;
+  config.dnscachesize = -1;
+  config.connectdelay = -1;
+  config.circuitbreaker = -1;
 
   /*
    * Read in the settings from the config file.
@@ -274,6 +284,33 @@ int main(int argc, char **argv)
   if (config.connectretries <= 0)
     config.connectretries = 3;
 
+  if (config.connectdelay < 0)
+    config.connectdelay = 250;
+
+  if (config.circuitbreaker < 0)
+    config.circuitbreaker = 5;
+
+  if (config.circuitbreakerbackoff <= 0)
+    config.circuitbreakerbackoff = 10;
+
+  if (config.dnstimeout <= 0)
+    config.dnstimeout = 5;
+
+  if (config.dnscachesize < 0)
+    config.dnscachesize = 1024;
+
+  if (config.connectionpoolidle <= 0)
+    config.connectionpoolidle = 4;
+
+  if (config.connectionpoolmaxage <= 0)
+    config.connectionpoolmaxage = 60;
+
+  if (config.relaybuffersize <= 0)
+    config.relaybuffersize = MAXBUFFSIZE;
+
+  if (config.freelistmemory < 0)
+    config.freelistmemory = 8 * config.relaybuffersize;
+
   /* 
    * warn if the overall timeout value exceeds 2min
    */
@@ -283,6 +320,8 @@ int main(int argc, char **argv)
 		config.connecttimeout, config.connectretries);
 
   init_stats();
+  dns_cache_init(config.dnscachesize);
+  health_init();
 
   /*
    * If ANONYMOUS is turned on, make sure that Content-Length is
@@ -368,6 +407,13 @@ int main(int argc, char **argv)
 
   initproctitle(argc, argv);
 
+  log_message(LOG_INFO, "Scanning message heads with %s.", scan_level());
+
+  if (relay_start() < 0) {
+    fprintf(stderr, "%s: Could not start the relay daemon.", argv[0]);
+    exit(EX_SOFTWARE);
+  }
+
   if (child_pool_create() < 0) {
     fprintf(stderr, "%s: Could not create the pool of children.", argv[0]);
     exit(EX_SOFTWARE);
@@ -400,6 +446,7 @@ int main(int argc, char **argv)
   log_message(LOG_INFO, "Shutting down.");
 
   child_kill_children();
+  relay_stop();
   close_listeners();
 
   /*
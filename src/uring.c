@@ -0,0 +1,478 @@
+/* $Id$
+ *
+ * The io_uring backend of relay_connection() (IOUring). Instead of
+ * polling both sockets and calling recv() and send() for every chunk,
+ * the reads and writes of both directions are kept in flight in an
+ * io_uring instance, and the child only waits for their completions.
+ * The data goes through two buffers registered with the ring, one per
+ * direction, each used as a circular buffer so a direction can read
+ * the next chunk while the previous one is still being written. Every
+ * request carries a linked timeout, which enforces the idle timeout.
+ *
+ * liburing is not needed, the three system calls are used directly. If
+ * the kernel lacks io_uring (or it is disabled), the backend turns
+ * itself off and relay_connection() uses its usual path.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "buffer.h"
+#include "conns.h"
+#include "log.h"
+#include "sock.h"
+#include "uring.h"
+#include "worker.h"
+
+/* enough for a read and a write with their timeouts in both directions */
+#define URING_ENTRIES 16
+
+/* holds everything the connection buffers may contain */
+#define URING_BUFSIZE (MAXBUFFSIZE + READ_BUFFER_SIZE)
+
+#define S2C 0				/* server to client */
+#define C2S 1				/* client to server */
+
+/* user_data of the requests: what it is and for which direction */
+enum { OP_READ, OP_WRITE, OP_TIMEOUT, OP_CANCEL };
+#define UDATA(op, dir) (((uint64_t) (op) << 1) | (dir))
+
+struct ring_s {
+  int fd;
+  int fixed;			/* the buffers are registered */
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  unsigned sq_entries;
+  unsigned tail;		/* local copy of the sq tail */
+  unsigned queued;		/* entries not yet submitted */
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+
+  unsigned char *buf[2];	/* one per direction */
+  struct __kernel_timespec idle;
+  struct ring_s *next;		/* list of unused rings */
+};
+
+struct dir_s {
+  int in, out;			/* read from, write to */
+  unsigned char *buf;
+  size_t start, len;		/* the data in the circular buffer */
+  unsigned int reading:1, writing:1;	/* requests in flight */
+  unsigned int eof:1;		/* nothing more to read */
+  unsigned int dead:1;		/* writing failed */
+  unsigned int cancelled:1;	/* the read has been cancelled */
+  uint64_t *processed;
+};
+
+static struct ring_s *unused;
+static int unavailable;
+
+/*
+ * Unmap and close a ring, also one which is only partly set up.
+ */
+static void ring_free(struct ring_s *ring)
+{
+  if (ring->buf[S2C])
+    munmap(ring->buf[S2C], 2 * URING_BUFSIZE);
+  if (ring->sqes && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+    munmap(ring->cq_ptr, ring->cq_len);
+  if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+    munmap(ring->sq_ptr, ring->sq_len);
+  close(ring->fd);
+  free(ring);
+}
+
+/*
+ * Create a new ring with registered buffers, returns NULL on failure.
+ */
+static struct ring_s *ring_new(void)
+{
+  struct io_uring_params p;
+  struct ring_s *ring;
+  struct iovec iov[2];
+  unsigned char *mem;
+
+  if (!(ring = calloc(1, sizeof(struct ring_s))))
+    return NULL;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (ring->fd < 0) {
+    log_message(errno == ENOMEM ? LOG_ERR : LOG_WARNING,
+		"io_uring not available (%s), IOUring disabled.",
+		strerror(errno));
+    if (errno != ENOMEM)
+      unavailable = TRUE;
+    free(ring);
+    return NULL;
+  }
+
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->sq_len = ring->cq_len = max(ring->sq_len, ring->cq_len);
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED)
+    goto ERROR_EXIT;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ptr = ring->sq_ptr;
+  else {
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED)
+      goto ERROR_EXIT;
+  }
+
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto ERROR_EXIT;
+
+  ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.array);
+  ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+  ring->sq_entries = p.sq_entries;
+  ring->tail = *ring->sq_tail;
+
+  mem = mmap(NULL, 2 * URING_BUFSIZE, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    goto ERROR_EXIT;
+  ring->buf[S2C] = mem;
+  ring->buf[C2S] = mem + URING_BUFSIZE;
+
+  /* unregistered buffers still work, e.g. with a low RLIMIT_MEMLOCK */
+  iov[S2C].iov_base = ring->buf[S2C];
+  iov[S2C].iov_len = URING_BUFSIZE;
+  iov[C2S].iov_base = ring->buf[C2S];
+  iov[C2S].iov_len = URING_BUFSIZE;
+  ring->fixed = syscall(__NR_io_uring_register, ring->fd,
+			IORING_REGISTER_BUFFERS, iov, 2) == 0;
+
+  return ring;
+
+ERROR_EXIT:
+  log_message(LOG_ERR, "ring_new: mmap() %s", strerror(errno));
+  ring_free(ring);
+  return NULL;
+}
+
+static struct io_uring_sqe *ring_sqe(struct ring_s *ring, uint64_t udata)
+{
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+
+  assert(ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+	 < ring->sq_entries);
+
+  idx = ring->tail & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = udata;
+  ring->sq_array[idx] = idx;
+  ring->tail++;
+  ring->queued++;
+
+  return sqe;
+}
+
+/*
+ * Submit all queued requests, returns -1 on error. The requests the
+ * kernel did not take are left in "queued" then.
+ */
+static int ring_submit(struct ring_s *ring)
+{
+  int ret;
+
+  __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+  while (ring->queued) {
+    ret = (int) syscall(__NR_io_uring_enter, ring->fd, ring->queued, 0, 0,
+			NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+	continue;
+      log_message(LOG_ERR, "ring_submit: io_uring_enter() %s",
+		  strerror(errno));
+      return -1;
+    }
+    ring->queued -= (unsigned) ret;
+  }
+  return 0;
+}
+
+/*
+ * Queue a read or a write for direction "dir" of up to "len" bytes at
+ * "pos" in its buffer, followed by a timeout.
+ */
+static void ring_rw(struct ring_s *ring, int op, int dir, int fd, size_t pos,
+		    size_t len)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = ring_sqe(ring, UDATA(op, dir));
+  if (ring->fixed) {
+    sqe->opcode = op == OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+    sqe->buf_index = (uint16_t) dir;
+  } else
+    sqe->opcode = op == OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) (ring->buf[dir] + pos);
+  sqe->len = (uint32_t) len;
+  sqe->flags = IOSQE_IO_LINK;
+
+  sqe = ring_sqe(ring, UDATA(OP_TIMEOUT, dir));
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = (uint64_t) (uintptr_t) & ring->idle;
+  sqe->len = 1;
+}
+
+/*
+ * Cancel the read in direction "dir".
+ */
+static void ring_cancel(struct ring_s *ring, int dir)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = ring_sqe(ring, UDATA(OP_CANCEL, dir));
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = UDATA(OP_READ, dir);
+}
+
+/*
+ * Queue whatever direction "d" is able to do next, returns the number of
+ * new requests.
+ */
+static int dir_queue(struct ring_s *ring, struct dir_s *d, int dir,
+		     int closing, uint64_t limit)
+{
+  size_t end, n;
+  int queued = 0;
+
+  if (!closing && !d->eof && !d->reading && d->len < URING_BUFSIZE) {
+    end = (d->start + d->len) % URING_BUFSIZE;
+    n = min(URING_BUFSIZE - d->len, URING_BUFSIZE - end);
+    if (n > limit)
+      n = (size_t) limit;
+    ring_rw(ring, OP_READ, dir, d->in, end, n);
+    d->reading = TRUE;
+    queued += 2;
+  }
+
+  if (!d->dead && !d->writing && d->len > 0) {
+    n = min(d->len, URING_BUFSIZE - d->start);
+    ring_rw(ring, OP_WRITE, dir, d->out, d->start, n);
+    d->writing = TRUE;
+    queued += 2;
+  }
+
+  return queued;
+}
+
+/*
+ * See uring.h
+ */
+int uring_relay(struct conn_s *connptr)
+{
+  struct ring_s *ring;
+  struct dir_s dirs[2], *d;
+  struct pollfd pfd;
+  unsigned head, tail;
+  time_t last_access;
+  int inflight = 0, closing = FALSE, shut = FALSE, aborted = FALSE;
+  int broken = FALSE;		/* the ring is not fit for reuse */
+  int i, dir, res;
+
+  if (!config.iouring || unavailable)
+    return -1;
+  if (buffer_size(connptr->sbuffer) > URING_BUFSIZE
+      || buffer_size(connptr->cbuffer) > URING_BUFSIZE)
+    return -1;
+
+  if (unused) {
+    ring = unused;
+    unused = ring->next;
+  } else if (!(ring = ring_new()))
+    return -1;
+
+  ring->idle.tv_sec = config.idletimeout;
+  ring->idle.tv_nsec = 0;
+
+  memset(dirs, 0, sizeof(dirs));
+  dirs[S2C].in = connptr->server_fd;
+  dirs[S2C].out = connptr->client_fd;
+  dirs[S2C].processed = &connptr->client.processed;
+  dirs[C2S].in = connptr->client_fd;
+  dirs[C2S].out = connptr->server_fd;
+  dirs[C2S].processed = &connptr->server.processed;
+  /* whatever the client sends now belongs to its next request */
+  dirs[C2S].eof = REQUEST_COMPLETE(connptr);
+
+  /* the buffered data has to go out first */
+  dirs[S2C].buf = ring->buf[S2C];
+  dirs[S2C].len = copy_from_buffer(connptr->sbuffer, dirs[S2C].buf,
+				   URING_BUFSIZE);
+  dirs[C2S].buf = ring->buf[C2S];
+  dirs[C2S].len = copy_from_buffer(connptr->cbuffer, dirs[C2S].buf,
+				   URING_BUFSIZE);
+  clear_buffer(connptr->sbuffer);
+  clear_buffer(connptr->cbuffer);
+
+  /* the ring waits for the sockets, nonblocking ones would fail */
+  socket_blocking(connptr->client_fd);
+  socket_blocking(connptr->server_fd);
+
+  pfd.fd = ring->fd;
+  pfd.events = POLLIN;
+  last_access = time(NULL);
+
+  for (;;) {
+    if (!aborted) {
+      inflight += dir_queue(ring, &dirs[S2C], S2C, closing,
+			    connptr->server.content_length);
+      inflight += dir_queue(ring, &dirs[C2S], C2S, closing, UINT64_MAX);
+    }
+
+    if (closing && !aborted) {
+      /* same order as relay_connection(): the client gets its FIN first */
+      d = &dirs[S2C];
+      if (!shut && !d->writing && (d->len == 0 || d->dead)) {
+	if (!connptr->keepalive)
+	  shutdown(connptr->client_fd, SHUT_WR);
+	shut = TRUE;
+      }
+      for (i = S2C; i <= C2S; i++) {
+	if (dirs[i].reading && !dirs[i].cancelled) {
+	  ring_cancel(ring, i);
+	  dirs[i].cancelled = TRUE;
+	  inflight++;
+	}
+      }
+    }
+
+    /*
+     * Nothing is queued once aborted. The requests the kernel did not
+     * take never complete, and stay in the ring.
+     */
+    if (!aborted && ring_submit(ring) < 0) {
+      inflight -= (int) ring->queued;
+      broken = aborted = TRUE;
+      shutdown(connptr->client_fd, SHUT_RDWR);
+      shutdown(connptr->server_fd, SHUT_RDWR);
+    }
+
+    if (inflight == 0)
+      break;
+
+    /* the linked timeouts fire long before this one */
+    if (worker_poll(&pfd, 1, (config.idletimeout + 5) * 1000) == 0) {
+      log_message(LOG_ERR, "uring_relay: no completions, giving up.");
+      if (broken)
+	break;		/* closing the ring cancels the rest */
+      broken = aborted = TRUE;
+      shutdown(connptr->client_fd, SHUT_RDWR);
+      shutdown(connptr->server_fd, SHUT_RDWR);
+    }
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+      inflight--;
+      dir = (int) (cqe->user_data & 1);
+      d = &dirs[dir];
+      res = cqe->res;
+
+      switch ((int) (cqe->user_data >> 1)) {
+      case OP_READ:
+	d->reading = FALSE;
+	if (res > 0) {
+	  d->len += (size_t) res;
+	  last_access = time(NULL);
+	  if (dir == S2C) {
+	    connptr->server.content_length -= (uint64_t) res;
+	    if (connptr->server.content_length == 0)
+	      closing = TRUE;
+	  }
+	} else if (res == -ECANCELED && !closing
+		   && time(NULL) - last_access < (time_t) config.idletimeout) {
+	  /* only one side is idle */
+	} else if (res == -ECANCELED && !closing) {
+	  log_message(LOG_INFO, "Idle Timeout (after poll) as %li > %u.",
+		      (long) (time(NULL) - last_access), config.idletimeout);
+	  aborted = closing = TRUE;
+	  shutdown(connptr->client_fd, SHUT_RDWR);
+	  shutdown(connptr->server_fd, SHUT_RDWR);
+	} else {
+	  d->eof = TRUE;
+	  closing = TRUE;
+	}
+	break;
+
+      case OP_WRITE:
+	d->writing = FALSE;
+	if (res > 0) {
+	  d->start = (d->start + (size_t) res) % URING_BUFSIZE;
+	  d->len -= (size_t) res;
+	  *d->processed += (uint64_t) res;
+	  last_access = time(NULL);
+	} else if (res == -ECANCELED
+		   && time(NULL) - last_access < (time_t) config.idletimeout) {
+	  /* try again */
+	} else {
+	  if (res != -EPIPE && res != -ECONNRESET && res != -ECANCELED)
+	    log_message(LOG_ERR, "uring_relay: write error \"%s\" on fd %d",
+			strerror(-res), d->out);
+	  d->dead = TRUE;
+	  d->len = 0;
+	  closing = TRUE;
+	}
+	break;
+      }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (closing && shut && !dirs[C2S].writing
+	&& (dirs[C2S].len == 0 || dirs[C2S].dead)
+	&& !dirs[S2C].reading && !dirs[C2S].reading)
+      aborted = TRUE;		/* nothing new to queue */
+  }
+
+  if (broken)
+    ring_free(ring);
+  else {
+    ring->next = unused;
+    unused = ring;
+  }
+
+  return 0;
+}
@@ -0,0 +1,31 @@
+/* $Id$
+ *
+ * See 'uring.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_URING_H
+#define TINYPROXY_URING_H
+
+#ifdef URING_SUPPORT
+struct conn_s;
+
+/*
+ * Relay the connection with io_uring. Returns -1 if IOUring is off or
+ * not available, relay_connection() has to do the work then.
+ */
+extern int uring_relay(struct conn_s *connptr);
+#else
+#define uring_relay(connptr) -1
+#endif
+
+#endif
@@ -28,6 +28,13 @@
 #include "http_message.h"
 #include "utils.h"
 
+/*
+ * The messages carry a Content-length, so the client connection may stay
+ * open if the client asked for it.
+ */
+#define CONNECTION_HEADER(connptr) \
+  ((connptr)->keepalive ? "Connection: keep-alive" : "Connection: close")
+
 /*
  * Build the data for a complete HTTP & HTML message for the client.
  */
@@ -35,10 +42,10 @@ int
 send_http_message(struct conn_s *connptr, int http_code,
 		  const char *error_title, const char *message)
 {
-  static char *headers[] = {
+  char *headers[] = {
     "Server: " PACKAGE "/" VERSION,
     "Content-type: text/html",
-    "Connection: close"
+    CONNECTION_HEADER(connptr)
   };
 
   http_message_t msg;
@@ -115,6 +122,7 @@ int serve_local_file(struct conn_s *connptr, const char *filename)
       headers[1] = "Content-type: image/jpg";
   }
 
+  headers[2] = CONNECTION_HEADER(connptr);
   http_message_add_headers(msg, headers, 3);
   http_message_set_body(msg, body, st.st_size);
   if ((ret = http_message_send(msg, connptr->client_fd)) != -1)
@@ -280,3 +288,14 @@ int pidfile_create(const char *filename)
   fclose(fd);
   return 0;
 }
+
+/*
+ * Milliseconds from a monotonic clock, for measuring intervals.
+ */
+long monotonic_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long) ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
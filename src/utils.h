@@ -31,4 +31,6 @@ extern int pidfile_create(const char *path);
 extern int create_file_safely(const char *filename, unsigned int truncate_file);
 extern int serve_local_file(struct conn_s *connptr, const char *filename);
 
+extern long monotonic_ms(void);
+
 #endif
@@ -0,0 +1,310 @@
+/* $Id$
+ *
+ * The worker mode lets a single child serve many connections at once.
+ * Each connection still runs through handle_connection(), but does so on
+ * a small stack of its own (a coroutine built with makecontext() and
+ * swapcontext()). Whenever a connection has to wait for the network it
+ * calls worker_poll(), which registers the descriptors with the epoll
+ * instance of the child and switches back to the dispatcher. The
+ * dispatcher sleeps in epoll_wait() and resumes the tasks whose
+ * descriptors became ready or whose timeout expired.
+ *
+ * Tasks are never preempted, so code running inside a task must not use
+ * blocking socket calls. Everything in the request path goes through
+ * safe_send(), safe_recv(), recvhead() and worker_poll() for that
+ * reason, and names are resolved by dns.c, which waits the same way.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include <sys/epoll.h>
+#include <ucontext.h>
+
+#include "log.h"
+#include "sock.h"
+#include "utils.h"
+#include "worker.h"
+
+/*
+ * Size of the stack of each task. The memory is only reserved here, the
+ * kernel hands out pages when they are touched for the first time.
+ */
+#define WORKER_STACK_SIZE (256 * 1024)
+
+/* Number of events fetched with a single epoll_wait() */
+#define WORKER_EVENTS 64
+
+/* epoll data used for the listening sockets */
+#define WORKER_LISTENER UINT64_C(-1)
+
+struct task_s {
+  ucontext_t ctx;
+  char *stack;
+
+  void (*func) (int);
+  int arg;
+
+  enum { TASK_FREE, TASK_READY, TASK_WAITING, TASK_DONE } state;
+
+  /* the descriptors passed to worker_poll() */
+  struct pollfd *fds;
+  nfds_t nfds;
+  int nready;
+  long deadline;		/* monotonic ms, -1 means no timeout */
+};
+
+static struct worker_s {
+  int epfd;
+  int maxtasks;
+  int ntasks;
+  int listening;
+  struct task_s *tasks;
+  struct task_s *current;	/* NULL while the dispatcher runs */
+  ucontext_t dispatcher;
+} worker;
+
+/*
+ * Allocate the task table and the epoll instance of this child.
+ */
+int worker_init(int maxtasks)
+{
+  assert(maxtasks > 0);
+
+  worker.tasks = calloc(maxtasks, sizeof(struct task_s));
+  if (!worker.tasks)
+    return -1;
+
+  if ((worker.epfd = epoll_create(maxtasks)) == -1) {
+    free(worker.tasks);
+    worker.tasks = NULL;
+    return -1;
+  }
+
+  worker.maxtasks = maxtasks;
+  worker.ntasks = 0;
+  worker.listening = FALSE;
+
+  return 0;
+}
+
+/*
+ * Start (or stop) watching the listening sockets for new connections.
+ */
+int worker_listen(int on)
+{
+  if (on == worker.listening)
+    return 0;
+
+  if (listeners_epoll(worker.epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+		      WORKER_LISTENER) < 0)
+    return -1;
+
+  worker.listening = on;
+  return 0;
+}
+
+/*
+ * Number of tasks currently running in this child
+ */
+int worker_tasks(void)
+{
+  return worker.ntasks;
+}
+
+static void task_main(int slot)
+{
+  struct task_s *t = &worker.tasks[slot];
+
+  t->func(t->arg);
+  t->state = TASK_DONE;
+
+  /* returning switches back to the dispatcher via uc_link */
+}
+
+/*
+ * Create a new task which runs func(arg). The task starts running with
+ * the next call to worker_dispatch().
+ */
+int worker_spawn(void (*func) (int), int arg)
+{
+  struct task_s *t = NULL;
+  int i;
+
+  for (i = 0; i != worker.maxtasks; i++) {
+    if (worker.tasks[i].state == TASK_FREE) {
+      t = &worker.tasks[i];
+      break;
+    }
+  }
+
+  if (!t)
+    return -1;
+
+  if (!t->stack) {
+    t->stack = mmap(NULL, WORKER_STACK_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (t->stack == MAP_FAILED) {
+      t->stack = NULL;
+      return -1;
+    }
+    /* a guard page turns a stack overflow into a segfault */
+    mprotect(t->stack, getpagesize(), PROT_NONE);
+  }
+
+  if (getcontext(&t->ctx) == -1)
+    return -1;
+
+  t->ctx.uc_stack.ss_sp = t->stack;
+  t->ctx.uc_stack.ss_size = WORKER_STACK_SIZE;
+  t->ctx.uc_link = &worker.dispatcher;
+  /* the slot from "t", "i" would have to survive getcontext() */
+  makecontext(&t->ctx, (void (*)(void)) task_main, 1,
+	      (int) (t - worker.tasks));
+
+  t->func = func;
+  t->arg = arg;
+  t->fds = NULL;
+  t->nfds = 0;
+  t->deadline = -1;
+  t->state = TASK_READY;
+
+  worker.ntasks++;
+  return 0;
+}
+
+/*
+ * See worker.h. The poll events share their values with the epoll
+ * events on Linux, so they are passed through unchanged.
+ */
+int worker_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  struct task_s *t = worker.current;
+  struct epoll_event ev;
+  nfds_t i;
+
+  if (!t)
+    return poll(fds, nfds, timeout);
+
+  t->nready = 0;
+  for (i = 0; i != nfds; i++) {
+    fds[i].revents = 0;
+    if (fds[i].fd < 0)
+      continue;
+
+    ev.events = fds[i].events;
+    ev.data.u64 = ((uint64_t) (t - worker.tasks) << 32) | i;
+    if (epoll_ctl(worker.epfd, EPOLL_CTL_ADD, fds[i].fd, &ev) == -1) {
+      /* regular files can not be watched, but never block either */
+      fds[i].revents = errno == EPERM ? fds[i].events : POLLNVAL;
+      t->nready++;
+    }
+  }
+
+  if (t->nready == 0 && timeout != 0) {
+    t->fds = fds;
+    t->nfds = nfds;
+    t->deadline = timeout < 0 ? -1 : monotonic_ms() + timeout;
+    t->state = TASK_WAITING;
+
+    swapcontext(&t->ctx, &worker.dispatcher);
+
+    t->fds = NULL;
+    t->nfds = 0;
+  }
+
+  for (i = 0; i != nfds; i++) {
+    if (fds[i].fd >= 0)
+      epoll_ctl(worker.epfd, EPOLL_CTL_DEL, fds[i].fd, &ev);
+  }
+
+  return t->nready;
+}
+
+/*
+ * Wait for events and run every task which is able to continue. Returns
+ * the number of tasks which have finished, "acceptable" is set if one of
+ * the listening sockets has a connection waiting.
+ */
+int worker_dispatch(int *acceptable)
+{
+  struct epoll_event events[WORKER_EVENTS];
+  struct task_s *t;
+  long now, timeout = -1;
+  int i, n, finished = 0;
+  uint32_t idx;
+
+  *acceptable = FALSE;
+
+  /* sleep no longer than until the nearest deadline */
+  now = monotonic_ms();
+  for (i = 0; i != worker.maxtasks; i++) {
+    t = &worker.tasks[i];
+    if (t->state == TASK_READY)
+      timeout = 0;
+    else if (t->state == TASK_WAITING && t->deadline != -1) {
+      long left = max(t->deadline - now, 0);
+      if (timeout == -1 || left < timeout)
+	timeout = left;
+    }
+  }
+
+  n = epoll_wait(worker.epfd, events, WORKER_EVENTS, (int) timeout);
+  if (n == -1) {
+    if (errno != EINTR)
+      log_message(LOG_ERR, "worker_dispatch: epoll_wait() %s",
+		  strerror(errno));
+    n = 0;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (events[i].data.u64 == WORKER_LISTENER) {
+      *acceptable = TRUE;
+      continue;
+    }
+
+    t = &worker.tasks[events[i].data.u64 >> 32];
+    idx = (uint32_t) events[i].data.u64;
+    if (!t->fds || idx >= t->nfds)
+      continue;
+
+    if (!t->fds[idx].revents)
+      t->nready++;
+    t->fds[idx].revents = (short) events[i].events;
+    t->state = TASK_READY;
+  }
+
+  now = monotonic_ms();
+  for (i = 0; i != worker.maxtasks; i++) {
+    t = &worker.tasks[i];
+    if (t->state == TASK_WAITING && t->deadline != -1 && t->deadline <= now)
+      t->state = TASK_READY;
+  }
+
+  for (i = 0; i != worker.maxtasks; i++) {
+    t = &worker.tasks[i];
+    if (t->state != TASK_READY)
+      continue;
+
+    worker.current = t;
+    swapcontext(&worker.dispatcher, &t->ctx);
+    worker.current = NULL;
+
+    if (t->state == TASK_DONE) {
+      t->state = TASK_FREE;
+      worker.ntasks--;
+      finished++;
+    }
+  }
+
+  return finished;
+}
@@ -0,0 +1,36 @@
+/* $Id$
+ *
+ * See 'worker.c' for a detailed description.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef TINYPROXY_WORKER_H
+#define TINYPROXY_WORKER_H
+
+#ifdef WORKER_SUPPORT
+extern int worker_init(int maxtasks);
+extern int worker_listen(int on);
+extern int worker_spawn(void (*func) (int), int arg);
+extern int worker_dispatch(int *acceptable);
+extern int worker_tasks(void);
+
+/*
+ * Drop-in replacement for poll(). Inside a worker task the calling task
+ * is suspended until one of the descriptors becomes ready, everywhere
+ * else this is a plain poll().
+ */
+extern int worker_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+#else
+#define worker_poll(fds, nfds, timeout) poll(fds, nfds, timeout)
+#endif
+
+#endif
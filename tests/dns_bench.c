@@ -0,0 +1,134 @@
+/* $Id$
+ *
+ * How long a lookup takes with and without the DNS cache. The cache is
+ * set up before the fork, like the proxy does for its children, and a
+ * child resolves COUNT names it has never seen (cold) and then the same
+ * names again (warm). Run it against 'fakedns.py', whose *.w.test names
+ * are answered right away and *.d.w.test names after 5 ms:
+ *
+ *	dns_bench ADDRESS PORT [COUNT [DOMAIN [CACHESIZE]]]
+ *
+ * CACHESIZE 0 turns the cache off.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include <sys/wait.h>
+
+#include "dns.h"
+#include "dnscache.h"
+#include "log.h"
+#include "sock.h"
+#include "stats.h"
+#include "utils.h"
+#include "worker.h"
+
+struct config_s config;
+
+void log_message(int level, char *fmt, ...)
+{
+}
+
+int update_stats(status_t update_level)
+{
+  return 0;
+}
+
+long monotonic_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long) ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+int socket_nonblocking(int sock)
+{
+  return fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+}
+
+#ifdef WORKER_SUPPORT
+int worker_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  return poll(fds, nfds, timeout);
+}
+#endif
+
+static long now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long) ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+/*
+ * Resolve the names 0 to "count" - 1 of "domain", returns the average
+ * time in microseconds or -1 if a lookup failed.
+ */
+static long run(const char *tag, int count, const char *domain)
+{
+  struct dns_result_s res;
+  char name[DNS_NAME_MAX + 1];
+  long start;
+  int i;
+
+  start = now_us();
+  for (i = 0; i < count; i++) {
+    snprintf(name, sizeof(name), "%s%d.%s.", tag, i, domain);
+    if (dns_resolve(name, 80, &res) != 0) {
+      fprintf(stderr, "%s: %s\n", name, dns_strerror(dns_resolve(name, 80,
+								  &res)));
+      return -1;
+    }
+  }
+  return (now_us() - start) / count;
+}
+
+int main(int argc, char **argv)
+{
+  const char *domain;
+  char tag[32];
+  long cold, warm;
+  int count, size, status;
+  pid_t pid;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s ADDRESS PORT [COUNT [DOMAIN [CACHESIZE]]]\n",
+	    argv[0]);
+    return 2;
+  }
+  count = argc > 3 ? atoi(argv[3]) : 500;
+  domain = argc > 4 ? argv[4] : "w.test";
+  size = argc > 5 ? atoi(argv[5]) : 1024;
+
+  config.dnstimeout = 5;
+  if (count <= 0 || dns_add_server(argv[1], atoi(argv[2])) < 0
+      || dns_cache_init(size) < 0)
+    return 2;
+
+  /* new names on every run, the nameserver may cache as well */
+  snprintf(tag, sizeof(tag), "b%ld-", (long) getpid());
+
+  if ((pid = fork()) == 0) {
+    if ((cold = run(tag, count, domain)) < 0
+	|| (warm = run(tag, count, domain)) < 0)
+      exit(1);
+    printf("%d names of %s, cache %d: cold %ld us, warm %ld us\n",
+	   count, domain, size, cold, warm);
+    exit(0);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) != pid)
+    return 1;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,174 @@
+/* $Id$
+ *
+ * Tests for the stub resolver (dns.c) against the stand-in nameserver in
+ * 'fakedns.py', see 'dns_test.sh' which starts both:
+ *
+ *	dns_test ADDRESS PORT		every answer the nameserver knows
+ *	dns_test ADDRESS PORT refused	nobody listens on PORT
+ *
+ * The names are resolved without the cache first, then with it. Prints a
+ * line for every check and exits with 1 if any of them failed.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tinyproxy-ex.h"
+
+#include "dns.h"
+#include "dnscache.h"
+#include "log.h"
+#include "sock.h"
+#include "stats.h"
+#include "utils.h"
+#include "worker.h"
+
+/* what the resolver needs from the rest of the program */
+struct config_s config;
+static int cache_hits;
+
+void log_message(int level, char *fmt, ...)
+{
+}
+
+int update_stats(status_t update_level)
+{
+  if (update_level == STAT_DNS_HIT)
+    cache_hits++;
+  return 0;
+}
+
+long monotonic_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long) ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+int socket_nonblocking(int sock)
+{
+  return fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+}
+
+#ifdef WORKER_SUPPORT
+int worker_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  return poll(fds, nfds, timeout);
+}
+#endif
+
+static int failed;
+
+/*
+ * Resolve "host" and compare the outcome: the error, the number of
+ * addresses (-1 for any), the first IPv4 address (or NULL), the TTL
+ * (-1 for any) and the time it may take at most.
+ */
+static void check(const char *host, int err, int count, const char *addr,
+		  int ttl, long maxms)
+{
+  struct dns_result_s res;
+  char buf[INET6_ADDRSTRLEN] = "-";
+  long ms;
+  int ret, i, ok;
+
+  ms = monotonic_ms();
+  ret = dns_resolve(host, 80, &res);
+  ms = monotonic_ms() - ms;
+
+  for (i = 0; i < res.count; i++) {
+    if (res.addr[i].sa.sa_family == AF_INET) {
+      inet_ntop(AF_INET, &res.addr[i].in.sin_addr, buf, sizeof(buf));
+      break;
+    }
+  }
+
+  ok = ret == err && (count < 0 || res.count == count)
+      && (!addr || strcmp(buf, addr) == 0)
+      && (ttl < 0 || res.ttl == (unsigned int) ttl) && ms <= maxms;
+  for (i = 0; ok && i < res.count; i++) {
+    if (ntohs(res.addr[i].in.sin_port) != 80)
+      ok = FALSE;
+  }
+
+  printf("%s %-16s %d (%s), %d addresses, first %s, ttl %u, %ld ms\n",
+	 ok ? "ok    " : "FAILED", host, ret, ret ? dns_strerror(ret) : "",
+	 res.count, buf, res.ttl, ms);
+  if (!ok)
+    failed = TRUE;
+}
+
+/*
+ * Resolve "host" twice with the cache on, the second answer must (or
+ * must not) come from the cache and be the same as the first.
+ */
+static void check_cached(const char *host, int err, int count, int ttl,
+			 int cached)
+{
+  int hits;
+
+  check(host, err, count, NULL, ttl, 500);
+  hits = cache_hits;
+  check(host, err, count, NULL, ttl, cached ? 10 : 500);
+  printf("%s %-16s %s\n", (cache_hits > hits) == cached ? "ok    " : "FAILED",
+	 host, cache_hits > hits ? "from the cache" : "not cached");
+  if ((cache_hits > hits) != cached)
+    failed = TRUE;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s ADDRESS PORT [refused]\n", argv[0]);
+    return 2;
+  }
+
+  config.dnstimeout = 2;
+  if (dns_add_server(argv[1], atoi(argv[2])) < 0) {
+    fprintf(stderr, "%s: bad nameserver %s\n", argv[0], argv[1]);
+    return 2;
+  }
+
+  /* the names end with a dot, so the search list never applies */
+  if (argc > 3 && strcmp(argv[3], "refused") == 0) {
+    /* the ICMP error ends the lookup, no waiting for the timeout */
+    check("origin.test.", DNS_EFAIL, 0, NULL, -1, 500);
+    return failed;
+  }
+
+  check("127.0.0.2", 0, 1, "127.0.0.2", -1, 10);
+  check("origin.test.", 0, 1, "127.0.0.1", 300, 500);
+  check("ORIGIN.test.", 0, 1, "127.0.0.1", 300, 500);
+  /* the lowest TTL along the chain counts */
+  check("alias.test.", 0, 1, "127.0.0.1", 120, 500);
+  check("v6.test.", 0, 2, "127.0.0.1", 30, 500);
+  /* truncated over UDP, asked again over TCP */
+  check("big.test.", 0, DNS_MAX_ADDRS / 2, "127.0.0.1", 300, 500);
+  /* kept as long as the SOA minimum says */
+  check("nx.test.", DNS_ENOTFOUND, 0, NULL, 60, 500);
+  check("fail.test.", DNS_EFAIL, 0, NULL, 0, 500);
+  check("refused.test.", DNS_EFAIL, 0, NULL, 0, 500);
+  /* the A answer does not wait long for the missing AAAA one */
+  check("slow6.test.", 0, 1, "127.0.0.1", 300, 500);
+  check("slow.test.", DNS_ETIMEDOUT, 0, NULL, 0,
+	config.dnstimeout * 1000L + 500);
+  check("bad..name.", DNS_EBADNAME, 0, NULL, -1, 10);
+
+  if (dns_cache_init(64) < 0)
+    return 1;
+  check_cached("alias.test.", 0, 1, 120, TRUE);
+  check_cached("big.test.", 0, DNS_MAX_ADDRS / 2, 300, TRUE);
+  /* names which do not exist are kept, failures are not */
+  check_cached("nx.test.", DNS_ENOTFOUND, 0, 60, TRUE);
+  check_cached("fail.test.", DNS_EFAIL, 0, 0, FALSE);
+
+  return failed;
+}
@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Run the resolver tests: start the stand-in nameserver on a free port,
+# run dns_test against it, and once more against a port nobody listens
+# on.
+#
+# usage: dns_test.sh DNS_TEST [PYTHON]
+
+TEST=${1:?usage: $0 DNS_TEST [PYTHON]}
+PYTHON=${2:-python3}
+DIR=$(dirname "$0")
+OUT=$(mktemp) || exit 1
+
+"$PYTHON" "$DIR/fakedns.py" > "$OUT" &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -f "$OUT"' EXIT
+
+# the server prints its port once it is ready
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  PORT=$(head -n 1 "$OUT")
+  [ -n "$PORT" ] && break
+  sleep 0.5
+done
+if [ -z "$PORT" ]; then
+  echo "the nameserver did not start" >&2
+  exit 1
+fi
+
+"$TEST" 127.0.0.1 "$PORT" || exit 1
+
+# the server is gone, its port refuses
+kill $SERVER
+wait $SERVER 2>/dev/null
+"$TEST" 127.0.0.1 "$PORT" refused || exit 1
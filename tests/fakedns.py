@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+#
+# A stand-in nameserver for the resolver tests. It answers on UDP and TCP
+# of the same port on 127.0.0.1 and prints the port once it is ready.
+# Every name under .test behaves in one particular way:
+#
+#   origin.test      A 127.0.0.1, TTL 300
+#   alias.test       CNAME origin.test, TTL 120, with the A of origin.test
+#   v6.test          A 127.0.0.1 and AAAA ::1
+#   big.test         truncated over UDP, 39 A records over TCP
+#   slow6.test       A 127.0.0.1, the AAAA query is never answered
+#   slow.test        no answer at all
+#   fail.test        SERVFAIL
+#   refused.test     REFUSED
+#   *.w.test         A 127.0.0.1, *.d.w.test after 5 ms
+#   anything else    NXDOMAIN with an SOA whose minimum is 60 seconds
+#
+# usage: fakedns.py [port]
+
+import socket
+import struct
+import sys
+import threading
+import time
+
+A, CNAME, SOA, AAAA = 1, 5, 6, 28
+NOERROR, SERVFAIL, NXDOMAIN, REFUSED = 0, 2, 3, 5
+
+
+def encode_name(name):
+    return b''.join(bytes([len(label)]) + label.encode()
+                    for label in name.rstrip('.').split('.') if label) + b'\0'
+
+
+def rr(name, rtype, ttl, rdata):
+    return encode_name(name) + struct.pack('>HHIH', rtype, 1, ttl,
+                                           len(rdata)) + rdata
+
+
+def inet(addr):
+    return socket.inet_aton(addr)
+
+
+def inet6(addr):
+    return socket.inet_pton(socket.AF_INET6, addr)
+
+
+def answer(query, tcp):
+    """The reply to "query", None to leave it unanswered."""
+    qid, = struct.unpack('>H', query[:2])
+    pos, labels = 12, []
+    while query[pos]:
+        labels.append(query[pos + 1:pos + 1 + query[pos]].decode())
+        pos += 1 + query[pos]
+    name = '.'.join(labels).lower()
+    qtype, = struct.unpack('>H', query[pos + 1:pos + 3])
+    question = query[12:pos + 5]
+
+    rcode, tc, an, ns = NOERROR, 0, [], []
+    if name == 'slow.test' or (name == 'slow6.test' and qtype == AAAA):
+        return None
+    elif name == 'fail.test':
+        rcode = SERVFAIL
+    elif name == 'refused.test':
+        rcode = REFUSED
+    elif name in ('origin.test', 'slow6.test'):
+        if qtype == A:
+            an = [rr(name, A, 300, inet('127.0.0.1'))]
+    elif name == 'alias.test':
+        an = [rr(name, CNAME, 120, encode_name('origin.test'))]
+        if qtype == A:
+            an.append(rr('origin.test', A, 300, inet('127.0.0.1')))
+    elif name == 'v6.test':
+        if qtype == A:
+            an = [rr(name, A, 30, inet('127.0.0.1'))]
+        else:
+            an = [rr(name, AAAA, 300, inet6('::1'))]
+    elif name == 'big.test':
+        if qtype == A and not tcp:
+            tc = 1
+        elif qtype == A:
+            an = [rr(name, A, 300, inet('127.0.0.%d' % i))
+                  for i in range(1, 40)]
+    elif name.endswith('.w.test'):
+        if name.endswith('.d.w.test'):
+            time.sleep(0.005)
+        if qtype == A:
+            an = [rr(name, A, 300, inet('127.0.0.1'))]
+    else:
+        rcode = NXDOMAIN
+        ns = [rr('test', SOA, 3600, encode_name('ns.test')
+                 + encode_name('root.test')
+                 + struct.pack('>IIIII', 1, 2, 3, 4, 60))]
+
+    header = struct.pack('>HHHHHH', qid, 0x8180 | (tc << 9) | rcode, 1,
+                         len(an), len(ns), 0)
+    return header + question + b''.join(an) + b''.join(ns)
+
+
+def serve_udp(sock):
+    while True:
+        query, peer = sock.recvfrom(512)
+        reply = answer(query, False)
+        if reply:
+            sock.sendto(reply, peer)
+
+
+def recv_all(conn, n):
+    data = b''
+    while len(data) < n:
+        chunk = conn.recv(n - len(data))
+        if not chunk:
+            break
+        data += chunk
+    return data
+
+
+def serve_tcp(sock):
+    while True:
+        conn, _ = sock.accept()
+        length, = struct.unpack('>H', recv_all(conn, 2))
+        reply = answer(recv_all(conn, length), True)
+        if reply:
+            conn.sendall(struct.pack('>H', len(reply)) + reply)
+        conn.close()
+
+
+def main():
+    udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    udp.bind(('127.0.0.1', int(sys.argv[1]) if len(sys.argv) > 1 else 0))
+    port = udp.getsockname()[1]
+
+    tcp = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    tcp.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    tcp.bind(('127.0.0.1', port))
+    tcp.listen(16)
+
+    threading.Thread(target=serve_tcp, args=(tcp,), daemon=True).start()
+    print(port, flush=True)
+    serve_udp(udp)
+
+
+if __name__ == '__main__':
+    main()